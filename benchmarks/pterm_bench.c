@@ -0,0 +1,596 @@
+// ------------------------------------------------------------------------------------
+// End-to-end benchmark of the rendering pipeline:
+// loadFile -> convertImage -> resizeImage -> text encoding
+//
+// The corpus consists of synthetic images of several sizes and formats
+// (written to a temporary directory) and the files in data/.
+//
+// -n   : number of iterations per file (default: 15)
+// -w   : output width in cells (default: 200)
+// -h   : output height in cells (default: 60)
+// -m   : render mode (ascii, background, quadrant, sextant, shape)
+// FILE : additional files to benchmark
+// ------------------------------------------------------------------------------------
+
+// --- Internal Includes ---
+#define PTERM_IMPLEMENTATION
+#include "pterm.h"
+
+// --- STL Includes ---
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef PTERM_DATA_DIR
+    #define PTERM_DATA_DIR "data"
+#endif
+
+
+#define BENCH_STAGE_COUNT 4
+const Char* benchStageNames[BENCH_STAGE_COUNT] = {"load", "decode", "resize", "encode"};
+
+
+struct benchParameters
+{
+    Int  numberOfIterations;
+    Int  columns;
+    Int  rows;
+    Int  renderMode;
+};
+
+typedef struct benchParameters BenchParameters;
+
+
+double benchNow()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+
+/// Peak resident set size in MiB (each file is benchmarked in its own process).
+double benchPeakRSS()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    #ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // <-- bytes on macOS
+    #else
+    return usage.ru_maxrss / 1024.0; // <-- kiB on Linux and the BSDs
+    #endif
+}
+
+
+int compareDoubles(const void* left, const void* right)
+{
+    double l = *(const double*) left, r = *(const double*) right;
+    return (l > r) - (l < r);
+}
+
+
+/// Nearest-rank percentile of sorted samples.
+double percentile(const double* sortedSamples, Int numberOfSamples, double fraction)
+{
+    Int rank = (Int)(fraction * numberOfSamples + 0.999999);
+    if (rank < 1) rank = 1;
+    if (numberOfSamples < rank) rank = numberOfSamples;
+    return sortedSamples[rank - 1];
+}
+
+
+// --- SYNTHETIC CORPUS --- //
+
+/// Gradients with a few discs and some noise, so that resizing and encoding see real edges.
+UChar* makeSyntheticImage(Int width, Int height)
+{
+    UChar* image = (UChar*) malloc((size_t)width * height * 4);
+    if (!image) {
+        printf("Error: failed to allocate synthetic %ix%i image\n", width, height);
+        exit(PTERM_MEMORY_ERROR);
+    }
+
+    UInt seed = 12345;
+    UChar* pixel = image;
+    for (Int y=0; y<height; ++y) {
+        for (Int x=0; x<width; ++x, pixel+=4) {
+            seed = seed * 1103515245u + 12345u;
+            Int noise = (seed >> 16) & 0x1F;
+
+            Int red   = (255 * x) / width;
+            Int green = (255 * y) / height;
+            Int blue  = 128;
+
+            for (Int disc=0; disc<4; ++disc) {
+                Int cx = (disc + 1) * width / 5, cy = (disc % 2 ? 1 : 2) * height / 3, r = height / 6;
+                if ((x-cx)*(x-cx) + (y-cy)*(y-cy) < r*r) {
+                    red   = 255 - red;
+                    blue  = 64 * disc;
+                }
+            }
+
+            pixel[0] = (UChar)(red   < 224 ? red + noise : red);
+            pixel[1] = (UChar)(green < 224 ? green + noise : green);
+            pixel[2] = (UChar) blue;
+            pixel[3] = 255;
+        }
+    }
+
+    return image;
+}
+
+
+void writeBytes(FILE* file, const void* data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size) {
+        puts("Error: failed to write synthetic image");
+        exit(PTERM_IO_ERROR);
+    }
+}
+
+
+void writeU32BE(FILE* file, UInt value)
+{
+    UChar bytes[4] = {(UChar)(value >> 24), (UChar)(value >> 16), (UChar)(value >> 8), (UChar) value};
+    writeBytes(file, bytes, 4);
+}
+
+
+void writeBMP(FILE* file, const UChar* image, Int width, Int height)
+{
+    UInt rowSize = (UInt) width * 3, padding = (4 - rowSize % 4) % 4;
+    UInt dataSize = (rowSize + padding) * height;
+    UChar header[54] = {'B', 'M'};
+    UInt fields[] = {54 + dataSize, 0, 54, 40, (UInt) width, (UInt) height};
+    for (Int i=0; i<6; ++i)
+        for (Int b=0; b<4; ++b)
+            header[2 + 4*i + b] = (UChar)(fields[i] >> (8*b));
+    header[26] = 1;  // <-- planes
+    header[28] = 24; // <-- bits per pixel
+    writeBytes(file, header, 54);
+
+    UChar* row = (UChar*) calloc(rowSize + padding, 1);
+    for (Int y=height-1; 0<=y; --y) {
+        for (Int x=0; x<width; ++x) {
+            const UChar* pixel = image + ((size_t)y * width + x) * 4;
+            row[3*x+0] = pixel[2];
+            row[3*x+1] = pixel[1];
+            row[3*x+2] = pixel[0];
+        }
+        writeBytes(file, row, rowSize + padding);
+    }
+    free(row);
+}
+
+
+void writeTGA(FILE* file, const UChar* image, Int width, Int height)
+{
+    UChar header[18] = {0, 0, 2}; // <-- uncompressed true color
+    header[12] = (UChar) width;  header[13] = (UChar)(width >> 8);
+    header[14] = (UChar) height; header[15] = (UChar)(height >> 8);
+    header[16] = 32;
+    header[17] = 0x28; // <-- top-left origin, 8 alpha bits
+    writeBytes(file, header, 18);
+
+    UChar* row = (UChar*) malloc((size_t)width * 4);
+    for (Int y=0; y<height; ++y) {
+        for (Int x=0; x<width; ++x) {
+            const UChar* pixel = image + ((size_t)y * width + x) * 4;
+            row[4*x+0] = pixel[2];
+            row[4*x+1] = pixel[1];
+            row[4*x+2] = pixel[0];
+            row[4*x+3] = pixel[3];
+        }
+        writeBytes(file, row, (size_t)width * 4);
+    }
+    free(row);
+}
+
+
+void writePPM(FILE* file, const UChar* image, Int width, Int height)
+{
+    fprintf(file, "P6\n%i %i\n255\n", width, height);
+    UChar* row = (UChar*) malloc((size_t)width * 3);
+    for (Int y=0; y<height; ++y) {
+        for (Int x=0; x<width; ++x) {
+            memcpy(row + 3*x, image + ((size_t)y * width + x) * 4, 3);
+        }
+        writeBytes(file, row, (size_t)width * 3);
+    }
+    free(row);
+}
+
+
+UInt crcTable[256];
+
+void initializeCRCTable()
+{
+    for (UInt n=0; n<256; ++n) {
+        UInt c = n;
+        for (Int k=0; k<8; ++k)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crcTable[n] = c;
+    }
+}
+
+
+UInt updateCRC(UInt crc, const UChar* data, size_t size)
+{
+    for (size_t i=0; i<size; ++i)
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+
+void writePNGChunk(FILE* file, const Char* type, const UChar* data, UInt size)
+{
+    writeU32BE(file, size);
+    writeBytes(file, type, 4);
+    if (size)
+        writeBytes(file, data, size);
+    UInt crc = updateCRC(0xFFFFFFFFu, (const UChar*) type, 4);
+    crc = updateCRC(crc, data, size);
+    writeU32BE(file, crc ^ 0xFFFFFFFFu);
+}
+
+
+/// RGBA PNG with stored (uncompressed) deflate blocks and "Sub" filtered rows.
+void writePNG(FILE* file, const UChar* image, Int width, Int height)
+{
+    const UChar signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    writeBytes(file, signature, 8);
+
+    UChar header[13];
+    header[0] = (UChar)(width >> 24);  header[1] = (UChar)(width >> 16);  header[2] = (UChar)(width >> 8);  header[3] = (UChar) width;
+    header[4] = (UChar)(height >> 24); header[5] = (UChar)(height >> 16); header[6] = (UChar)(height >> 8); header[7] = (UChar) height;
+    header[8]  = 8; // <-- bit depth
+    header[9]  = 6; // <-- RGBA
+    header[10] = header[11] = header[12] = 0;
+    writePNGChunk(file, "IHDR", header, 13);
+
+    // Filtered scanlines
+    const size_t rowSize = (size_t)width * 4 + 1;
+    const size_t rawSize = rowSize * height;
+    UChar* raw = (UChar*) malloc(rawSize);
+    for (Int y=0; y<height; ++y) {
+        UChar* row = raw + y * rowSize;
+        const UChar* source = image + (size_t)y * width * 4;
+        row[0] = 1; // <-- Sub
+        for (size_t i=0; i<(size_t)width*4; ++i)
+            row[1+i] = (UChar)(source[i] - (i < 4 ? 0 : source[i-4]));
+    }
+
+    // zlib stream of stored blocks
+    const size_t blockSize = 65535;
+    const size_t numberOfBlocks = (rawSize + blockSize - 1) / blockSize;
+    const size_t streamSize = 2 + rawSize + 5 * numberOfBlocks + 4;
+    UChar* stream = (UChar*) malloc(streamSize);
+    UChar* cursor = stream;
+    *cursor++ = 0x78;
+    *cursor++ = 0x01;
+
+    UInt adlerA = 1, adlerB = 0;
+    for (size_t offset=0; offset<rawSize; offset+=blockSize) {
+        size_t size = rawSize - offset < blockSize ? rawSize - offset : blockSize;
+        *cursor++ = offset + size == rawSize ? 1 : 0;
+        *cursor++ = (UChar) size;
+        *cursor++ = (UChar)(size >> 8);
+        *cursor++ = (UChar) ~size;
+        *cursor++ = (UChar)(~size >> 8);
+        memcpy(cursor, raw + offset, size);
+        cursor += size;
+
+        for (size_t i=0; i<size; ++i) {
+            adlerA = (adlerA + raw[offset + i]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+    }
+
+    UInt adler = (adlerB << 16) | adlerA;
+    *cursor++ = (UChar)(adler >> 24);
+    *cursor++ = (UChar)(adler >> 16);
+    *cursor++ = (UChar)(adler >> 8);
+    *cursor++ = (UChar) adler;
+
+    writePNGChunk(file, "IDAT", stream, (UInt) streamSize);
+    writePNGChunk(file, "IEND", NULL, 0);
+
+    free(stream);
+    free(raw);
+}
+
+
+/// Write the synthetic corpus to a temporary directory. The images are generated
+/// in a child process, so that they don't inflate the peak RSS of the benchmarks.
+Int makeSyntheticCorpus(Char* directory, Char*** fileNames)
+{
+    const Int sizes[][2] = {{320, 240}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+    const Char* formats[] = {".png", ".bmp", ".tga", ".ppm"};
+    const Int numberOfSizes = sizeof(sizes) / sizeof(sizes[0]);
+    const Int numberOfFormats = sizeof(formats) / sizeof(formats[0]);
+
+    if (!mkdtemp(directory)) {
+        printf("Error: failed to create corpus directory (%s)\n", strerror(errno));
+        exit(PTERM_ENVIRONMENT_ERROR);
+    }
+
+    initializeCRCTable();
+    *fileNames = (Char**) malloc(numberOfSizes * numberOfFormats * sizeof(Char*));
+    Int numberOfFiles = 0;
+
+    for (Int sizeIndex=0; sizeIndex<numberOfSizes; ++sizeIndex) {
+        for (Int formatIndex=0; formatIndex<numberOfFormats; ++formatIndex) {
+            Char* fileName = (Char*) malloc(strlen(directory) + 64);
+            sprintf(fileName, "%s/synthetic_%ix%i%s", directory, sizes[sizeIndex][0], sizes[sizeIndex][1], formats[formatIndex]);
+            (*fileNames)[numberOfFiles++] = fileName;
+        }
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        printf("Error: failed to fork (%s)\n", strerror(errno));
+        exit(PTERM_ENVIRONMENT_ERROR);
+    }
+
+    if (child) {
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != PTERM_SUCCESS)
+            exit(PTERM_IO_ERROR);
+        return numberOfFiles;
+    }
+
+    for (Int sizeIndex=0; sizeIndex<numberOfSizes; ++sizeIndex) {
+        const Int width = sizes[sizeIndex][0], height = sizes[sizeIndex][1];
+        UChar* image = makeSyntheticImage(width, height);
+
+        for (Int formatIndex=0; formatIndex<numberOfFormats; ++formatIndex) {
+            const Char* fileName = (*fileNames)[sizeIndex * numberOfFormats + formatIndex];
+            FILE* file = fopen(fileName, "wb");
+            if (!file) {
+                printf("Error: failed to create %s (%s)\n", fileName, strerror(errno));
+                exit(PTERM_IO_ERROR);
+            }
+
+            if (formatIndex == 0)      writePNG(file, image, width, height);
+            else if (formatIndex == 1) writeBMP(file, image, width, height);
+            else if (formatIndex == 2) writeTGA(file, image, width, height);
+            else                       writePPM(file, image, width, height);
+
+            fclose(file);
+        }
+
+        free(image);
+    }
+
+    exit(PTERM_SUCCESS);
+}
+
+
+// --- PIPELINE --- //
+
+UInt encodeFrame(const UChar* frame, UChar* output, UInt outputSize, Int width, Int height, Int renderMode)
+{
+    if (renderMode == PTERM_RENDER_QUADRANT || renderMode == PTERM_RENDER_SEXTANT)
+        return _blockTextFromImageInMemory(frame, output, width, height, 4, renderMode);
+
+    if (renderMode == PTERM_RENDER_SHAPE)
+        _shapeTextFromImageInMemory(frame, output, width, height, 4);
+    else
+        _textFromImageInMemory(frame, output, width, height, 4, renderMode == PTERM_RENDER_BACKGROUND);
+
+    return outputSize - 1;
+}
+
+
+void _benchmarkFile(const Char* fileName, const BenchParameters* parameters)
+{
+    const Int numberOfIterations = parameters->numberOfIterations;
+    double* samples = (double*) malloc(BENCH_STAGE_COUNT * numberOfIterations * sizeof(double));
+
+    Int imageWidth = 0, imageHeight = 0, numberOfFrames = 0, width = 0, height = 0;
+    UInt outputBytes = 0;
+
+    for (Int iteration=0; iteration<numberOfIterations; ++iteration) {
+        Int numberOfChannels = 0, numberOfSourceChannels = 0;
+        Int* delays = NULL;
+
+        // Load
+        double begin = benchNow();
+        UInt fileSize = 0;
+        UChar* data = loadFile(fileName, &fileSize);
+        double loaded = benchNow();
+
+        // Decode
+        Int conversionOutput = convertImage(&data, fileSize, fileExtension(fileName), &numberOfFrames, &delays,
+                                            &imageWidth, &imageHeight, &numberOfSourceChannels, &numberOfChannels);
+        double decoded = benchNow();
+
+        if (conversionOutput != PTERM_SUCCESS) {
+            printf("%-40s failed to decode (%i)\n", fileName, conversionOutput);
+            free(samples);
+            return;
+        }
+
+        // Resize: same geometry as the command line tool
+        width  = imageWidth;
+        height = imageHeight / 2;
+        fitImageSize(&width, &height, parameters->columns, parameters->rows);
+        if (width < 1) width = 1;
+        if (height < 1) height = 1;
+
+        Int cellColumns = 1, cellRows = 1;
+        getCellResolution(parameters->renderMode, &cellColumns, &cellRows);
+        const Int sampledWidth = width * cellColumns, sampledHeight = height * cellRows;
+
+        const size_t frameSize = (size_t)imageWidth * imageHeight * 4;
+        const size_t resizedFrameSize = (size_t)sampledWidth * sampledHeight * 4;
+        UChar* resized = (UChar*) malloc(resizedFrameSize * numberOfFrames);
+
+        double resizeBegin = benchNow();
+        for (Int frameIndex=0; frameIndex<numberOfFrames; ++frameIndex) {
+            resizeImage(data + frameIndex * frameSize, resized + frameIndex * resizedFrameSize,
+                        imageWidth, imageHeight, 4, sampledWidth, sampledHeight);
+        }
+        double resizeEnd = benchNow();
+
+        // Encode
+        UInt outputSize = 0;
+        UChar* output = NULL;
+        if (parameters->renderMode == PTERM_RENDER_QUADRANT || parameters->renderMode == PTERM_RENDER_SEXTANT)
+            allocateBlockTextImage(&output, &outputSize, width, height);
+        else
+            allocateANSITextImage(&output, &outputSize, width, height);
+
+        double encodeBegin = benchNow();
+        outputBytes = 0;
+        for (Int frameIndex=0; frameIndex<numberOfFrames; ++frameIndex) {
+            outputBytes += encodeFrame(resized + frameIndex * resizedFrameSize, output, outputSize,
+                                       width, height, parameters->renderMode);
+        }
+        double encodeEnd = benchNow();
+
+        samples[0 * numberOfIterations + iteration] = loaded - begin;
+        samples[1 * numberOfIterations + iteration] = decoded - loaded;
+        samples[2 * numberOfIterations + iteration] = resizeEnd - resizeBegin;
+        samples[3 * numberOfIterations + iteration] = encodeEnd - encodeBegin;
+
+        free(output);
+        free(resized);
+        free(data);
+        free(delays);
+    }
+
+    const double sourcePixels = (double)imageWidth * imageHeight * numberOfFrames;
+    const double cells = (double)width * height * numberOfFrames;
+
+    const Char* baseName = fileName;
+    for (const Char* it=fileName; *it; ++it)
+        if (*it == '/') baseName = it + 1;
+
+    for (Int stage=0; stage<BENCH_STAGE_COUNT; ++stage) {
+        double* stageSamples = samples + stage * numberOfIterations;
+        qsort(stageSamples, numberOfIterations, sizeof(double), compareDoubles);
+        const double median = percentile(stageSamples, numberOfIterations, 0.5);
+        const double p99    = percentile(stageSamples, numberOfIterations, 0.99);
+
+        printf("%-28s %5ix%-5i %4i %-7s %10.3f %10.3f %10.1f %10.2f %8.2f %9.1f\n",
+               baseName,
+               imageWidth,
+               imageHeight,
+               numberOfFrames,
+               benchStageNames[stage],
+               1e3 * median,
+               1e3 * p99,
+               sourcePixels / median * 1e-6,
+               cells / median * 1e-6,
+               outputBytes / cells,
+               benchPeakRSS());
+    }
+
+    free(samples);
+}
+
+
+/// Run the benchmark of a file in a child process to get its own peak RSS.
+void benchmarkFile(const Char* fileName, const BenchParameters* parameters)
+{
+    fflush(stdout);
+    pid_t child = fork();
+
+    if (child < 0) {
+        printf("Error: failed to fork (%s)\n", strerror(errno));
+        exit(PTERM_ENVIRONMENT_ERROR);
+    }
+
+    if (!child) {
+        _benchmarkFile(fileName, parameters);
+        fflush(stdout);
+        exit(PTERM_SUCCESS);
+    }
+
+    waitpid(child, NULL, 0);
+}
+
+
+int main(int argc, char const* argv[])
+{
+    BenchParameters parameters;
+    parameters.numberOfIterations = 15;
+    parameters.columns            = 200;
+    parameters.rows               = 60;
+    parameters.renderMode         = PTERM_RENDER_ASCII;
+
+    Char** extraFiles = (Char**) malloc(argc * sizeof(Char*));
+    Int numberOfExtraFiles = 0;
+
+    for (Int i=1; i<argc; ++i) {
+        if (argv[i][0] == '-' && i + 1 < argc) {
+            const Char flag = argv[i][1];
+            const Char* value = argv[++i];
+            if (flag == 'n') {
+                parameters.numberOfIterations = atoi(value);
+            } else if (flag == 'w') {
+                parameters.columns = atoi(value);
+            } else if (flag == 'h') {
+                parameters.rows = atoi(value);
+            } else if (flag == 'm') {
+                if      (strcmp(value, "ascii") == 0)      parameters.renderMode = PTERM_RENDER_ASCII;
+                else if (strcmp(value, "background") == 0) parameters.renderMode = PTERM_RENDER_BACKGROUND;
+                else if (strcmp(value, "quadrant") == 0)   parameters.renderMode = PTERM_RENDER_QUADRANT;
+                else if (strcmp(value, "sextant") == 0)    parameters.renderMode = PTERM_RENDER_SEXTANT;
+                else if (strcmp(value, "shape") == 0)      parameters.renderMode = PTERM_RENDER_SHAPE;
+                else {
+                    printf("Error: unknown render mode: %s\n", value);
+                    return PTERM_ARGUMENT_ERROR;
+                }
+            } else {
+                printf("Error: unrecognized argument: %s\n", argv[i-1]);
+                return PTERM_ARGUMENT_ERROR;
+            }
+        } else if (argv[i][0] != '-') {
+            extraFiles[numberOfExtraFiles++] = (Char*) argv[i];
+        } else {
+            printf("Error: expecting a value after %s\n", argv[i]);
+            return PTERM_ARGUMENT_ERROR;
+        }
+    }
+
+    if (parameters.numberOfIterations < 1 || parameters.columns < 1 || parameters.rows < 1) {
+        puts("Error: iterations, width and height must be positive");
+        return PTERM_ARGUMENT_ERROR;
+    }
+
+    Char directory[] = "/tmp/pterm_bench_XXXXXX";
+    Char** corpus = NULL;
+    const Int numberOfSyntheticFiles = makeSyntheticCorpus(directory, &corpus);
+
+    printf("%-28s %11s %4s %-7s %10s %10s %10s %10s %8s %9s\n",
+           "file", "size", "frms", "stage", "median[ms]", "p99[ms]", "MPix/s", "Mcells/s", "B/cell", "RSS[MiB]");
+
+    for (Int fileIndex=0; fileIndex<numberOfSyntheticFiles; ++fileIndex)
+        benchmarkFile(corpus[fileIndex], &parameters);
+
+    const Char* dataFiles[] = {PTERM_DATA_DIR "/code_doge.jpg", PTERM_DATA_DIR "/02.gif"};
+    for (UInt fileIndex=0; fileIndex<sizeof(dataFiles)/sizeof(dataFiles[0]); ++fileIndex) {
+        struct stat status;
+        if (stat(dataFiles[fileIndex], &status) == 0)
+            benchmarkFile(dataFiles[fileIndex], &parameters);
+    }
+
+    for (Int fileIndex=0; fileIndex<numberOfExtraFiles; ++fileIndex)
+        benchmarkFile(extraFiles[fileIndex], &parameters);
+
+    // Clean up the corpus
+    for (Int fileIndex=0; fileIndex<numberOfSyntheticFiles; ++fileIndex) {
+        remove(corpus[fileIndex]);
+        free(corpus[fileIndex]);
+    }
+    remove(directory);
+    free(corpus);
+    free(extraFiles);
+
+    return PTERM_SUCCESS;
+}
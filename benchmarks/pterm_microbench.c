@@ -0,0 +1,342 @@
+// ------------------------------------------------------------------------------------
+// Microbenchmarks of the per-cell encoder primitives
+//
+// Each primitive is called in batches over randomized inputs that fit in the cache.
+// Batches are repeated after a warm-up, and the median and minimum cost per call
+// are reported in nanoseconds and CPU cycles (perf_event_open if permitted,
+// otherwise the time stamp counter).
+//
+// -c   : CPU to pin the benchmark to (default: the current one)
+// -r   : number of repetitions per primitive (default: 200)
+// -w   : image width in cells for the encoder loops (default: 200)
+// -h   : image height in cells for the encoder loops (default: 60)
+// ------------------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+
+// --- Internal Includes ---
+#define PTERM_IMPLEMENTATION
+#include "pterm.h"
+
+// --- STL Includes ---
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define MICROBENCH_RDTSC
+#endif
+
+
+// Number of calls per batch
+#define MICROBENCH_BATCH_SIZE 4096
+
+// Keeps the compiler from discarding results
+volatile UInt microbenchSink = 0;
+
+
+double microbenchNow()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+
+// --- CYCLE COUNTER --- //
+
+Int cycleCounter = -1;  // <-- perf event file descriptor, -1 if unavailable
+
+
+const Char* openCycleCounter()
+{
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type           = PERF_TYPE_HARDWARE;
+    attributes.size           = sizeof(attributes);
+    attributes.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attributes.disabled       = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv     = 1;
+
+    cycleCounter = (Int) syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+    if (0 <= cycleCounter) {
+        ioctl(cycleCounter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cycleCounter, PERF_EVENT_IOC_ENABLE, 0);
+        return "perf_event_open";
+    }
+
+    #ifdef MICROBENCH_RDTSC
+    return "rdtsc";
+    #else
+    return "none";
+    #endif
+}
+
+
+unsigned long long readCycles()
+{
+    if (0 <= cycleCounter) {
+        unsigned long long cycles = 0;
+        if (read(cycleCounter, &cycles, sizeof(cycles)) == sizeof(cycles))
+            return cycles;
+    }
+
+    #ifdef MICROBENCH_RDTSC
+    return __rdtsc();
+    #else
+    return 0;
+    #endif
+}
+
+
+// --- HARNESS --- //
+
+typedef void (*MicrobenchTask)(void* context);
+
+int compareDoubles(const void* left, const void* right)
+{
+    double l = *(const double*) left, r = *(const double*) right;
+    return (l > r) - (l < r);
+}
+
+
+/// Time task over the requested number of repetitions (after a warm-up), and
+/// print the median and minimum cost of a single item.
+void runMicrobench(const Char* name, MicrobenchTask task, void* context, UInt itemsPerCall, Int numberOfRepetitions, const Char* unit)
+{
+    double* nanoseconds = (double*) malloc(numberOfRepetitions * sizeof(double));
+    double* cycles      = (double*) malloc(numberOfRepetitions * sizeof(double));
+
+    // Warm up caches and branch predictors
+    for (Int repetition=0; repetition<numberOfRepetitions/10+1; ++repetition)
+        task(context);
+
+    for (Int repetition=0; repetition<numberOfRepetitions; ++repetition) {
+        unsigned long long cycleBegin = readCycles();
+        double begin = microbenchNow();
+        task(context);
+        double end = microbenchNow();
+        unsigned long long cycleEnd = readCycles();
+
+        nanoseconds[repetition] = (end - begin) * 1e9 / itemsPerCall;
+        cycles[repetition]      = (double)(cycleEnd - cycleBegin) / itemsPerCall;
+    }
+
+    qsort(nanoseconds, numberOfRepetitions, sizeof(double), compareDoubles);
+    qsort(cycles, numberOfRepetitions, sizeof(double), compareDoubles);
+
+    printf("%-32s %12.3f %12.3f %12.2f %12.2f   per %s\n",
+           name,
+           nanoseconds[numberOfRepetitions / 2],
+           nanoseconds[0],
+           cycles[numberOfRepetitions / 2],
+           cycles[0],
+           unit);
+
+    free(nanoseconds);
+    free(cycles);
+}
+
+
+// --- PRIMITIVES --- //
+
+typedef struct
+{
+    UChar* pixels;          // <-- MICROBENCH_BATCH_SIZE random RGBA pixels
+    UInt*  indices;         // <-- random pixel indices for getPixel
+    UChar* scratch;         // <-- MICROBENCH_BATCH_SIZE ANSI codes
+} PrimitiveContext;
+
+
+void benchAnsiColorCode(void* p_context)
+{
+    PrimitiveContext* context = (PrimitiveContext*) p_context;
+    const UChar* pixel = context->pixels;
+    UChar* cursor = context->scratch;
+    for (UInt i=0; i<MICROBENCH_BATCH_SIZE; ++i, pixel+=4, cursor+=ansiColorSize)
+        ansiColorCode(pixel[0], pixel[1], pixel[2], cursor, pixel[3] & 1);
+    microbenchSink += context->scratch[MICROBENCH_BATCH_SIZE * ansiColorSize - 2];
+}
+
+
+void benchAnsiPadding(void* p_context)
+{
+    PrimitiveContext* context = (PrimitiveContext*) p_context;
+    UChar* cursor = context->scratch;
+    for (UInt i=0; i<MICROBENCH_BATCH_SIZE; ++i, cursor+=ansiColorSize)
+        ansiPadding(cursor);
+    microbenchSink += context->scratch[MICROBENCH_BATCH_SIZE * ansiColorSize - 2];
+}
+
+
+void benchGetPixel(void* p_context)
+{
+    PrimitiveContext* context = (PrimitiveContext*) p_context;
+    UChar pixel[4];
+    UInt checksum = 0;
+    for (UInt i=0; i<MICROBENCH_BATCH_SIZE; ++i) {
+        UInt index = context->indices[i];
+        getPixel(context->pixels, pixel, index / 64, index % 64, 64, MICROBENCH_BATCH_SIZE / 64, 4);
+        checksum += pixel[0] ^ pixel[3];
+    }
+    microbenchSink += checksum;
+}
+
+
+void benchGetASCIIFromRGB(void* p_context)
+{
+    PrimitiveContext* context = (PrimitiveContext*) p_context;
+    const UChar* pixel = context->pixels;
+    UInt checksum = 0;
+    for (UInt i=0; i<MICROBENCH_BATCH_SIZE; ++i, pixel+=4)
+        checksum += getASCIIFromRGB(pixel[0], pixel[1], pixel[2]);
+    microbenchSink += checksum;
+}
+
+
+// --- ENCODER LOOPS --- //
+
+typedef struct
+{
+    UChar* image;
+    UChar* output;
+    UInt   width;
+    UInt   height;
+    Int    renderMode;
+} EncoderContext;
+
+
+void benchEncoder(void* p_context)
+{
+    EncoderContext* context = (EncoderContext*) p_context;
+    if (context->renderMode == PTERM_RENDER_QUADRANT || context->renderMode == PTERM_RENDER_SEXTANT) {
+        _blockTextFromImageInMemory(context->image, context->output, context->width, context->height, 4, context->renderMode);
+    } else if (context->renderMode == PTERM_RENDER_SHAPE) {
+        _shapeTextFromImageInMemory(context->image, context->output, context->width, context->height, 4);
+    } else {
+        _textFromImageInMemory(context->image, context->output, context->width, context->height, 4, context->renderMode == PTERM_RENDER_BACKGROUND);
+    }
+    microbenchSink += context->output[0];
+}
+
+
+UChar* makeRandomPixels(UInt numberOfPixels, UInt* seed)
+{
+    UChar* pixels = (UChar*) malloc(numberOfPixels * 4);
+    if (!pixels) {
+        puts("Error: failed to allocate random pixels");
+        exit(PTERM_MEMORY_ERROR);
+    }
+
+    for (UInt i=0; i<4*numberOfPixels; ++i) {
+        *seed = *seed * 1103515245u + 12345u;
+        pixels[i] = (UChar)(*seed >> 16);
+    }
+
+    // Make about one pixel in 16 transparent, like the edges of a sprite
+    for (UInt i=0; i<numberOfPixels; ++i)
+        pixels[4*i+3] = (pixels[4*i+3] & 0xF) ? 255 : 0;
+
+    return pixels;
+}
+
+
+int main(int argc, char const* argv[])
+{
+    Int cpu = sched_getcpu(), numberOfRepetitions = 200;
+    UInt width = 200, height = 60;
+
+    for (Int i=1; i<argc; i+=2) {
+        if (argv[i][0] != '-') {
+            printf("Error: unrecognized argument: %s\n", argv[i]);
+            return PTERM_ARGUMENT_ERROR;
+        }
+        if (i+1 == argc) {
+            printf("Error: expecting a value after %s\n", argv[i]);
+            return PTERM_ARGUMENT_ERROR;
+        }
+
+        const Int value = atoi(argv[i+1]);
+        if      (argv[i][1] == 'c') cpu = value;
+        else if (argv[i][1] == 'r') numberOfRepetitions = value;
+        else if (argv[i][1] == 'w') width = (UInt) value;
+        else if (argv[i][1] == 'h') height = (UInt) value;
+        else {
+            printf("Error: unrecognized argument: %s\n", argv[i]);
+            return PTERM_ARGUMENT_ERROR;
+        }
+    }
+
+    if (numberOfRepetitions < 1 || !width || !height) {
+        puts("Error: repetitions, width and height must be positive");
+        return PTERM_ARGUMENT_ERROR;
+    }
+
+    // Pin to a single CPU, and keep the encoders on it
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        printf("Warning: failed to pin to CPU %i (%s)\n", cpu, strerror(errno));
+    numberOfWorkerThreads = 1;
+
+    const Char* counterName = openCycleCounter();
+    printf("CPU %i, cycles from %s, %i repetitions\n\n", cpu, counterName, numberOfRepetitions);
+    printf("%-32s %12s %12s %12s %12s\n", "primitive", "median[ns]", "min[ns]", "median[cyc]", "min[cyc]");
+
+    UInt seed = 2023;
+
+    // Primitives
+    PrimitiveContext primitives;
+    primitives.pixels  = makeRandomPixels(MICROBENCH_BATCH_SIZE, &seed);
+    primitives.indices = (UInt*) malloc(MICROBENCH_BATCH_SIZE * sizeof(UInt));
+    primitives.scratch = (UChar*) malloc(MICROBENCH_BATCH_SIZE * ansiColorSize);
+    for (UInt i=0; i<MICROBENCH_BATCH_SIZE; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        primitives.indices[i] = (seed >> 8) % MICROBENCH_BATCH_SIZE;
+    }
+
+    runMicrobench("ansiColorCode", benchAnsiColorCode, &primitives, MICROBENCH_BATCH_SIZE, numberOfRepetitions, "call");
+    runMicrobench("ansiPadding", benchAnsiPadding, &primitives, MICROBENCH_BATCH_SIZE, numberOfRepetitions, "call");
+    runMicrobench("getPixel", benchGetPixel, &primitives, MICROBENCH_BATCH_SIZE, numberOfRepetitions, "call");
+    runMicrobench("getASCIIFromRGB", benchGetASCIIFromRGB, &primitives, MICROBENCH_BATCH_SIZE, numberOfRepetitions, "call");
+
+    // Whole encoder loops
+    const Int renderModes[] = {PTERM_RENDER_ASCII, PTERM_RENDER_BACKGROUND, PTERM_RENDER_QUADRANT, PTERM_RENDER_SEXTANT, PTERM_RENDER_SHAPE};
+    const Char* names[] = {"_textFromImageInMemory", "_textFromImageInMemory (-b)", "_blockText (quadrant)", "_blockText (sextant)", "_shapeTextFromImageInMemory"};
+
+    for (UInt modeIndex=0; modeIndex<sizeof(renderModes)/sizeof(renderModes[0]); ++modeIndex) {
+        Int cellColumns = 1, cellRows = 1;
+        getCellResolution(renderModes[modeIndex], &cellColumns, &cellRows);
+
+        EncoderContext encoder;
+        encoder.width      = width;
+        encoder.height     = height;
+        encoder.renderMode = renderModes[modeIndex];
+        encoder.image      = makeRandomPixels(width * height * cellColumns * cellRows, &seed);
+
+        UInt outputSize = 0;
+        if (1 < cellColumns * cellRows && renderModes[modeIndex] != PTERM_RENDER_SHAPE)
+            allocateBlockTextImage(&encoder.output, &outputSize, width, height);
+        else
+            allocateANSITextImage(&encoder.output, &outputSize, width, height);
+
+        runMicrobench(names[modeIndex], benchEncoder, &encoder, width * height, numberOfRepetitions, "cell");
+
+        free(encoder.image);
+        free(encoder.output);
+    }
+
+    free(primitives.pixels);
+    free(primitives.indices);
+    free(primitives.scratch);
+    if (0 <= cycleCounter)
+        close(cycleCounter);
+
+    return PTERM_SUCCESS;
+}
@@ -2,6 +2,19 @@
 // Yet another program that 'draws' on the terminal
 //
 // -b   : color background instead of colored ASCII characters
+// -m   : render mode (ascii, background, quadrant, sextant, shape)
+// -p   : play animations in place on the alternate screen
+// -j   : number of files rendered in parallel (batch mode: several files, a directory or a glob)
+// -g   : lay out the batch inputs as a grid of thumbnails with the given width
+// --stats[=json] : print stage timings and counters to stderr
+// --trace <file> : record the pipeline in Chrome/Perfetto trace-event format
+// --cache[=<file>] : reuse downscaled images from a persistent thumbnail cache
+// --preview[=refine] : only decode the first passes of progressive JPEGs and interlaced PNGs
+// --watch : redraw the image whenever the terminal is resized
+// --view : pan and zoom around the image with the keyboard
+// -t y4m|rgba : play raw video frames from stdin (--video-size=WxH for rgba, --framerate=N)
+// -t png-stream|ppm-stream : play concatenated PNG or PPM/PGM images from stdin as they arrive
+// --serve <socket> : render the images requested over a Unix domain socket, from memory caches
 // ------------------------------------------------------------------------------------
 
 // --- Internal Includes ---
@@ -11,12 +24,30 @@
 // --- STL Includes ---
 #include <time.h>
 #include <stdio.h>
+#include <signal.h>
 
 #if _WIN32
     #include <windows.h>    // <-- for getting the terminal's size in windows
+    #define STDIN_FILENO  0
+    #define STDOUT_FILENO 1
 #else
     #include <sys/ioctl.h>  // <--
     #include <unistd.h>     // <-- for getting the terminal's size on linux
+    #include <sys/resource.h> // <-- for peak memory statistics
+    #include <sys/stat.h>
+    #include <dirent.h>     // <-- for listing directories in batch mode
+    #include <glob.h>
+    #include <strings.h>
+    #include <termios.h>    // <-- raw key input in the viewer
+    #include <sys/select.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/socket.h> // <-- render server
+    #include <sys/un.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/signalfd.h>
 #endif
 
 
@@ -54,17 +85,57 @@ void printHelp()
     puts("[-h <height>] output height");
     puts("[-t <file type>] file type if reading from stdin");
     puts("[-b] color background instead of ASCII characters");
+    puts("[-m <mode>] render mode: ascii, background, quadrant, sextant or shape");
+    puts("[-p] play animations in place on the alternate screen");
+    puts("[-j <jobs>] render several files, directories or globs in parallel (first frame of each)");
+    puts("[-g <tile width>] show the files as a grid of thumbnails that fills the output width");
+    puts("[--stats[=json]] print stage timings and counters to stderr");
+    puts("[--trace <file>] write a Chrome/Perfetto trace of the pipeline");
+    puts("[--cache[=<file>]] reuse downscaled images across runs (default: ~/.cache/pterm/thumbnails)");
+    puts("[--preview[=refine]] show the early passes of progressive/interlaced images (then redraw in full)");
+    puts("[--watch] fit the image to the terminal and redraw it whenever the terminal is resized (until interrupted)");
+    puts("[--view] pan (arrows, hjkl) and zoom (+, -) around the image until q is pressed");
+    puts("[-t y4m|rgba] play a stream of raw video frames (e.g. from ffmpeg) in place");
+    puts("[-t png-stream|ppm-stream] play back-to-back PNG or binary PPM/PGM images (e.g. from ffmpeg -f image2pipe) in place");
+    puts("[--video-size=<width>x<height>] size of raw RGBA frames");
+    puts("[--serve <socket>] answer \"<width>x<height> <mode> <path>\" requests on a Unix socket (width or height may be 0)");
+    puts("[--framerate=<fps>] presentation rate of video streams (default: the Y4M header, or as fast as frames arrive)");
 }
 
 
 struct parameters
 {
     char* fileName;
+    char** fileNames;       // <-- batch inputs (files, directories or globs)
+    Int   numberOfFileNames;
     char* extension;
+    char* mode;
+    char* traceFileName;
+    char* cacheFileName;
+    char* socketName;       // <-- render server if set
+    Bool  cache;
+    Bool  preview;          // <-- stop decoding after the early passes of progressive images
+    Bool  refine;           // <-- redraw the preview in place once the full image is decoded
+    Bool  watch;            // <-- redraw on SIGWINCH
+    Bool  view;             // <-- interactive pan/zoom viewer
+    Bool  isStream;         // <-- raw video frames (see VideoStream)
+    Int   streamFormat;
+    Int   videoWidth;       // <-- size of raw RGBA frames
+    Int   videoHeight;
+    double frameRate;       // <-- frames per second of video streams (0: from the stream)
     Bool  backgroundOnly;
+    Bool  playback;
+    Bool  stats;
+    Bool  statsJSON;
+    Int   renderMode;
     Bool  isGIF;
+    Bool  isBatch;
+    Int   numberOfJobs;
+    Int   tileWidth;        // <-- gallery mode if set
     Int   width;
     Int   height;
+    Int   terminalWidth;    // <-- cached terminal size (0 if not queried yet)
+    Int   terminalHeight;
 };
 
 typedef struct parameters Parameters;
@@ -73,11 +144,36 @@ typedef struct parameters Parameters;
 void initializeParameters(Parameters* p_parameters)
 {
     p_parameters->fileName       = NULL;
+    p_parameters->fileNames      = NULL;
+    p_parameters->numberOfFileNames = 0;
     p_parameters->extension      = NULL;
+    p_parameters->mode           = NULL;
+    p_parameters->traceFileName  = NULL;
+    p_parameters->cacheFileName  = NULL;
+    p_parameters->socketName     = NULL;
+    p_parameters->cache          = PTERM_FALSE;
+    p_parameters->preview        = PTERM_FALSE;
+    p_parameters->refine         = PTERM_FALSE;
+    p_parameters->watch          = PTERM_FALSE;
+    p_parameters->view           = PTERM_FALSE;
+    p_parameters->isStream       = PTERM_FALSE;
+    p_parameters->streamFormat   = PTERM_VIDEO_RGBA;
+    p_parameters->videoWidth     = 0;
+    p_parameters->videoHeight    = 0;
+    p_parameters->frameRate      = 0.0;
     p_parameters->backgroundOnly = PTERM_FALSE;
+    p_parameters->playback       = PTERM_FALSE;
+    p_parameters->stats          = PTERM_FALSE;
+    p_parameters->statsJSON      = PTERM_FALSE;
+    p_parameters->renderMode     = PTERM_RENDER_ASCII;
     p_parameters->isGIF          = PTERM_FALSE;
+    p_parameters->isBatch        = PTERM_FALSE;
+    p_parameters->numberOfJobs   = 0;
+    p_parameters->tileWidth      = 0;
     p_parameters->width          = 0;
     p_parameters->height         = 0;
+    p_parameters->terminalWidth  = 0;
+    p_parameters->terminalHeight = 0;
 }
 
 
@@ -91,46 +187,37 @@ Int parseInteger(const char* p_string)
 
 void readPipe(UChar** content, UInt* size)
 {
-    const UInt chunkSize = 1024;
-    UInt bufferSize = 1;
-
-    // Initial allocation
-    *size = 0;
-    *content = (UChar*) malloc(bufferSize * sizeof(UChar));
+    *content = readFileDescriptor(STDIN_FILENO, size);
     if (!*content) {
-        puts("Error: failed to allocate initial memory for reading stdin");
-        exit(PTERM_MEMORY_ERROR);
+        puts("Error: failed to read stdin");
+        exit(PTERM_INPUT_ERROR);
     }
+}
 
-    UChar* begin = *content;
 
-    // Read loop
-    while(PTERM_TRUE) {
-        // Extend memory if necessary
-        if (bufferSize <= (unsigned long)(begin - *content)) {
-            UChar* tmp = *content;
-            bufferSize += chunkSize;
-            *content = (UChar*) realloc(*content, bufferSize * sizeof(UChar));
-            if (!*content) {
-                printf("Error: failed to extend memory while reading stdin (%ub)", *size);
-                free(tmp);
-                exit(PTERM_MEMORY_ERROR);
-            }
-            begin = (*content) + (begin - tmp);
-        }
+/// Check whether an input names several files (a directory or a glob pattern).
+Bool isBatchInput(const Char* fileName)
+{
+    #ifndef _WIN32
+    struct stat status;
+    if (strpbrk(fileName, "*?[") || (stat(fileName, &status) == 0 && S_ISDIR(status.st_mode)))
+        return PTERM_TRUE;
+    #endif
+    return PTERM_FALSE;
+}
+
 
-        // Read stdin
-        UChar c = (UChar) getchar();
-        if (!feof(stdin))
-        {
-            *begin = c;
-            ++begin;
+/// Look up a render mode by its name (false if there is no such mode).
+Bool parseRenderMode(const Char* name, Int* renderMode)
+{
+    const Char* modeNames[] = {"ascii", "background", "quadrant", "sextant", "shape"}; // <-- indexed by PTERM_RENDER_*
+    for (Int modeIndex=0; modeIndex<5; ++modeIndex) {
+        if (strcmp(name, modeNames[modeIndex]) == 0) {
+            *renderMode = modeIndex;
+            return PTERM_TRUE;
         }
-        else
-            break;
     }
-
-    *size = begin - *content;
+    return PTERM_FALSE;
 }
 
 
@@ -143,14 +230,19 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
     Int* intArguments[] = {
         NULL,
         &p_parameters->width,
-        &p_parameters->height
+        &p_parameters->height,
+        &p_parameters->numberOfJobs,
+        &p_parameters->tileWidth
     };
 
     int stringFlag = NULL_FLAG;
     Char** stringArguments[] = {
         NULL,
         &p_parameters->fileName,
-        &p_parameters->extension
+        &p_parameters->extension,
+        &p_parameters->mode,
+        &p_parameters->traceFileName,
+        &p_parameters->socketName
     };
 
     // Parse arguments
@@ -170,8 +262,14 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
                 copyString(argv[i], stringArguments[stringFlag]);
                 stringFlag = NULL_FLAG;
                 continue;
-            } else { // no flag set before value => must be file name
-                copyString(argv[i], &p_parameters->fileName);
+            } else { // no flag set before value => must be a file name
+                Char** fileNames = (Char**) realloc(p_parameters->fileNames, (p_parameters->numberOfFileNames + 1) * sizeof(Char*));
+                if (!fileNames) {
+                    puts("Error: failed to allocate memory for file names");
+                    return PTERM_FALSE;
+                }
+                p_parameters->fileNames = fileNames;
+                copyString(argv[i], p_parameters->fileNames + p_parameters->numberOfFileNames++);
                 continue;
             }
         } else { // flag argument
@@ -182,10 +280,75 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
             }
 
             token = argv[i][1];
+            if (token == '-') { // long flags
+                if (strcmp(argv[i], "--stats") == 0) {
+                    p_parameters->stats = PTERM_TRUE;
+                    continue;
+                }
+                if (strcmp(argv[i], "--stats=json") == 0) {
+                    p_parameters->stats = PTERM_TRUE;
+                    p_parameters->statsJSON = PTERM_TRUE;
+                    continue;
+                }
+                if (strcmp(argv[i], "--trace") == 0) { // trace file => expecting a string value
+                    stringFlag = 4;
+                    continue;
+                }
+                if (strcmp(argv[i], "--serve") == 0) { // socket path => expecting a string value
+                    stringFlag = 5;
+                    continue;
+                }
+                if (strcmp(argv[i], "--cache") == 0) {
+                    p_parameters->cache = PTERM_TRUE;
+                    continue;
+                }
+                if (strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8]) {
+                    p_parameters->cache = PTERM_TRUE;
+                    copyString(argv[i] + 8, &p_parameters->cacheFileName);
+                    continue;
+                }
+                if (strcmp(argv[i], "--preview") == 0) {
+                    p_parameters->preview = PTERM_TRUE;
+                    continue;
+                }
+                if (strcmp(argv[i], "--preview=refine") == 0) {
+                    p_parameters->preview = PTERM_TRUE;
+                    p_parameters->refine  = PTERM_TRUE;
+                    continue;
+                }
+                if (strcmp(argv[i], "--watch") == 0) {
+                    p_parameters->watch = PTERM_TRUE;
+                    continue;
+                }
+                if (strcmp(argv[i], "--view") == 0) {
+                    p_parameters->view = PTERM_TRUE;
+                    continue;
+                }
+                if (strncmp(argv[i], "--video-size=", 13) == 0) {
+                    if (sscanf(argv[i] + 13, "%ix%i", &p_parameters->videoWidth, &p_parameters->videoHeight) != 2
+                        || p_parameters->videoWidth <= 0 || p_parameters->videoHeight <= 0) {
+                        printf("Error: invalid video size: %s\n", argv[i] + 13);
+                        return PTERM_FALSE;
+                    }
+                    continue;
+                }
+                if (strncmp(argv[i], "--framerate=", 12) == 0) {
+                    p_parameters->frameRate = strtod(argv[i] + 12, NULL);
+                    if (p_parameters->frameRate <= 0.0) {
+                        printf("Error: invalid frame rate: %s\n", argv[i] + 12);
+                        return PTERM_FALSE;
+                    }
+                    continue;
+                }
+            }
             if (token == 'b') { // flag: backgroundOnly
                 p_parameters->backgroundOnly = PTERM_TRUE;
                 continue;
             }
+            if (token == 'p') { // flag: playback
+                p_parameters->playback = PTERM_TRUE;
+                continue;
+            }
             if (token == 'w') { // width => expecting an integer value
                 intFlag = 1;
                 continue;
@@ -198,6 +361,18 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
                 stringFlag = 2;
                 continue;
             }
+            if(token == 'm') { // render mode => expecting a string value
+                stringFlag = 3;
+                continue;
+            }
+            if (token == 'j') { // number of jobs => expecting an integer value
+                intFlag = 3;
+                continue;
+            }
+            if (token == 'g') { // gallery tile width => expecting an integer value
+                intFlag = 4;
+                continue;
+            }
         }
 
         // Unhandled
@@ -206,6 +381,89 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
     } // for argc
 
     // Postprocess
+    if (p_parameters->tileWidth < 0) {
+        printf("Error: invalid tile width: %i\n", p_parameters->tileWidth);
+        return PTERM_FALSE;
+    }
+
+    if (p_parameters->numberOfFileNames == 1 && !p_parameters->tileWidth && !isBatchInput(p_parameters->fileNames[0])) {
+        p_parameters->fileName = p_parameters->fileNames[0];
+        free(p_parameters->fileNames);
+        p_parameters->fileNames = NULL;
+        p_parameters->numberOfFileNames = 0;
+    } else if (p_parameters->numberOfFileNames) {
+        p_parameters->isBatch = PTERM_TRUE;
+    }
+
+    if (p_parameters->isBatch && p_parameters->extension) {
+        puts("Error: cannot specify both file names and extension");
+        return PTERM_FALSE;
+    }
+
+    if (p_parameters->tileWidth && !p_parameters->isBatch) {
+        puts("Error: gallery mode needs input files");
+        return PTERM_FALSE;
+    }
+
+    if (p_parameters->tileWidth && p_parameters->height) {
+        puts("Error: the height of a gallery is set by its number of files");
+        return PTERM_FALSE;
+    }
+
+    if (p_parameters->isBatch && (p_parameters->playback || p_parameters->stats || p_parameters->preview)) {
+        puts("Error: playback, statistics and previews are not available when rendering several files");
+        return PTERM_FALSE;
+    }
+
+    if (p_parameters->watch) {
+        #ifdef _WIN32
+        puts("Error: watch mode is not available on Windows");
+        return PTERM_FALSE;
+        #endif
+        if (p_parameters->isBatch || p_parameters->playback || p_parameters->preview) {
+            puts("Error: watch mode shows a single still image (no batches, playback or previews)");
+            return PTERM_FALSE;
+        }
+        if (p_parameters->width || p_parameters->height) {
+            puts("Error: watch mode fits the image to the terminal (no width or height)");
+            return PTERM_FALSE;
+        }
+    }
+
+    if (p_parameters->view) {
+        #ifdef _WIN32
+        puts("Error: the viewer is not available on Windows");
+        return PTERM_FALSE;
+        #endif
+        if (p_parameters->isBatch || p_parameters->playback || p_parameters->preview || p_parameters->watch) {
+            puts("Error: the viewer shows a single still image (no batches, playback, previews or watch mode)");
+            return PTERM_FALSE;
+        }
+        if (p_parameters->width || p_parameters->height) {
+            puts("Error: the viewer fits the image to the terminal (no width or height)");
+            return PTERM_FALSE;
+        }
+    }
+
+    if (p_parameters->socketName) {
+        #ifndef __linux__
+        puts("Error: the server is only available on Linux");
+        return PTERM_FALSE;
+        #endif
+        if (p_parameters->fileName || p_parameters->isBatch || p_parameters->extension || p_parameters->mode
+            || p_parameters->backgroundOnly || p_parameters->width || p_parameters->height || p_parameters->playback
+            || p_parameters->preview || p_parameters->watch || p_parameters->view || p_parameters->cache
+            || p_parameters->stats || p_parameters->traceFileName) {
+            puts("Error: the server takes the file, size and mode from each request (no inputs, sizes, modes, playback, previews, watch mode, viewer, caches, statistics or traces)");
+            return PTERM_FALSE;
+        }
+    }
+
+    if (p_parameters->numberOfJobs < 0) {
+        printf("Error: invalid number of jobs: %i\n", p_parameters->numberOfJobs);
+        return PTERM_FALSE;
+    }
+
     if (p_parameters->fileName && p_parameters->extension) {
         puts("Error: cannot specify both file name and extension");
         return PTERM_FALSE;
@@ -220,6 +478,21 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
         return PTERM_FALSE;
     }
 
+    if (p_parameters->backgroundOnly) {
+        p_parameters->renderMode = PTERM_RENDER_BACKGROUND;
+    }
+
+    if (p_parameters->mode) {
+        if (!parseRenderMode(p_parameters->mode, &p_parameters->renderMode)) {
+            printf("Error: unknown render mode: %s\n", p_parameters->mode);
+            return PTERM_FALSE;
+        }
+
+        p_parameters->backgroundOnly = p_parameters->renderMode == PTERM_RENDER_BACKGROUND;
+        free(p_parameters->mode);
+        p_parameters->mode = NULL;
+    }
+
     if (!p_parameters->extension) {
         if (p_parameters->fileName) {
             p_parameters->extension = strdup(fileExtension(p_parameters->fileName));
@@ -229,10 +502,155 @@ Bool parseArguments(int argc, const char* argv[], Parameters* p_parameters)
         }
     }
 
+    // Video streams are played in place as they are read
+    const Char* format = p_parameters->extension[0] == '.' ? p_parameters->extension + 1 : p_parameters->extension;
+    const Char* streamFormats[] = {"rgba", "y4m", "png-stream", "ppm-stream"}; // <-- indexed by PTERM_VIDEO_*
+    for (Int formatIndex=0; formatIndex<4; ++formatIndex) {
+        if (strcmp(format, streamFormats[formatIndex]) == 0) {
+            p_parameters->isStream     = PTERM_TRUE;
+            p_parameters->streamFormat = formatIndex;
+        }
+    }
+
+    if (p_parameters->isStream) {
+        if (p_parameters->isBatch || p_parameters->preview || p_parameters->watch || p_parameters->view) {
+            puts("Error: video streams are played in place (no batches, previews, watch mode or viewer)");
+            return PTERM_FALSE;
+        }
+    }
+
+    if ((p_parameters->isStream && p_parameters->streamFormat == PTERM_VIDEO_RGBA) != (0 < p_parameters->videoWidth)) {
+        puts("Error: raw RGBA video (-t rgba) needs --video-size=<width>x<height>, and only it does");
+        return PTERM_FALSE;
+    }
+
+    if (p_parameters->frameRate && !p_parameters->isStream) {
+        puts("Error: the frame rate only applies to video streams (-t y4m, rgba, png-stream or ppm-stream)");
+        return PTERM_FALSE;
+    }
+
     return PTERM_TRUE;
 }
 
 
+/// Restore the main screen if playback is interrupted.
+void onPlaybackInterrupt(int signalNumber)
+{
+    struct iovec chunks[2] = {
+        {(void*) ansiColorReset, ansiColorResetSize},
+        {(void*) ansiLeavePlayback, ansiLeavePlaybackSize}
+    };
+    writeChunks(STDOUT_FILENO, chunks, 2);
+    signal(signalNumber, SIG_DFL);
+    raise(signalNumber);
+}
+
+
+/// Print collected pipeline statistics to stderr.
+void printStats(const PipelineStats* stats, Bool json)
+{
+    const Char* stageNames[PTERM_STAGE_COUNT] = {"read", "decode", "resize", "encode", "write"};
+
+    double peakMemory = 0.0; // <-- MiB
+    #ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        #ifdef __APPLE__
+        peakMemory = usage.ru_maxrss / (1024.0 * 1024.0); // <-- bytes on macOS
+        #else
+        peakMemory = usage.ru_maxrss / 1024.0; // <-- kiB elsewhere
+        #endif
+    }
+    #endif
+
+    // Hardware counters are normalized by the number of encoded cells
+    const double cells = stats->cellsEncoded ? (double) stats->cellsEncoded : 1.0;
+
+    if (json) {
+        fputs("{\"stages\":{", stderr);
+        for (Int stage=0; stage<PTERM_STAGE_COUNT; ++stage) {
+            const unsigned long long* counters = stats->stageCounters[stage];
+            fprintf(stderr, "%s\"%s\":{\"ms\":%.3f,\"calls\":%u",
+                    stage ? "," : "",
+                    stageNames[stage],
+                    1e3 * stats->stageSeconds[stage],
+                    stats->stageCalls[stage]);
+            if (stats->hasCounters) {
+                fprintf(stderr, ",\"cycles\":%llu,\"instructions\":%llu,\"cacheMisses\":%llu,\"branchMisses\":%llu",
+                        counters[PTERM_COUNTER_CYCLES],
+                        counters[PTERM_COUNTER_INSTRUCTIONS],
+                        counters[PTERM_COUNTER_CACHE_MISSES],
+                        counters[PTERM_COUNTER_BRANCH_MISSES]);
+            }
+            fputc('}', stderr);
+        }
+        fprintf(stderr,
+                "},\"bytesRead\":%llu,\"bytesWritten\":%llu,\"cellsEncoded\":%llu,"
+                "\"framesRendered\":%u,\"framesLate\":%u,\"framesDropped\":%u,\"framesMerged\":%u,"
+                "\"maxLatenessMs\":%.3f,\"peakMemoryMiB\":%.1f}\n",
+                stats->bytesRead,
+                stats->bytesWritten,
+                stats->cellsEncoded,
+                stats->framesRendered,
+                stats->framesLate,
+                stats->framesDropped,
+                stats->framesMerged,
+                1e3 * stats->maximumLateness,
+                peakMemory);
+    } else {
+        fputs("pterm stats\n", stderr);
+        for (Int stage=0; stage<PTERM_STAGE_COUNT; ++stage) {
+            fprintf(stderr, "  %-8s %12.3f ms  (%u calls)\n",
+                    stageNames[stage],
+                    1e3 * stats->stageSeconds[stage],
+                    stats->stageCalls[stage]);
+        }
+        fprintf(stderr, "  bytes read     %llu\n", stats->bytesRead);
+        fprintf(stderr, "  bytes written  %llu\n", stats->bytesWritten);
+        fprintf(stderr, "  cells encoded  %llu\n", stats->cellsEncoded);
+        fprintf(stderr, "  frames         %u rendered, %u late (max %.3f ms), %u dropped, %u merged\n",
+                stats->framesRendered,
+                stats->framesLate,
+                1e3 * stats->maximumLateness,
+                stats->framesDropped,
+                stats->framesMerged);
+        fprintf(stderr, "  peak memory    %.1f MiB\n", peakMemory);
+
+        if (stats->hasCounters) {
+            fputs("  counters          IPC  cycles/cell  cache misses/cell  branch misses/cell\n", stderr);
+            for (Int stage=0; stage<PTERM_STAGE_COUNT; ++stage) {
+                const unsigned long long* counters = stats->stageCounters[stage];
+                if (!stats->stageCalls[stage])
+                    continue;
+                fprintf(stderr, "  %-8s %11.2f %12.1f %18.3f %19.3f\n",
+                        stageNames[stage],
+                        counters[PTERM_COUNTER_CYCLES] ? (double) counters[PTERM_COUNTER_INSTRUCTIONS] / counters[PTERM_COUNTER_CYCLES] : 0.0,
+                        counters[PTERM_COUNTER_CYCLES] / cells,
+                        counters[PTERM_COUNTER_CACHE_MISSES] / cells,
+                        counters[PTERM_COUNTER_BRANCH_MISSES] / cells);
+            }
+        }
+    }
+}
+
+
+/// Get the terminal size once and cache it in the parameters.
+void queryTerminalSize(Parameters* p_parameters)
+{
+    if (p_parameters->terminalWidth && p_parameters->terminalHeight)
+        return;
+
+    getTerminalSize(&p_parameters->terminalWidth, &p_parameters->terminalHeight);
+
+    if (p_parameters->terminalWidth <= 0 || p_parameters->terminalHeight <= 0) {
+        printf("Error: invalid terminal size: %ix%i\n", p_parameters->terminalHeight, p_parameters->terminalWidth);
+        exit(PTERM_ENVIRONMENT_ERROR);
+    }
+
+    PTERM_DEBUG_PRINTF("Detected %ix%i terminal\n", p_parameters->terminalWidth, p_parameters->terminalHeight);
+}
+
+
 void getFinalImageSize(Parameters* p_parameters, Int originalWidth, Int originalHeight)
 {
     Int targetWidth = originalWidth, targetHeight = originalHeight;
@@ -249,14 +667,9 @@ void getFinalImageSize(Parameters* p_parameters, Int originalWidth, Int original
             targetHeight = p_parameters->height;
         }
     } else { // no requested size => fit to terminal size
-        getTerminalSize(&targetWidth, &targetHeight);
-
-        if (!targetWidth || !targetHeight) {
-            printf("Error: invalid terminal size: %ix%i\n", targetHeight, targetWidth);
-            exit(PTERM_ENVIRONMENT_ERROR);
-        }
-
-        PTERM_DEBUG_PRINTF("Detected %ix%i terminal\n", targetWidth, targetHeight);
+        queryTerminalSize(p_parameters);
+        targetWidth  = p_parameters->terminalWidth;
+        targetHeight = p_parameters->terminalHeight;
     }
 
     p_parameters->width = originalWidth;
@@ -266,153 +679,2988 @@ void getFinalImageSize(Parameters* p_parameters, Int originalWidth, Int original
 
 
 
-int main(int argc, char const* argv[])
+/** Decode an image for display at the output size of the parameters.
+ *  The output size is worked out from the image header first (and stored in the parameters),
+ *  so that large JPEGs can be decoded at a reduced scale that still covers it, and oversized
+ *  images are rejected before any pixels are decoded.
+ */
+Int decodeImage(Parameters* p_parameters,
+                UChar** data,
+                UInt size,
+                const Char* extension,
+                Int* numberOfFrames,
+                Int** delays,
+                Int* width,
+                Int* height,
+                Int* numberOfSourceChannels,
+                Int* numberOfChannels)
 {
-    // Init
-    Parameters parameters;
-    initializeParameters(&parameters);
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(p_parameters->renderMode, &cellColumns, &cellRows);
+
+    Int headerWidth = 0, headerHeight = 0, headerChannels = 0, minimumWidth = 0, minimumHeight = 0;
+    const Bool hasHeader = probeImage(*data, size, &headerWidth, &headerHeight, &headerChannels) == PTERM_SUCCESS; // <-- oversized images are rejected by convertImageScaled
+    if (hasHeader) {
+        getFinalImageSize(p_parameters, headerWidth, headerHeight);
+        minimumWidth  = p_parameters->width * cellColumns;
+        minimumHeight = p_parameters->height * cellRows;
+    }
 
-    if (!parseArguments(argc, argv, &parameters)) {
-        printHelp();
-        return PTERM_ARGUMENT_ERROR;
+    Int conversionOutput = convertImageScaled(data,
+                                              size,
+                                              extension,
+                                              minimumWidth,
+                                              minimumHeight,
+                                              numberOfFrames,
+                                              delays,
+                                              width,
+                                              height,
+                                              numberOfSourceChannels,
+                                              numberOfChannels);
+
+    if (conversionOutput == PTERM_SUCCESS && !hasHeader) {
+        getFinalImageSize(p_parameters, *width, *height);
     }
 
-    // Read image (and convert to RGB if necessary)
-    Int imageWidth=0, imageHeight=0, numberOfChannels=0, numberOfSourceChannels=0, numberOfFrames=0;
-    Int* delays = NULL;
+    return conversionOutput;
+}
 
-    UChar* data = NULL;
-    if (parameters.fileName) {
-        data = loadImageFile(parameters.fileName,
-                             &numberOfFrames,
-                             &delays,
-                             &imageWidth,
-                             &imageHeight,
-                             &numberOfSourceChannels,
-                             &numberOfChannels);
-    } else if (parameters.extension) {
-        UInt size = 0;
-        readPipe(&data, &size);
-        Int conversionOutput = convertImage(&data,
-                                            size,
-                                            parameters.extension,
-                                            &numberOfFrames,
-                                            &delays,
-                                            &imageWidth,
-                                            &imageHeight,
-                                            &numberOfSourceChannels,
-                                            &numberOfChannels);
-
-        if (conversionOutput != PTERM_SUCCESS) {
-            printf("Error: failed to convert image from stdin (%i)\n", conversionOutput);
-            exit(conversionOutput);
-        }
-    } else {
-        puts("Error: no input");
-        printHelp();
-        exit(PTERM_INPUT_ERROR);
-    }
 
-    if (parameters.fileName) {
-        free(parameters.fileName);
-        parameters.fileName = NULL;
+/** Decode a PNG file beyond PTERM_STREAMING_PIXELS straight into an image of the output size of the
+ *  parameters, one scanline at a time (see @ref{openPNGStream}). Such images are not loaded into memory,
+ *  so they can exceed PTERM_MAX_IMAGE_PIXELS. Returns PTERM_FAIL, without touching the outputs, for other files.
+ */
+Int streamImageFile(Parameters* p_parameters,
+                    const Char* fileName,
+                    UChar** data,
+                    Int* numberOfFrames,
+                    Int** delays,
+                    Int* width,
+                    Int* height,
+                    Int* numberOfSourceChannels,
+                    Int* numberOfChannels)
+{
+    #ifdef _WIN32
+    FILE* file = _stricmp(fileExtension(fileName), ".png") == 0 ? fopen(fileName, "rb") : NULL;
+    #else
+    FILE* file = strcasecmp(fileExtension(fileName), ".png") == 0 ? fopen(fileName, "rb") : NULL;
+    #endif
+    if (!file)
+        return PTERM_FAIL;
+
+    #ifdef _WIN32
+    Int fileDescriptor = _fileno(file);
+    #else
+    Int fileDescriptor = fileno(file);
+    #endif
+
+    Int imageWidth = 0, imageHeight = 0;
+    PNGStream* stream = openPNGStream(fileDescriptor, &imageWidth, &imageHeight);
+    if (!stream || (unsigned long long) imageWidth * imageHeight <= PTERM_STREAMING_PIXELS) {
+        closePNGStream(stream);
+        fclose(file);
+        return PTERM_FAIL;
     }
 
-    if (parameters.extension) {
-        free(parameters.extension);
-        parameters.extension = NULL;
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(p_parameters->renderMode, &cellColumns, &cellRows);
+
+    Parameters parameters = *p_parameters;
+    getFinalImageSize(&parameters, imageWidth, imageHeight);
+    const Int sampledWidth  = 0 < parameters.width ? parameters.width * cellColumns : 1;
+    const Int sampledHeight = 0 < parameters.height ? parameters.height * cellRows : 1;
+    const Int streamedWidth  = sampledWidth < imageWidth ? sampledWidth : imageWidth;
+    const Int streamedHeight = sampledHeight < imageHeight ? sampledHeight : imageHeight;
+
+    UChar* image = (UChar*) malloc((size_t) streamedWidth * streamedHeight * 4);
+    Int* frameDelays = (Int*) calloc(1, sizeof(Int));
+    Int result = image && frameDelays ? decodePNGStream(stream, image, streamedWidth, streamedHeight) : PTERM_MEMORY_ERROR;
+    closePNGStream(stream);
+    fclose(file);
+
+    if (result != PTERM_SUCCESS) {
+        free(image);
+        free(frameDelays);
+        return result;
     }
 
-    if (numberOfChannels != 4) {
-        PTERM_DEBUG_PRINTF("Error: invalid number of channels (%i)\n", numberOfChannels);
-        exit(PTERM_FAIL);
+    p_parameters->width     = parameters.width;
+    p_parameters->height    = parameters.height;
+    *data                   = image;
+    *numberOfFrames         = 1;
+    *delays                 = frameDelays;
+    *width                  = streamedWidth;
+    *height                 = streamedHeight;
+    *numberOfSourceChannels = 4;
+    *numberOfChannels       = 4;
+    return PTERM_SUCCESS;
+}
+
+
+/// Read and decode an image file (see @ref{decodeImage}).
+UChar* loadImage(Parameters* p_parameters,
+                 const Char* fileName,
+                 Int* numberOfFrames,
+                 Int** delays,
+                 Int* width,
+                 Int* height,
+                 Int* numberOfSourceChannels,
+                 Int* numberOfChannels)
+{
+    UChar* data = NULL;
+    if (streamImageFile(p_parameters,
+                        fileName,
+                        &data,
+                        numberOfFrames,
+                        delays,
+                        width,
+                        height,
+                        numberOfSourceChannels,
+                        numberOfChannels) == PTERM_SUCCESS) {
+        return data;
     }
 
-    // Get target image sizes
-    getFinalImageSize(&parameters, imageWidth, imageHeight);
+    UInt size = 0;
+    data = loadFile(fileName, &size);
+    if (!data) {
+        return NULL;
+    }
 
-    UChar* frame = data;
-    UChar* resizedImage;
-    UChar* resizedFrame;
-    UInt resizedFrameSize = parameters.width * parameters.height * numberOfChannels;
+    Int conversionOutput = decodeImage(p_parameters,
+                                       &data,
+                                       size,
+                                       fileExtension(fileName),
+                                       numberOfFrames,
+                                       delays,
+                                       width,
+                                       height,
+                                       numberOfSourceChannels,
+                                       numberOfChannels);
+
+    return conversionOutput == PTERM_SUCCESS ? data : NULL;
+}
 
-    // Resize frames if necessary
-    if (parameters.width!=imageWidth || parameters.height!=imageHeight) {
-        resizedImage = (UChar*) malloc(resizedFrameSize * numberOfFrames);
-        resizedFrame = resizedImage;
 
-        if (!resizedImage) {
-            printf("Error: failed to allocate memory for resized image (%ib)", resizedFrameSize * numberOfFrames);
-            exit(PTERM_MEMORY_ERROR);
+/// Encode an RGBA image of the output size of the parameters (the output is not null-terminated).
+Int encodeImage(const Parameters* p_parameters, const UChar* image, UChar** output, UInt* outputSize)
+{
+    const Int numberOfChannels = 4;
+
+    if (p_parameters->renderMode == PTERM_RENDER_QUADRANT || p_parameters->renderMode == PTERM_RENDER_SEXTANT) {
+        allocateBlockTextImage(output, outputSize, p_parameters->width, p_parameters->height);
+        if (*output) {
+            *outputSize = _blockTextFromImageInMemory(image,
+                                                      *output,
+                                                      p_parameters->width,
+                                                      p_parameters->height,
+                                                      numberOfChannels,
+                                                      p_parameters->renderMode);
         }
+    } else {
+        allocateANSITextImage(output, outputSize, p_parameters->width, p_parameters->height);
+        if (*output) {
+            if (p_parameters->renderMode == PTERM_RENDER_SHAPE) {
+                _shapeTextFromImageInMemory(image, *output, p_parameters->width, p_parameters->height, numberOfChannels);
+            } else {
+                _textFromImageInMemory(image, *output, p_parameters->width, p_parameters->height, numberOfChannels, p_parameters->backgroundOnly);
+            }
+            --*outputSize; // <-- skip \0
+        }
+    }
 
-        UInt frameSize = imageWidth*imageHeight*numberOfChannels;
-        for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex, frame+=frameSize, resizedFrame+=resizedFrameSize) {
-            Int resizeOutput = resizeImage(
-                frame,
-                resizedFrame,
-                imageWidth,
-                imageHeight,
-                numberOfChannels,
-                parameters.width,
-                parameters.height
-            );
+    return *output ? PTERM_SUCCESS : PTERM_MEMORY_ERROR;
+}
 
-            if (resizeOutput)
-                exit(resizeOutput);
+
+/** Decode the early passes of a progressive JPEG or an interlaced PNG (see @ref{decodePreview}).
+ *  Returns true if the preview is the image to render (no refinement requested, or nothing was skipped).
+ *  Otherwise the preview, if there is one, is written right away and @p isRefining is set:
+ *  the caller decodes the full image and redraws it in place.
+ */
+Bool previewImage(Parameters* p_parameters,
+                  UChar** data,
+                  UInt size,
+                  Int* numberOfFrames,
+                  Int** delays,
+                  Int* width,
+                  Int* height,
+                  Int* numberOfSourceChannels,
+                  Int* numberOfChannels,
+                  Bool* isRefining)
+{
+    Int headerWidth = 0, headerHeight = 0, headerChannels = 0;
+    if (probeImage(*data, size, &headerWidth, &headerHeight, &headerChannels) != PTERM_SUCCESS)
+        return PTERM_FALSE;
+
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(p_parameters->renderMode, &cellColumns, &cellRows);
+
+    Parameters parameters = *p_parameters; // <-- the full decode works out the size again
+    getFinalImageSize(&parameters, headerWidth, headerHeight);
+    const Int sampledWidth  = parameters.width * cellColumns;
+    const Int sampledHeight = parameters.height * cellRows;
+
+    Int previewWidth = 0, previewHeight = 0;
+    Bool isComplete = PTERM_FALSE;
+    UChar* preview = decodePreview(*data, size, sampledWidth, sampledHeight, &previewWidth, &previewHeight, &isComplete);
+    if (!preview)
+        return PTERM_FALSE;
+
+    if (isComplete || !parameters.refine) {
+        *delays = (Int*) calloc(1, sizeof(Int));
+        if (!*delays) {
+            free(preview);
+            return PTERM_FALSE;
         }
 
-        free(data);
-    } else { // no resizing needed
-        resizedImage = data;
-        resizedFrame = resizedImage;
+        free(*data);
+        *data                   = preview;
+        *numberOfFrames         = 1;
+        *width                  = previewWidth;
+        *height                 = previewHeight;
+        *numberOfSourceChannels = headerChannels;
+        *numberOfChannels       = 4;
+        p_parameters->width     = parameters.width;
+        p_parameters->height    = parameters.height;
+        return PTERM_TRUE;
     }
 
-    UInt outputSize = 0;
+    UChar* frame  = (UChar*) malloc(sampledWidth * sampledHeight * 4);
     UChar* output = NULL;
-    allocateANSITextImage(&output, &outputSize, parameters.width, parameters.height);
-
-    if (!output) {
-        printf("Error: failed to allocate output of size %i\n", outputSize);
-        exit(PTERM_MEMORY_ERROR);
+    UInt outputSize = 0;
+    if (frame
+        && resizeImage(preview, frame, previewWidth, previewHeight, 4, sampledWidth, sampledHeight) == PTERM_SUCCESS
+        && encodeImage(&parameters, frame, &output, &outputSize) == PTERM_SUCCESS) {
+        struct iovec chunks[2] = {
+            {output, outputSize},
+            {(void*) ansiColorReset, ansiColorResetSize}
+        };
+
+        const double writeBegin = beginStage();
+        *isRefining = writeChunks(STDOUT_FILENO, chunks, 2) == PTERM_SUCCESS;
+        endStage(PTERM_STAGE_WRITE, writeBegin);
     }
 
-    // Loop through frames
-    setvbuf(stdout, NULL, _IOFBF, outputSize);
-    clock_t time     = clock();
-    resizedFrame     = resizedImage;
-    UInt* frameDelay = (UInt*)delays;
+    free(output);
+    free(frame);
+    free(preview);
+    return PTERM_FALSE;
+}
 
-    for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex, resizedFrame+=resizedFrameSize, ++frameDelay) {
-        _textFromImageInMemory(resizedFrame,
-                               output,
-                               parameters.width,
-                               parameters.height,
-                               numberOfChannels,
-                               parameters.backgroundOnly);
 
-        // Print
-        double sleepTime = (*frameDelay) - difftime(clock(), time)/1000.0;
-        if (0 < sleepTime) {
-            usleep(1000 * sleepTime);
+/// --- THUMBNAIL CACHE --- ///
+
+// Downscaled images are looked up here if open (see --cache)
+ThumbnailCache thumbnailCache = {-1, NULL, 0, NULL, 0};
+
+
+/// Open the thumbnail cache at the given path, or at $XDG_CACHE_HOME/pterm/thumbnails (~/.cache by default).
+void openCache(const Char* fileName)
+{
+    #ifndef _WIN32
+    Char path[PATH_MAX];
+    if (!fileName) {
+        const Char* cacheHome = getenv("XDG_CACHE_HOME");
+        const Char* home = getenv("HOME");
+        if (cacheHome && cacheHome[0]) {
+            snprintf(path, sizeof(path), "%s/pterm", cacheHome);
+        } else if (home && home[0]) {
+            snprintf(path, sizeof(path), "%s/.cache", home);
+            mkdir(path, 0755);
+            snprintf(path, sizeof(path), "%s/.cache/pterm", home);
+        } else {
+            fputs("Warning: no cache directory (set XDG_CACHE_HOME or HOME)\n", stderr);
+            return;
         }
-        time = clock();
 
-        fwrite(output, sizeof(UChar), outputSize, stdout);
-        fflush(stdout);
+        mkdir(path, 0755);
+        strncat(path, "/thumbnails", sizeof(path) - strlen(path) - 1);
+        fileName = path;
     }
 
-    // Clear color
-    fwrite(ansiColorReset, sizeof(UChar), ansiColorResetSize, stdout);
+    if (openThumbnailCache(&thumbnailCache, fileName) != PTERM_SUCCESS) {
+        fprintf(stderr, "Warning: failed to open thumbnail cache %s\n", fileName);
+    }
+    #else
+    fputs("Warning: the thumbnail cache is not available on Windows\n", stderr);
+    #endif
+}
 
-    // Release resources
-    free(delays);
-    free(output);
 
-    if (parameters.width!=imageWidth || parameters.height!=imageHeight)
-        free(resizedImage);
-    else
-        free(data);
+/// Get the geometry images are fitted into by @ref{getFinalImageSize}.
+ThumbnailGeometry getThumbnailGeometry(const Parameters* p_parameters)
+{
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(p_parameters->renderMode, &cellColumns, &cellRows);
+
+    ThumbnailGeometry geometry;
+    const Bool isFitToTerminal = !p_parameters->width && !p_parameters->height;
+    geometry.width       = isFitToTerminal ? p_parameters->terminalWidth : p_parameters->width;
+    geometry.height      = isFitToTerminal ? p_parameters->terminalHeight : p_parameters->height;
+    geometry.cellColumns = cellColumns;
+    geometry.cellRows    = cellRows;
+    return geometry;
+}
+
+
+/// --- BATCH --- ///
+
+typedef struct
+{
+    Char*  fileName;
+    UChar* output;
+    UInt   outputSize;
+    Int    status;
+    Bool   isDone;
+} BatchJob;
+
+
+/// Check whether a file name has an extension that stb_image can decode.
+Bool isImageFileName(const Char* fileName)
+{
+    const Char* extensions[] = {".jpg", ".jpeg", ".png", ".tga", ".bmp", ".psd", ".gif", ".hdr", ".pic", ".pnm", ".ppm", ".pgm"};
+    const Char* extension = fileExtension(fileName);
+    for (UInt extensionIndex=0; extensionIndex<sizeof(extensions)/sizeof(extensions[0]); ++extensionIndex) {
+        #ifdef _WIN32
+        if (_stricmp(extension, extensions[extensionIndex]) == 0)
+        #else
+        if (strcasecmp(extension, extensions[extensionIndex]) == 0)
+        #endif
+            return PTERM_TRUE;
+    }
+    return PTERM_FALSE;
+}
+
+
+Bool appendBatchJob(BatchJob** jobs, UInt* numberOfJobs, const Char* fileName)
+{
+    BatchJob* newJobs = (BatchJob*) realloc(*jobs, (*numberOfJobs + 1) * sizeof(BatchJob));
+    if (!newJobs) {
+        puts("Error: failed to allocate memory for batch jobs");
+        return PTERM_FALSE;
+    }
+
+    *jobs = newJobs;
+    BatchJob* job = newJobs + (*numberOfJobs)++;
+    memset(job, 0, sizeof(BatchJob));
+    copyString(fileName, &job->fileName);
+    return PTERM_TRUE;
+}
+
+
+int compareStrings(const void* left, const void* right)
+{
+    return strcmp(*(const Char* const*) left, *(const Char* const*) right);
+}
+
+
+/// Expand directories (their image files, sorted by name) and glob patterns into jobs.
+Bool collectBatchJobs(const Parameters* p_parameters, BatchJob** jobs, UInt* numberOfJobs)
+{
+    *jobs = NULL;
+    *numberOfJobs = 0;
+
+    for (Int inputIndex=0; inputIndex<p_parameters->numberOfFileNames; ++inputIndex) {
+        const Char* input = p_parameters->fileNames[inputIndex];
+
+        #ifndef _WIN32
+        struct stat status;
+        if (stat(input, &status) == 0 && S_ISDIR(status.st_mode)) {
+            DIR* directory = opendir(input);
+            if (!directory) {
+                fprintf(stderr, "Error: failed to open directory %s (%s)\n", input, strerror(errno));
+                continue;
+            }
+
+            // Collect paths first, so they can be sorted
+            Char** paths = NULL;
+            UInt numberOfPaths = 0;
+            for (struct dirent* entry=readdir(directory); entry; entry=readdir(directory)) {
+                if (entry->d_name[0] == '.' || !isImageFileName(entry->d_name))
+                    continue;
+
+                const size_t pathSize = strlen(input) + strlen(entry->d_name) + 2;
+                Char* path = (Char*) malloc(pathSize);
+                Char** newPaths = (Char**) realloc(paths, (numberOfPaths + 1) * sizeof(Char*));
+                if (!path || !newPaths) {
+                    free(path);
+                    free(newPaths ? newPaths : paths);
+                    closedir(directory);
+                    puts("Error: failed to allocate memory for file names");
+                    return PTERM_FALSE;
+                }
+
+                snprintf(path, pathSize, "%s/%s", input, entry->d_name);
+                paths = newPaths;
+                if (stat(path, &status) == 0 && S_ISREG(status.st_mode))
+                    paths[numberOfPaths++] = path;
+                else
+                    free(path);
+            }
+            closedir(directory);
+
+            qsort(paths, numberOfPaths, sizeof(Char*), compareStrings);
+
+            Bool isValid = PTERM_TRUE;
+            for (UInt pathIndex=0; pathIndex<numberOfPaths; ++pathIndex) {
+                isValid = isValid && appendBatchJob(jobs, numberOfJobs, paths[pathIndex]);
+                free(paths[pathIndex]);
+            }
+            free(paths);
+            if (!isValid)
+                return PTERM_FALSE;
+            continue;
+        }
+
+        if (strpbrk(input, "*?[")) {
+            glob_t matches;
+            const int globOutput = glob(input, GLOB_MARK, NULL, &matches);
+            if (globOutput == 0) {
+                for (size_t matchIndex=0; matchIndex<matches.gl_pathc; ++matchIndex) {
+                    const Char* match = matches.gl_pathv[matchIndex];
+                    if (match[strlen(match) - 1] == '/') // <-- skip directories (GLOB_MARK)
+                        continue;
+                    if (!appendBatchJob(jobs, numberOfJobs, match)) {
+                        globfree(&matches);
+                        return PTERM_FALSE;
+                    }
+                }
+                globfree(&matches);
+            } else if (globOutput == GLOB_NOMATCH) {
+                fprintf(stderr, "Warning: no files match %s\n", input);
+            } else {
+                fprintf(stderr, "Error: failed to expand %s\n", input);
+            }
+            continue;
+        }
+        #endif
+
+        if (!appendBatchJob(jobs, numberOfJobs, input))
+            return PTERM_FALSE;
+    }
+
+    return PTERM_TRUE;
+}
+
+
+/// Render the first frame of an image file into a compact text buffer.
+Int renderImageFile(const Parameters* p_parameters, const Char* fileName, UChar** output, UInt* outputSize)
+{
+    *output = NULL;
+    *outputSize = 0;
+
+    Parameters parameters = *p_parameters;
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(parameters.renderMode, &cellColumns, &cellRows);
+
+    // Cached thumbnails are encoded straight from the mapped pack
+    const ThumbnailGeometry geometry = getThumbnailGeometry(p_parameters);
+    const Int numberOfChannels = 4;
+    UInt cachedWidth = 0, cachedHeight = 0;
+    const UChar* cachedFrame = findThumbnail(&thumbnailCache, fileName, &geometry, &cachedWidth, &cachedHeight);
+    UChar* frame = NULL;
+
+    if (cachedFrame) {
+        parameters.width  = cachedWidth / cellColumns;
+        parameters.height = cachedHeight / cellRows;
+    } else {
+        Int imageWidth=0, imageHeight=0, numberOfSourceChannels=0, numberOfOutputChannels=0, numberOfFrames=0;
+        Int* delays = NULL;
+        UChar* data = loadImage(&parameters, // <-- every file gets its own size
+                                fileName,
+                                &numberOfFrames,
+                                &delays,
+                                &imageWidth,
+                                &imageHeight,
+                                &numberOfSourceChannels,
+                                &numberOfOutputChannels);
+        if (!data) {
+            return PTERM_INPUT_ERROR;
+        }
+        free(delays);
+
+        const Int sampledWidth = parameters.width * cellColumns;
+        const Int sampledHeight = parameters.height * cellRows;
+
+        frame = data;
+        if (sampledWidth!=imageWidth || sampledHeight!=imageHeight) {
+            frame = (UChar*) malloc(sampledWidth * sampledHeight * numberOfChannels);
+            if (!frame) {
+                free(data);
+                return PTERM_MEMORY_ERROR;
+            }
+
+            Int resizeOutput = resizeImage(data, frame, imageWidth, imageHeight, numberOfChannels, sampledWidth, sampledHeight);
+            free(data);
+            if (resizeOutput) {
+                free(frame);
+                return resizeOutput;
+            }
+        }
+
+        if (0 <= thumbnailCache.fileDescriptor && numberOfFrames == 1)
+            storeThumbnail(&thumbnailCache, fileName, &geometry, frame, sampledWidth, sampledHeight);
+        cachedFrame = frame;
+    }
+
+    Int encodeOutput = encodeImage(&parameters, cachedFrame, output, outputSize);
+    free(frame);
+    return encodeOutput;
+}
+
+
+#ifndef _WIN32
+struct batchState
+{
+    BatchJob*         jobs;
+    UInt              numberOfJobs;
+    UInt              numberOfWrittenJobs;
+    UInt              window;       // <-- rendered jobs may only run this far ahead of the output
+    atomic_uint       next;
+    const Parameters* parameters;
+    pthread_mutex_t   mutex;
+    pthread_cond_t    condition;
+};
+
+
+void* _batchWorker(void* p_state)
+{
+    struct batchState* state = (struct batchState*) p_state;
+    for (UInt index=atomic_fetch_add(&state->next, 1); index<state->numberOfJobs; index=atomic_fetch_add(&state->next, 1)) {
+        pthread_mutex_lock(&state->mutex);
+        while (state->numberOfWrittenJobs + state->window <= index)
+            pthread_cond_wait(&state->condition, &state->mutex);
+        pthread_mutex_unlock(&state->mutex);
+
+        BatchJob* job = state->jobs + index;
+        job->status = renderImageFile(state->parameters, job->fileName, &job->output, &job->outputSize);
+
+        pthread_mutex_lock(&state->mutex);
+        job->isDone = PTERM_TRUE;
+        pthread_cond_broadcast(&state->condition);
+        pthread_mutex_unlock(&state->mutex);
+    }
+    return NULL;
+}
+#endif
+
+
+/// Write a rendered job to stdout (or report its failure) and release it.
+Int writeBatchJob(BatchJob* job)
+{
+    Int status = job->status;
+    if (status == PTERM_SUCCESS) {
+        struct iovec chunk = {job->output, job->outputSize};
+        status = writeChunks(STDOUT_FILENO, &chunk, 1);
+    } else {
+        fprintf(stderr, "Error: failed to render %s (%i)\n", job->fileName, status);
+    }
+
+    free(job->output);
+    free(job->fileName);
+    job->output = NULL;
+    job->fileName = NULL;
+    return status;
+}
+
+
+/** Render the first frame of every batch input on a pool of worker threads.
+ *  Workers pick up the next file as soon as they are done with the previous one, while the
+ *  calling thread writes the finished files in their original order.
+ */
+Int renderBatch(const Parameters* p_parameters)
+{
+    BatchJob* jobs = NULL;
+    UInt numberOfJobs = 0;
+    if (!collectBatchJobs(p_parameters, &jobs, &numberOfJobs)) {
+        return PTERM_MEMORY_ERROR;
+    }
+
+    if (!numberOfJobs) {
+        puts("Error: no image files found");
+        return PTERM_INPUT_ERROR;
+    }
+
+    UInt numberOfThreads = p_parameters->numberOfJobs ? (UInt) p_parameters->numberOfJobs : getNumberOfThreads();
+    if (numberOfJobs < numberOfThreads)
+        numberOfThreads = numberOfJobs;
+
+    // Files are the unit of parallelism; encoders run serially within each of them
+    if (1 < numberOfThreads)
+        numberOfWorkerThreads = 1;
+
+    Int output = PTERM_SUCCESS;
+    UInt numberOfStartedThreads = 0;
+
+    #ifndef _WIN32
+    struct batchState state;
+    state.jobs                = jobs;
+    state.numberOfJobs        = numberOfJobs;
+    state.numberOfWrittenJobs = 0;
+    state.window              = 4 * numberOfThreads;
+    state.parameters          = p_parameters;
+    atomic_init(&state.next, 0);
+    pthread_mutex_init(&state.mutex, NULL);
+    pthread_cond_init(&state.condition, NULL);
+
+    pthread_t* threads = (pthread_t*) malloc(numberOfThreads * sizeof(pthread_t));
+    if (threads && 1 < numberOfThreads) {
+        for (; numberOfStartedThreads<numberOfThreads; ++numberOfStartedThreads) {
+            if (pthread_create(threads + numberOfStartedThreads, NULL, _batchWorker, &state))
+                break;
+        }
+    }
+
+    if (numberOfStartedThreads) {
+        for (UInt jobIndex=0; jobIndex<numberOfJobs; ++jobIndex) {
+            pthread_mutex_lock(&state.mutex);
+            while (!jobs[jobIndex].isDone)
+                pthread_cond_wait(&state.condition, &state.mutex);
+            pthread_mutex_unlock(&state.mutex);
+
+            Int jobOutput = writeBatchJob(jobs + jobIndex);
+            if (jobOutput != PTERM_SUCCESS)
+                output = jobOutput;
+
+            pthread_mutex_lock(&state.mutex);
+            ++state.numberOfWrittenJobs;
+            pthread_cond_broadcast(&state.condition);
+            pthread_mutex_unlock(&state.mutex);
+        }
+
+        for (UInt threadIndex=0; threadIndex<numberOfStartedThreads; ++threadIndex)
+            pthread_join(threads[threadIndex], NULL);
+    }
+
+    free(threads);
+    pthread_cond_destroy(&state.condition);
+    pthread_mutex_destroy(&state.mutex);
+    #endif
+
+    // Serial fallback (single job, or no threads available)
+    if (!numberOfStartedThreads) {
+        for (UInt jobIndex=0; jobIndex<numberOfJobs; ++jobIndex) {
+            BatchJob* job = jobs + jobIndex;
+            job->status = renderImageFile(p_parameters, job->fileName, &job->output, &job->outputSize);
+            Int jobOutput = writeBatchJob(job);
+            if (jobOutput != PTERM_SUCCESS)
+                output = jobOutput;
+        }
+    }
+
+    free(jobs);
+
+    struct iovec chunk = {(void*) ansiColorReset, ansiColorResetSize};
+    writeChunks(STDOUT_FILENO, &chunk, 1);
+    return output;
+}
+
+
+
+/// --- GALLERY --- ///
+
+typedef struct
+{
+    const Parameters* parameters;
+    BatchJob* jobs;
+    UChar*    canvas;           // <-- RGBA subpixels of the grid rows being rendered (transparent between tiles)
+    Int       canvasWidth;      // <-- subpixels
+    Int       numberOfColumns;  // <-- tiles per grid row
+    Int       tileWidth;        // <-- cells
+    Int       tileHeight;       // <-- cells (without the gap below)
+    Int       cellColumns;
+    Int       cellRows;
+} GalleryContext;
+
+
+/// Decode, downscale and draw a single tile onto the canvas.
+void _galleryTile(void* p_context, UInt index)
+{
+    GalleryContext* context = (GalleryContext*) p_context;
+    BatchJob* job = context->jobs + index;
+
+    ThumbnailGeometry geometry;
+    geometry.width       = context->tileWidth;
+    geometry.height      = context->tileHeight;
+    geometry.cellColumns = context->cellColumns;
+    geometry.cellRows    = context->cellRows;
+
+    const Int numberOfChannels = 4;
+    UInt cachedWidth = 0, cachedHeight = 0;
+    const UChar* cachedThumbnail = findThumbnail(&thumbnailCache, job->fileName, &geometry, &cachedWidth, &cachedHeight);
+    UChar* thumbnail = NULL;
+    Int sampledWidth = cachedWidth, sampledHeight = cachedHeight;
+
+    if (!cachedThumbnail) {
+        Int imageWidth=0, imageHeight=0, numberOfSourceChannels=0, numberOfOutputChannels=0, numberOfFrames=0;
+        Int* delays = NULL;
+        // Fit the thumbnail into the tile
+        Parameters tileParameters = *context->parameters;
+        tileParameters.width  = context->tileWidth;
+        tileParameters.height = context->tileHeight;
+
+        UChar* data = loadImage(&tileParameters,
+                                job->fileName,
+                                &numberOfFrames,
+                                &delays,
+                                &imageWidth,
+                                &imageHeight,
+                                &numberOfSourceChannels,
+                                &numberOfOutputChannels);
+        if (!data) {
+            job->status = PTERM_INPUT_ERROR;
+            return;
+        }
+        free(delays);
+
+        sampledWidth  = (tileParameters.width ? tileParameters.width : 1) * context->cellColumns;
+        sampledHeight = (tileParameters.height ? tileParameters.height : 1) * context->cellRows;
+
+        thumbnail = (UChar*) malloc(sampledWidth * sampledHeight * numberOfChannels);
+        if (!thumbnail) {
+            free(data);
+            job->status = PTERM_MEMORY_ERROR;
+            return;
+        }
+
+        job->status = resizeImage(data, thumbnail, imageWidth, imageHeight, numberOfChannels, sampledWidth, sampledHeight);
+        free(data);
+
+        if (job->status == PTERM_SUCCESS && 0 <= thumbnailCache.fileDescriptor && numberOfFrames == 1)
+            storeThumbnail(&thumbnailCache, job->fileName, &geometry, thumbnail, sampledWidth, sampledHeight);
+        cachedThumbnail = thumbnail;
+    }
+
+    if (job->status == PTERM_SUCCESS) {
+        const Int width  = sampledWidth / context->cellColumns;
+        const Int height = sampledHeight / context->cellRows;
+
+        // Center the thumbnail in its tile
+        const Int gridRow    = index / context->numberOfColumns;
+        const Int gridColumn = index % context->numberOfColumns;
+        const Int left = (gridColumn * (context->tileWidth + 1) + (context->tileWidth - width) / 2) * context->cellColumns;
+        const Int top  = (gridRow * (context->tileHeight + 1) + (context->tileHeight - height) / 2) * context->cellRows;
+
+        for (Int rowIndex=0; rowIndex<sampledHeight; ++rowIndex) {
+            memcpy(context->canvas + ((top + rowIndex) * context->canvasWidth + left) * numberOfChannels,
+                   cachedThumbnail + rowIndex * sampledWidth * numberOfChannels,
+                   sampledWidth * numberOfChannels);
+        }
+    }
+
+    free(thumbnail);
+}
+
+
+/** Lay out the first frame of every batch input as a grid of thumbnails.
+ *  Tiles are decoded and downscaled in parallel straight onto a canvas of several grid rows,
+ *  which is then encoded in one go, so each line of text ends with a single color reset.
+ */
+Int renderGallery(const Parameters* p_parameters)
+{
+    BatchJob* jobs = NULL;
+    UInt numberOfJobs = 0;
+    if (!collectBatchJobs(p_parameters, &jobs, &numberOfJobs)) {
+        return PTERM_MEMORY_ERROR;
+    }
+
+    if (!numberOfJobs) {
+        puts("Error: no image files found");
+        return PTERM_INPUT_ERROR;
+    }
+
+    if (p_parameters->numberOfJobs)
+        numberOfWorkerThreads = p_parameters->numberOfJobs;
+
+    GalleryContext context;
+    context.parameters = p_parameters;
+    context.jobs       = jobs;
+    context.tileWidth  = p_parameters->tileWidth;
+    context.tileHeight = (p_parameters->tileWidth + 1) / 2; // <-- square tiles
+    getCellResolution(p_parameters->renderMode, &context.cellColumns, &context.cellRows);
+
+    // Tiles are separated by an empty column and row
+    const Int width = p_parameters->width ? p_parameters->width : p_parameters->terminalWidth;
+    context.numberOfColumns = (width + 1) / (context.tileWidth + 1);
+    if (context.numberOfColumns < 1)
+        context.numberOfColumns = 1;
+
+    const Int textWidth = context.numberOfColumns * (context.tileWidth + 1) - 1;
+    context.canvasWidth = textWidth * context.cellColumns;
+
+    // Render enough grid rows at once to keep every thread busy
+    const Int numberOfGridRows = (numberOfJobs + context.numberOfColumns - 1) / context.numberOfColumns;
+    Int gridRowsPerChunk = (4 * getNumberOfThreads() + context.numberOfColumns - 1) / context.numberOfColumns;
+    if (numberOfGridRows < gridRowsPerChunk)
+        gridRowsPerChunk = numberOfGridRows;
+
+    const Int maximumTextHeight = gridRowsPerChunk * (context.tileHeight + 1);
+    const size_t canvasSize = (size_t) context.canvasWidth * maximumTextHeight * context.cellRows * 4;
+    const Bool isBlockMode = p_parameters->renderMode == PTERM_RENDER_QUADRANT || p_parameters->renderMode == PTERM_RENDER_SEXTANT;
+
+    UInt outputSize = 0;
+    UChar* output = NULL;
+    if (isBlockMode) {
+        allocateBlockTextImage(&output, &outputSize, textWidth, maximumTextHeight);
+    } else {
+        allocateANSITextImage(&output, &outputSize, textWidth, maximumTextHeight);
+    }
+    context.canvas = (UChar*) malloc(canvasSize);
+
+    if (!output || !context.canvas) {
+        printf("Error: failed to allocate a %ix%i gallery\n", textWidth, maximumTextHeight);
+        free(output);
+        free(context.canvas);
+        free(jobs);
+        return PTERM_MEMORY_ERROR;
+    }
+
+    Int result = PTERM_SUCCESS;
+    for (Int firstGridRow=0; firstGridRow<numberOfGridRows; firstGridRow+=gridRowsPerChunk) {
+        const UInt firstJob = firstGridRow * context.numberOfColumns;
+        UInt numberOfChunkJobs = gridRowsPerChunk * context.numberOfColumns;
+        if (numberOfJobs - firstJob < numberOfChunkJobs)
+            numberOfChunkJobs = numberOfJobs - firstJob;
+
+        const Int chunkGridRows = (numberOfChunkJobs + context.numberOfColumns - 1) / context.numberOfColumns;
+        const Int textHeight = chunkGridRows * (context.tileHeight + 1);
+
+        memset(context.canvas, 0, canvasSize);
+        context.jobs = jobs + firstJob;
+        parallelFor(numberOfChunkJobs, _galleryTile, &context);
+
+        UInt size = 0;
+        if (isBlockMode) {
+            size = _blockTextFromImageInMemory(context.canvas, output, textWidth, textHeight, 4, p_parameters->renderMode);
+        } else {
+            if (p_parameters->renderMode == PTERM_RENDER_SHAPE) {
+                _shapeTextFromImageInMemory(context.canvas, output, textWidth, textHeight, 4);
+            } else {
+                _textFromImageInMemory(context.canvas, output, textWidth, textHeight, 4, p_parameters->backgroundOnly);
+            }
+            size = strlen((const Char*) output);
+        }
+
+        struct iovec chunk = {output, size};
+        if (writeChunks(STDOUT_FILENO, &chunk, 1) != PTERM_SUCCESS)
+            result = PTERM_IO_ERROR;
+
+        for (UInt jobIndex=0; jobIndex<numberOfChunkJobs; ++jobIndex) {
+            BatchJob* job = context.jobs + jobIndex;
+            if (job->status != PTERM_SUCCESS) {
+                fprintf(stderr, "Error: failed to render %s (%i)\n", job->fileName, job->status);
+                result = job->status;
+            }
+            free(job->fileName);
+        }
+    }
+
+    free(output);
+    free(context.canvas);
+    free(jobs);
+    return result;
+}
+
+
+
+/// --- WATCH --- ///
+
+#ifndef _WIN32
+volatile sig_atomic_t isTerminalResized = 0;
+
+
+void onTerminalResize(int signalNumber)
+{
+    (void) signalNumber;
+    isTerminalResized = 1;
+}
+
+
+/// Fit the image of a pyramid to the current terminal and draw it over the whole (alternate) screen.
+Int redrawImage(const Parameters* p_parameters, const ImagePyramid* pyramid)
+{
+    Parameters parameters = *p_parameters;
+    parameters.terminalWidth  = 0; // <-- query the new size
+    parameters.terminalHeight = 0;
+    getFinalImageSize(&parameters, pyramid->widths[0], pyramid->heights[0]);
+    if (parameters.width <= 0 || parameters.height <= 0)
+        return PTERM_SUCCESS; // <-- nothing fits
+
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(parameters.renderMode, &cellColumns, &cellRows);
+    const Int sampledWidth  = parameters.width * cellColumns;
+    const Int sampledHeight = parameters.height * cellRows;
+
+    UChar* frame  = (UChar*) malloc((size_t) sampledWidth * sampledHeight * 4);
+    UChar* output = NULL;
+    UInt outputSize = 0;
+    Int result = frame ? resizeImageFromPyramid(pyramid, frame, sampledWidth, sampledHeight) : PTERM_MEMORY_ERROR;
+    if (result == PTERM_SUCCESS) {
+        const double encodeBegin = beginStage();
+        result = encodeImage(&parameters, frame, &output, &outputSize);
+        endStage(PTERM_STAGE_ENCODE, encodeBegin);
+    }
+
+    if (result == PTERM_SUCCESS) {
+        struct iovec chunks[5] = {
+            {(void*) ansiFrameBegin, ansiFrameBeginSize},
+            {(void*) ansiClearScreen, ansiClearScreenSize},
+            {output, outputSize},
+            {(void*) ansiColorReset, ansiColorResetSize},
+            {(void*) ansiFrameEnd, ansiFrameEndSize}
+        };
+
+        const double writeBegin = beginStage();
+        result = writeChunks(STDOUT_FILENO, chunks, 5);
+        endStage(PTERM_STAGE_WRITE, writeBegin);
+    }
+
+    free(output);
+    free(frame);
+    return result;
+}
+
+
+/** Decode the first frame of the input at full resolution into the bottom level of a pyramid (freed by the caller).
+ *  Errors are printed only if @p isReporting (server workers send them back to the client instead).
+ */
+Int loadImagePyramid(const Parameters* p_parameters, ImagePyramid* pyramid, Bool isReporting)
+{
+    UInt size = 0;
+    UChar* data = NULL;
+    if (p_parameters->fileName) {
+        data = loadFile(p_parameters->fileName, &size);
+    } else {
+        readPipe(&data, &size);
+    }
+
+    Int numberOfFrames = 0, width = 0, height = 0, numberOfSourceChannels = 0, numberOfChannels = 0;
+    Int* delays = NULL;
+    Int result = data ? convertImageScaled(&data,
+                                           size,
+                                           p_parameters->extension,
+                                           0, // <-- full resolution: the terminal may grow
+                                           0,
+                                           &numberOfFrames,
+                                           &delays,
+                                           &width,
+                                           &height,
+                                           &numberOfSourceChannels,
+                                           &numberOfChannels) : PTERM_INPUT_ERROR;
+    free(delays);
+
+    if (result != PTERM_SUCCESS) {
+        if (isReporting)
+            printf("Error: failed to load %s\n", p_parameters->fileName ? p_parameters->fileName : "image from stdin");
+        return result;
+    }
+
+    result = buildImagePyramid(pyramid, data, width, height, numberOfChannels);
+    if (result != PTERM_SUCCESS) {
+        if (isReporting)
+            puts("Error: failed to allocate memory for the image pyramid");
+        free(data);
+    }
+
+    return result;
+}
+
+
+/** Decode an image once at full resolution and keep it fitted to the terminal: every SIGWINCH
+ *  redraws it, resized from the nearest level of its pyramid (see @ref{buildImagePyramid}).
+ *  Runs until the process is interrupted (animations show their first frame).
+ */
+Int watchImage(const Parameters* p_parameters)
+{
+    ImagePyramid pyramid;
+    Int result = loadImagePyramid(p_parameters, &pyramid, PTERM_TRUE);
+    if (result != PTERM_SUCCESS)
+        return result;
+    UChar* data = pyramid.levels[0];
+
+    // SIGWINCH is only let through while waiting, so that no resize goes unnoticed
+    sigset_t resizeSignals, waitSignals;
+    sigemptyset(&resizeSignals);
+    sigaddset(&resizeSignals, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &resizeSignals, &waitSignals);
+    sigdelset(&waitSignals, SIGWINCH);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onTerminalResize;
+    sigaction(SIGWINCH, &action, NULL);
+
+    signal(SIGINT, onPlaybackInterrupt);
+    signal(SIGTERM, onPlaybackInterrupt);
+    struct iovec chunk = {(void*) ansiEnterPlayback, ansiEnterPlaybackSize};
+    writeChunks(STDOUT_FILENO, &chunk, 1);
+
+    for (isTerminalResized = 1; result == PTERM_SUCCESS; ) {
+        while (!isTerminalResized)
+            sigsuspend(&waitSignals);
+        isTerminalResized = 0;
+        result = redrawImage(p_parameters, &pyramid);
+    }
+
+    struct iovec chunks[2] = {
+        {(void*) ansiColorReset, ansiColorResetSize},
+        {(void*) ansiLeavePlayback, ansiLeavePlaybackSize}
+    };
+    writeChunks(STDOUT_FILENO, chunks, 2);
+
+    freeImagePyramid(&pyramid);
+    free(data);
+    return result;
+}
+#endif
+
+
+/// --- VIEWER --- ///
+
+#ifndef _WIN32
+/// Encoded text of a tile of the zoomed image (PTERM_VIEWER_TILE_COLUMNS x PTERM_VIEWER_TILE_ROWS cells)
+typedef struct
+{
+    Int    scaledWidth;     // <-- key: size of the zoomed image in cells ...
+    Int    scaledHeight;
+    Int    tileColumn;      // <-- ... and position of the tile in tiles
+    Int    tileRow;
+    Int    width;           // <-- cells (tiles on the right and bottom edges are smaller)
+    Int    height;
+    UChar* text;
+    UInt   size;
+    UInt   rowOffsets[PTERM_VIEWER_TILE_ROWS + 1]; // <-- rows end with a color reset and a new line
+    size_t lastUse;         // <-- last frame that showed the tile
+    Int    status;
+} ViewerTile;
+
+
+typedef struct
+{
+    const Parameters*   parameters;
+    const ImagePyramid* pyramid;
+    Int         cellColumns;
+    Int         cellRows;
+    Int         viewWidth;      // <-- cells showing the image (the status line is below)
+    Int         viewHeight;
+    Int         fitWidth;       // <-- size of the whole image fitted into the view ...
+    Int         fitHeight;
+    Int         zoom;           // <-- ... which is shown at 2^zoom times that size
+    Int         maxZoom;
+    Int         scaledWidth;
+    Int         scaledHeight;
+    Int         left;           // <-- cell of the zoomed image in the top left corner of the view
+    Int         top;
+    ViewerTile* tiles;          // <-- cache of encoded tiles, the least recently shown go first
+    UInt        numberOfTiles;
+    UInt        tileCapacity;
+    size_t      numberOfBytes;
+    size_t      frame;
+    UInt*       visibleTiles;   // <-- indices of the tiles under the view, row by row
+    UInt*       pendingTiles;   // <-- indices of the tiles to encode for this frame
+    Int         firstTileColumn;
+    Int         firstTileRow;
+    Int         numberOfTileColumns;
+    Int         numberOfTileRows;
+    UChar*      output;
+    size_t      outputCapacity;
+} Viewer;
+
+
+// Terminal settings to restore when the viewer exits
+Int            viewerTerminal = -1;
+struct termios viewerTerminalSettings;
+
+
+/// Restore the terminal if the viewer is interrupted.
+void onViewerInterrupt(int signalNumber)
+{
+    tcsetattr(viewerTerminal, TCSAFLUSH, &viewerTerminalSettings);
+    onPlaybackInterrupt(signalNumber);
+}
+
+
+/// Resize and encode a tile that the next frame shows but the cache lacks.
+void _encodeViewerTile(void* p_context, UInt index)
+{
+    Viewer* viewer = (Viewer*) p_context;
+    ViewerTile* tile = viewer->tiles + viewer->pendingTiles[index];
+
+    const Int numberOfChannels = 4;
+    const Int sampledWidth     = tile->width * viewer->cellColumns;
+    const Int sampledHeight    = tile->height * viewer->cellRows;
+    UChar* region = (UChar*) malloc((size_t) sampledWidth * sampledHeight * numberOfChannels);
+
+    tile->status = region ? resizeRegionFromPyramid(viewer->pyramid,
+                                                    region,
+                                                    tile->scaledWidth * viewer->cellColumns,
+                                                    tile->scaledHeight * viewer->cellRows,
+                                                    tile->tileColumn * PTERM_VIEWER_TILE_COLUMNS * viewer->cellColumns,
+                                                    tile->tileRow * PTERM_VIEWER_TILE_ROWS * viewer->cellRows,
+                                                    sampledWidth,
+                                                    sampledHeight,
+                                                    sampledWidth * numberOfChannels) : PTERM_MEMORY_ERROR;
+
+    if (tile->status == PTERM_SUCCESS) {
+        Parameters parameters = *viewer->parameters;
+        parameters.width  = tile->width;
+        parameters.height = tile->height;
+        tile->status = encodeImage(&parameters, region, &tile->text, &tile->size);
+    }
+
+    if (tile->status == PTERM_SUCCESS) {
+        tile->rowOffsets[0] = 0;
+        for (Int rowIndex=0; rowIndex<tile->height; ++rowIndex) {
+            const UChar* rowEnd = (const UChar*) memchr(tile->text + tile->rowOffsets[rowIndex], '\n', tile->size - tile->rowOffsets[rowIndex]);
+            tile->rowOffsets[rowIndex + 1] = (UInt)(rowEnd - tile->text) + 1;
+        }
+    }
+
+    free(region);
+}
+
+
+/// Make sure that the cache holds every tile under the view (evicting the least recently shown ones first).
+Int _prepareViewerTiles(Viewer* viewer)
+{
+    ++viewer->frame;
+
+    while (PTERM_VIEWER_CACHE_LIMIT < viewer->numberOfBytes) {
+        UInt oldest = 0;
+        for (UInt tileIndex=1; tileIndex<viewer->numberOfTiles; ++tileIndex)
+            if (viewer->tiles[tileIndex].lastUse < viewer->tiles[oldest].lastUse)
+                oldest = tileIndex;
+
+        viewer->numberOfBytes -= viewer->tiles[oldest].size;
+        free(viewer->tiles[oldest].text);
+        viewer->tiles[oldest] = viewer->tiles[--viewer->numberOfTiles];
+    }
+
+    const Int right  = viewer->left + viewer->viewWidth < viewer->scaledWidth ? viewer->left + viewer->viewWidth : viewer->scaledWidth;
+    const Int bottom = viewer->top + viewer->viewHeight < viewer->scaledHeight ? viewer->top + viewer->viewHeight : viewer->scaledHeight;
+    viewer->firstTileColumn     = viewer->left / PTERM_VIEWER_TILE_COLUMNS;
+    viewer->firstTileRow        = viewer->top / PTERM_VIEWER_TILE_ROWS;
+    viewer->numberOfTileColumns = (right - 1) / PTERM_VIEWER_TILE_COLUMNS - viewer->firstTileColumn + 1;
+    viewer->numberOfTileRows    = (bottom - 1) / PTERM_VIEWER_TILE_ROWS - viewer->firstTileRow + 1;
+
+    const UInt numberOfVisibleTiles = viewer->numberOfTileColumns * viewer->numberOfTileRows;
+    UInt* visibleTiles = (UInt*) realloc(viewer->visibleTiles, numberOfVisibleTiles * sizeof(UInt));
+    UInt* pendingTiles = visibleTiles ? (UInt*) realloc(viewer->pendingTiles, numberOfVisibleTiles * sizeof(UInt)) : NULL;
+    if (visibleTiles)
+        viewer->visibleTiles = visibleTiles;
+    if (pendingTiles)
+        viewer->pendingTiles = pendingTiles;
+    if (!visibleTiles || !pendingTiles)
+        return PTERM_MEMORY_ERROR;
+
+    // Look the tiles up, and append placeholders for the missing ones
+    UInt numberOfPendingTiles = 0;
+    for (Int tileRow=0; tileRow<viewer->numberOfTileRows; ++tileRow) {
+        for (Int tileColumn=0; tileColumn<viewer->numberOfTileColumns; ++tileColumn) {
+            const Int column = viewer->firstTileColumn + tileColumn;
+            const Int row    = viewer->firstTileRow + tileRow;
+
+            UInt tileIndex = 0;
+            for (; tileIndex<viewer->numberOfTiles; ++tileIndex) {
+                const ViewerTile* tile = viewer->tiles + tileIndex;
+                if (tile->tileColumn == column && tile->tileRow == row
+                    && tile->scaledWidth == viewer->scaledWidth && tile->scaledHeight == viewer->scaledHeight)
+                    break;
+            }
+
+            if (tileIndex == viewer->numberOfTiles) {
+                if (viewer->numberOfTiles == viewer->tileCapacity) {
+                    const UInt capacity = viewer->tileCapacity ? 2 * viewer->tileCapacity : 64;
+                    ViewerTile* tiles = (ViewerTile*) realloc(viewer->tiles, capacity * sizeof(ViewerTile));
+                    if (!tiles)
+                        return PTERM_MEMORY_ERROR;
+                    viewer->tiles        = tiles;
+                    viewer->tileCapacity = capacity;
+                }
+
+                ViewerTile* tile = viewer->tiles + viewer->numberOfTiles++;
+                memset(tile, 0, sizeof(ViewerTile));
+                tile->scaledWidth  = viewer->scaledWidth;
+                tile->scaledHeight = viewer->scaledHeight;
+                tile->tileColumn   = column;
+                tile->tileRow      = row;
+                tile->width        = viewer->scaledWidth - column * PTERM_VIEWER_TILE_COLUMNS;
+                tile->height       = viewer->scaledHeight - row * PTERM_VIEWER_TILE_ROWS;
+                tile->width        = PTERM_VIEWER_TILE_COLUMNS < tile->width ? PTERM_VIEWER_TILE_COLUMNS : tile->width;
+                tile->height       = PTERM_VIEWER_TILE_ROWS < tile->height ? PTERM_VIEWER_TILE_ROWS : tile->height;
+                viewer->pendingTiles[numberOfPendingTiles++] = tileIndex;
+            }
+
+            viewer->tiles[tileIndex].lastUse = viewer->frame;
+            viewer->visibleTiles[tileRow * viewer->numberOfTileColumns + tileColumn] = tileIndex;
+        }
+    }
+
+    // Only newly exposed tiles are resized and encoded (on every thread, each tile encoding its rows serially)
+    if (numberOfPendingTiles) {
+        const double encodeBegin = beginStage();
+        parallelFor(numberOfPendingTiles, _encodeViewerTile, viewer);
+        endStage(PTERM_STAGE_ENCODE, encodeBegin);
+    }
+
+    Int result = PTERM_SUCCESS;
+    for (UInt pendingIndex=0; pendingIndex<numberOfPendingTiles; ++pendingIndex) {
+        const ViewerTile* tile = viewer->tiles + viewer->pendingTiles[pendingIndex];
+        viewer->numberOfBytes += tile->size;
+        if (tile->status != PTERM_SUCCESS)
+            result = tile->status;
+    }
+
+    return result;
+}
+
+
+/// Size of the encoded cell at the cursor (see @ref{encodeImage})
+UInt getEncodedCellSize(const UChar* cell, Int renderMode)
+{
+    // Transparent cells ("\e[11;...") and the modes with a single color per cell have a fixed size
+    if (cell[2] == '1' || (renderMode != PTERM_RENDER_QUADRANT && renderMode != PTERM_RENDER_SEXTANT))
+        return ansiColorSize + 1;
+
+    const UChar lead = cell[2 * ansiColorSize]; // <-- after the foreground and background colors
+    return 2 * ansiColorSize + (lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4);
+}
+
+
+/// Write a row of the view from the tiles under it, and clear the rest of the line.
+UChar* _composeViewerRow(const Viewer* viewer, Int viewRow, UChar* cursor)
+{
+    cursor += sprintf((char*) cursor, "\e[%i;1H", viewRow + 1);
+
+    const Int row = viewer->top + viewRow;
+    if (row < viewer->scaledHeight) {
+        const Int right = viewer->left + viewer->viewWidth < viewer->scaledWidth ? viewer->left + viewer->viewWidth : viewer->scaledWidth;
+        const UInt* visibleTiles = viewer->visibleTiles
+                                 + (row / PTERM_VIEWER_TILE_ROWS - viewer->firstTileRow) * viewer->numberOfTileColumns
+                                 - viewer->firstTileColumn;
+
+        for (Int column=viewer->left; column<right; ) {
+            const ViewerTile* tile = viewer->tiles + visibleTiles[column / PTERM_VIEWER_TILE_COLUMNS];
+            const UChar* segment = tile->text + tile->rowOffsets[row % PTERM_VIEWER_TILE_ROWS];
+
+            const Int firstCell = column % PTERM_VIEWER_TILE_COLUMNS;
+            const Int lastCell  = firstCell + right - column < tile->width ? firstCell + right - column : tile->width;
+            for (Int cell=0; cell<firstCell; ++cell)
+                segment += getEncodedCellSize(segment, viewer->parameters->renderMode);
+
+            const UChar* segmentEnd = segment;
+            for (Int cell=firstCell; cell<lastCell; ++cell)
+                segmentEnd += getEncodedCellSize(segmentEnd, viewer->parameters->renderMode);
+
+            memcpy(cursor, segment, segmentEnd - segment);
+            cursor += segmentEnd - segment;
+            column += lastCell - firstCell;
+        }
+    }
+
+    memcpy(cursor, ansiColorReset, ansiColorResetSize);
+    cursor += ansiColorResetSize;
+    memcpy(cursor, "\e[K", 3);
+    return cursor + 3;
+}
+
+
+/** Draw a frame of the viewer. Unless everything is redrawn, the image rows still in view are
+ *  scrolled by the terminal (within a scroll region above the status line), and only the rows
+ *  that this exposes are written.
+ */
+Int drawViewer(Viewer* viewer, Bool isFullRedraw, Int scrolledRows)
+{
+    Int result = _prepareViewerTiles(viewer);
+    if (result != PTERM_SUCCESS)
+        return result;
+
+    const size_t capacity = (size_t)(viewer->viewHeight + 1) * (viewer->viewWidth * blockCellSize + 64) + 256;
+    if (viewer->outputCapacity < capacity) {
+        UChar* output = (UChar*) realloc(viewer->output, capacity);
+        if (!output)
+            return PTERM_MEMORY_ERROR;
+        viewer->output         = output;
+        viewer->outputCapacity = capacity;
+    }
+
+    UChar* cursor = viewer->output;
+    memcpy(cursor, ansiFrameBegin, ansiFrameBeginSize);
+    cursor += ansiFrameBeginSize;
+
+    Int rowBegin = 0, rowEnd = viewer->viewHeight;
+    if (!isFullRedraw) {
+        if (scrolledRows) {
+            cursor += sprintf((char*) cursor,
+                              "\e[1;%ir\e[%i%c\e[r",
+                              viewer->viewHeight,
+                              scrolledRows < 0 ? -scrolledRows : scrolledRows,
+                              scrolledRows < 0 ? 'T' : 'S');
+            rowBegin = scrolledRows < 0 ? 0 : viewer->viewHeight - scrolledRows;
+            rowEnd   = scrolledRows < 0 ? -scrolledRows : viewer->viewHeight;
+        } else {
+            rowBegin = rowEnd;
+        }
+    }
+
+    for (Int viewRow=rowBegin; viewRow<rowEnd; ++viewRow)
+        cursor = _composeViewerRow(viewer, viewRow, cursor);
+
+    // Status line
+    const Int originalWidth = viewer->pyramid->widths[0];
+    const Int originalHeight = viewer->pyramid->heights[0];
+    Char status[160];
+    Int statusSize = snprintf(status,
+                              sizeof(status),
+                              " %ix%i  %i%%  %i,%i  arrows/hjkl: pan  +/-: zoom  q: quit",
+                              originalWidth,
+                              originalHeight,
+                              (Int)((100.0 * viewer->scaledWidth * viewer->cellColumns) / originalWidth + 0.5),
+                              viewer->left,
+                              viewer->top);
+    statusSize = statusSize < viewer->viewWidth ? statusSize : viewer->viewWidth;
+    cursor += sprintf((char*) cursor, "\e[%i;1H\e[7m%.*s", viewer->viewHeight + 1, statusSize, status);
+    memcpy(cursor, ansiColorReset, ansiColorResetSize);
+    cursor += ansiColorResetSize;
+    memcpy(cursor, "\e[K", 3);
+    cursor += 3;
+
+    memcpy(cursor, ansiFrameEnd, ansiFrameEndSize);
+    cursor += ansiFrameEndSize;
+
+    struct iovec chunk = {viewer->output, (size_t)(cursor - viewer->output)};
+    const double writeBegin = beginStage();
+    result = writeChunks(STDOUT_FILENO, &chunk, 1);
+    endStage(PTERM_STAGE_WRITE, writeBegin);
+    return result;
+}
+
+
+/// Keep the view within the zoomed image.
+void _clampViewer(Viewer* viewer)
+{
+    const Int maxLeft = viewer->viewWidth < viewer->scaledWidth ? viewer->scaledWidth - viewer->viewWidth : 0;
+    const Int maxTop  = viewer->viewHeight < viewer->scaledHeight ? viewer->scaledHeight - viewer->viewHeight : 0;
+    viewer->left = viewer->left < 0 ? 0 : maxLeft < viewer->left ? maxLeft : viewer->left;
+    viewer->top  = viewer->top < 0 ? 0 : maxTop < viewer->top ? maxTop : viewer->top;
+}
+
+
+/// Zoom the image in or out around the center of the view.
+void setViewerZoom(Viewer* viewer, Int zoom)
+{
+    zoom = zoom < 0 ? 0 : viewer->maxZoom < zoom ? viewer->maxZoom : zoom;
+
+    // Position of the center of the view relative to the zoomed image
+    double centerX = 0.0, centerY = 0.0;
+    if (viewer->scaledWidth && viewer->scaledHeight) {
+        centerX = (viewer->left + 0.5 * (viewer->viewWidth < viewer->scaledWidth ? viewer->viewWidth : viewer->scaledWidth)) / viewer->scaledWidth;
+        centerY = (viewer->top + 0.5 * (viewer->viewHeight < viewer->scaledHeight ? viewer->viewHeight : viewer->scaledHeight)) / viewer->scaledHeight;
+    }
+
+    viewer->zoom         = zoom;
+    viewer->scaledWidth  = viewer->fitWidth << zoom;
+    viewer->scaledHeight = viewer->fitHeight << zoom;
+    viewer->left         = (Int)(centerX * viewer->scaledWidth - 0.5 * viewer->viewWidth + 0.5);
+    viewer->top          = (Int)(centerY * viewer->scaledHeight - 0.5 * viewer->viewHeight + 0.5);
+    _clampViewer(viewer);
+}
+
+
+/// Fit the image to the current size of the terminal (keeping the zoom and the center of the view).
+Bool fitViewer(Viewer* viewer)
+{
+    Parameters parameters = *viewer->parameters;
+    parameters.terminalWidth  = 0; // <-- query the new size
+    parameters.terminalHeight = 0;
+    getFinalImageSize(&parameters, viewer->pyramid->widths[0], viewer->pyramid->heights[0]);
+    if (parameters.width <= 0 || parameters.height <= 0)
+        return PTERM_FALSE; // <-- nothing fits
+
+    viewer->viewWidth  = parameters.terminalWidth;
+    viewer->viewHeight = parameters.terminalHeight; // <-- the last row shows the status
+    viewer->fitWidth   = parameters.width;
+    viewer->fitHeight  = parameters.height;
+
+    // Zoom in up to twice the resolution of the image
+    const Int originalWidth = viewer->pyramid->widths[0];
+    for (viewer->maxZoom=0; viewer->maxZoom<16; ++viewer->maxZoom)
+        if (2 * originalWidth < (viewer->fitWidth << (viewer->maxZoom + 1)) * viewer->cellColumns)
+            break;
+
+    setViewerZoom(viewer, viewer->zoom);
+    return PTERM_TRUE;
+}
+
+
+/** Show an image on the alternate screen and pan and zoom around it with the keyboard of the terminal.
+ *  The image is decoded once into a pyramid (see @ref{buildImagePyramid}). Each zoom level is resized
+ *  and encoded lazily, tile by tile, and the encoded tiles are cached: vertical pans scroll the screen
+ *  and write only the exposed rows, and any frame only encodes the tiles it shows for the first time.
+ */
+Int viewImage(const Parameters* p_parameters)
+{
+    viewerTerminal = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (viewerTerminal < 0 || tcgetattr(viewerTerminal, &viewerTerminalSettings)) {
+        puts("Error: the viewer reads keys from a terminal");
+        return PTERM_ENVIRONMENT_ERROR;
+    }
+
+    ImagePyramid pyramid;
+    Int result = loadImagePyramid(p_parameters, &pyramid, PTERM_TRUE);
+    if (result != PTERM_SUCCESS) {
+        close(viewerTerminal);
+        return result;
+    }
+
+    Viewer viewer;
+    memset(&viewer, 0, sizeof(viewer));
+    viewer.parameters = p_parameters;
+    viewer.pyramid    = &pyramid;
+    getCellResolution(p_parameters->renderMode, &viewer.cellColumns, &viewer.cellRows);
+
+    // Keys are read one by one without echo (Ctrl-C included)
+    struct termios settings = viewerTerminalSettings;
+    settings.c_lflag    &= ~(ICANON | ECHO | ISIG);
+    settings.c_cc[VMIN]  = 1;
+    settings.c_cc[VTIME] = 0;
+    tcsetattr(viewerTerminal, TCSAFLUSH, &settings);
+
+    // SIGWINCH is only let through while waiting, so that no resize goes unnoticed
+    sigset_t resizeSignals, waitSignals;
+    sigemptyset(&resizeSignals);
+    sigaddset(&resizeSignals, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &resizeSignals, &waitSignals);
+    sigdelset(&waitSignals, SIGWINCH);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onTerminalResize;
+    sigaction(SIGWINCH, &action, NULL);
+
+    signal(SIGTERM, onViewerInterrupt);
+    signal(SIGHUP, onViewerInterrupt);
+    struct iovec chunk = {(void*) ansiEnterPlayback, ansiEnterPlaybackSize};
+    writeChunks(STDOUT_FILENO, &chunk, 1);
+
+    for (isTerminalResized = 1; result == PTERM_SUCCESS; ) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(viewerTerminal, &readable);
+        const Int numberOfReadable = isTerminalResized ? 0 : pselect(viewerTerminal + 1, &readable, NULL, NULL, NULL, &waitSignals);
+
+        if (isTerminalResized) {
+            isTerminalResized = 0;
+            if (fitViewer(&viewer))
+                result = drawViewer(&viewer, PTERM_TRUE, 0);
+            continue;
+        }
+
+        if (numberOfReadable <= 0)
+            continue;
+
+        // Handle every key read so far in a single frame
+        UChar keys[64];
+        const ssize_t numberOfKeys = read(viewerTerminal, keys, sizeof(keys));
+        if (numberOfKeys <= 0)
+            break;
+
+        Int columns = 0, rows = 0, zoom = 0;
+        Bool isDone = PTERM_FALSE;
+        for (ssize_t keyIndex=0; keyIndex<numberOfKeys; ++keyIndex) {
+            UChar key = keys[keyIndex];
+            if (key == '\e' && keyIndex + 2 < numberOfKeys && (keys[keyIndex+1] == '[' || keys[keyIndex+1] == 'O')) {
+                keyIndex += 2;
+                while (keyIndex + 1 < numberOfKeys && 0x30 <= keys[keyIndex] && keys[keyIndex] <= 0x3F) // <-- skip parameters
+                    ++keyIndex;
+                key = keys[keyIndex] == 'A' ? 'k' : keys[keyIndex] == 'B' ? 'j' : keys[keyIndex] == 'C' ? 'l' : keys[keyIndex] == 'D' ? 'h' : 0;
+            }
+
+            switch (key) {
+                case 'h': --columns; break;
+                case 'l': ++columns; break;
+                case 'k': --rows; break;
+                case 'j': ++rows; break;
+                case '+': case '=': ++zoom; break;
+                case '-': case '_': --zoom; break;
+                case 'q': case 'Q': case '\e': case 3: isDone = PTERM_TRUE; break; // <-- ESC alone, Ctrl-C
+                default: break;
+            }
+        }
+
+        if (isDone)
+            break;
+
+        const Int previousZoom = viewer.zoom, previousLeft = viewer.left, previousTop = viewer.top;
+        if (zoom)
+            setViewerZoom(&viewer, viewer.zoom + zoom);
+
+        viewer.left += columns * (viewer.viewWidth / 8 ? viewer.viewWidth / 8 : 1);
+        viewer.top  += rows * (viewer.viewHeight / 8 ? viewer.viewHeight / 8 : 1);
+        _clampViewer(&viewer);
+
+        const Int scrolledRows = viewer.top - previousTop;
+        if (viewer.zoom != previousZoom || viewer.left != previousLeft || viewer.viewHeight <= abs(scrolledRows)) {
+            result = drawViewer(&viewer, PTERM_TRUE, 0);
+        } else if (scrolledRows) {
+            result = drawViewer(&viewer, PTERM_FALSE, scrolledRows);
+        }
+    }
+
+    struct iovec chunks[2] = {
+        {(void*) ansiColorReset, ansiColorResetSize},
+        {(void*) ansiLeavePlayback, ansiLeavePlaybackSize}
+    };
+    writeChunks(STDOUT_FILENO, chunks, 2);
+    tcsetattr(viewerTerminal, TCSAFLUSH, &viewerTerminalSettings);
+    close(viewerTerminal);
+
+    for (UInt tileIndex=0; tileIndex<viewer.numberOfTiles; ++tileIndex)
+        free(viewer.tiles[tileIndex].text);
+    free(viewer.tiles);
+    free(viewer.visibleTiles);
+    free(viewer.pendingTiles);
+    free(viewer.output);
+    freeImagePyramid(&pyramid);
+    free(pyramid.levels[0]);
+    return result;
+}
+#endif
+
+
+
+/// --- VIDEO STREAMS --- ///
+
+/** Play raw video from stdin (or a file) in place while it is being read (see @ref{VideoStream}).
+ *  Frames are resized and encoded one at a time as the stream reads ahead, and presented every
+ *  1/frame rate seconds (or as soon as they are ready without a frame rate). Late frames are dropped
+ *  if the next one has been read already, and frames that look like the one on screen once resized
+ *  are not drawn again. Memory does not depend on the length of the stream.
+ */
+Int playStream(Parameters* p_parameters)
+{
+    FILE* file = NULL;
+    Int fileDescriptor = STDIN_FILENO;
+    if (p_parameters->fileName) {
+        file = fopen(p_parameters->fileName, "rb");
+        if (!file) {
+            printf("Error: failed to open %s\n", p_parameters->fileName);
+            return PTERM_INPUT_ERROR;
+        }
+        #ifdef _WIN32
+        fileDescriptor = _fileno(file);
+        #else
+        fileDescriptor = fileno(file);
+        #endif
+    }
+
+    Int width = p_parameters->videoWidth, height = p_parameters->videoHeight;
+    double frameRate = 0.0;
+    VideoStream* stream = openVideoStream(fileDescriptor, p_parameters->streamFormat, &width, &height, &frameRate);
+    if (!stream) {
+        puts("Error: invalid or unsupported video stream");
+        if (file)
+            fclose(file);
+        return PTERM_INPUT_ERROR;
+    }
+
+    if (p_parameters->frameRate)
+        frameRate = p_parameters->frameRate;
+
+    getFinalImageSize(p_parameters, width, height);
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(p_parameters->renderMode, &cellColumns, &cellRows);
+    const Int sampledWidth        = p_parameters->width * cellColumns;
+    const Int sampledHeight       = p_parameters->height * cellRows;
+    const size_t resizedFrameSize = (size_t) sampledWidth * sampledHeight * 4;
+
+    // The frame on screen is kept to spot repeats, the next one is resized next to it
+    UChar* resizedFrames[2] = {(UChar*) malloc(resizedFrameSize), (UChar*) malloc(resizedFrameSize)};
+    if (!resizedFrames[0] || !resizedFrames[1]) {
+        printf("Error: failed to allocate memory for resized frames (%lub)\n", 2 * resizedFrameSize);
+        exit(PTERM_MEMORY_ERROR);
+    }
+
+    IORing ring;
+    openIORing(&ring, 4);
+
+    signal(SIGINT, onPlaybackInterrupt);
+    signal(SIGTERM, onPlaybackInterrupt);
+    struct iovec chunk = {(void*) ansiEnterPlayback, ansiEnterPlaybackSize};
+    writeChunks(STDOUT_FILENO, &chunk, 1);
+
+    // Outputs are double buffered: a frame is encoded while the previous one is being written
+    UChar* outputs[2] = {NULL, NULL};
+    struct iovec chunkBuffers[2][3];
+    const UChar* shownFrame    = NULL;
+    const double frameDuration = 0.0 < frameRate ? 1.0 / frameRate : 0.0;
+    double deadline            = 0.0;
+    UInt resizedIndex = 0, outputIndex = 0;
+    Int result = PTERM_SUCCESS;
+
+    for (UInt frameIndex=0; result == PTERM_SUCCESS; ++frameIndex) {
+        const UChar* frame = acquireVideoFrame(stream);
+        if (!frame)
+            break;
+
+        traceFrameIndex = frameIndex;
+        deadline = frameIndex && frameDuration ? deadline + frameDuration : getMonotonicTime();
+
+        // Skip frames if the next one is already due (and read)
+        if (frameIndex && frameDuration && deadline + frameDuration < getMonotonicTime() && getNumberOfBufferedFrames(stream)) {
+            releaseVideoFrame(stream);
+            if (pipelineStats) {
+                ++pipelineStats->framesDropped;
+            }
+            continue;
+        }
+
+        UChar* resizedFrame = resizedFrames[resizedIndex];
+        if (sampledWidth == width && sampledHeight == height) {
+            memcpy(resizedFrame, frame, resizedFrameSize);
+        } else {
+            result = resizeImage(frame, resizedFrame, width, height, 4, sampledWidth, sampledHeight);
+        }
+        releaseVideoFrame(stream);
+
+        // A repeat of the frame on screen just stays up until the next frame is due
+        if (result != PTERM_SUCCESS || (shownFrame && memcmp(resizedFrame, shownFrame, resizedFrameSize) == 0)) {
+            if (result == PTERM_SUCCESS && pipelineStats) {
+                ++pipelineStats->framesMerged;
+            }
+            continue;
+        }
+
+        const double encodeBegin = beginStage();
+        UInt outputSize = 0;
+        free(outputs[outputIndex]); // <-- written two frames ago, the last submit waited for it
+        result = encodeImage(p_parameters, resizedFrame, outputs + outputIndex, &outputSize);
+        endStage(PTERM_STAGE_ENCODE, encodeBegin);
+        if (result != PTERM_SUCCESS)
+            break;
+
+        struct iovec* chunks = chunkBuffers[outputIndex];
+        chunks[0].iov_base = (void*) ansiFrameBegin;
+        chunks[0].iov_len  = ansiFrameBeginSize;
+        chunks[1].iov_base = outputs[outputIndex];
+        chunks[1].iov_len  = outputSize;
+        chunks[2].iov_base = (void*) ansiFrameEnd;
+        chunks[2].iov_len  = ansiFrameEndSize;
+
+        double sleepTime = deadline - getMonotonicTime();
+        if (0 < sleepTime) {
+            usleep(1e6 * sleepTime);
+        } else if (pipelineStats && frameIndex && frameDuration && 1e-3 < -sleepTime) {
+            ++pipelineStats->framesLate;
+            if (pipelineStats->maximumLateness < -sleepTime) {
+                pipelineStats->maximumLateness = -sleepTime;
+            }
+        }
+
+        if (pipelineStats) {
+            ++pipelineStats->framesRendered;
+            pipelineStats->cellsEncoded += p_parameters->width * p_parameters->height;
+            pipelineStats->bytesWritten += ansiFrameBeginSize + outputSize + ansiFrameEndSize;
+        }
+
+        const double writeBegin = beginStage();
+        result = submitChunks(&ring, STDOUT_FILENO, chunks, 3);
+        endStage(PTERM_STAGE_WRITE, writeBegin);
+
+        shownFrame   = resizedFrame;
+        resizedIndex = 1 - resizedIndex;
+        outputIndex  = 1 - outputIndex;
+    }
+
+    const double writeBegin = beginStage();
+    if (waitForChunks(&ring) != PTERM_SUCCESS && result == PTERM_SUCCESS) {
+        result = PTERM_IO_ERROR;
+    }
+    endStage(PTERM_STAGE_WRITE, writeBegin);
+    closeIORing(&ring);
+
+    // Hold merged trailing frames for their durations too
+    const double holdTime = deadline + frameDuration - getMonotonicTime();
+    if (result == PTERM_SUCCESS && 0 < holdTime) {
+        usleep(1e6 * holdTime);
+    }
+
+    struct iovec chunks[2] = {
+        {(void*) ansiColorReset, ansiColorResetSize},
+        {(void*) ansiLeavePlayback, ansiLeavePlaybackSize}
+    };
+    writeChunks(STDOUT_FILENO, chunks, 2);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    closeVideoStream(stream);
+    if (file)
+        fclose(file);
+
+    free(outputs[0]);
+    free(outputs[1]);
+    free(resizedFrames[0]);
+    free(resizedFrames[1]);
+
+    if (result != PTERM_SUCCESS)
+        printf("Error: failed to play the video stream (%i)\n", result);
+    return result;
+}
+
+
+
+/// --- SERVER --- ///
+
+#ifdef __linux__
+/// First frame of a file decoded at full resolution, with its pyramid
+typedef struct
+{
+    Char*              path;                // <-- key: absolute path ...
+    unsigned long long modificationTime;    // <-- ... and version of the file
+    unsigned long long fileSize;
+    ImagePyramid       pyramid;
+    size_t             numberOfBytes;
+    UInt               numberOfUsers;       // <-- workers resizing it
+    Bool               isCached;            // <-- evicted images are freed by their last user
+    Bool               isLoading;           // <-- other workers wait for it rather than decoding it again
+    Int                status;              // <-- of the decoding
+    size_t             lastUse;
+} ServerImage;
+
+
+/// Encoded response to a request, sent straight from the cache to every connection asking for it
+typedef struct
+{
+    unsigned long long hash;                // <-- of the whole key
+    Char*              path;                // <-- key: image ...
+    unsigned long long modificationTime;
+    unsigned long long fileSize;
+    Int                width;               // <-- ... requested size in cells (0: from the other one) ...
+    Int                height;
+    Int                renderMode;          // <-- ... and render mode
+    UChar*             text;
+    UInt               size;
+    UInt               numberOfUsers;       // <-- connections sending it
+    Bool               isCached;            // <-- evicted outputs are freed by their last user
+    size_t             lastUse;
+} ServerOutput;
+
+
+/// Client connection: one request line in, one rendered image (or error line) out
+typedef struct serverConnection
+{
+    Int                      fileDescriptor;
+    Char                     request[PTERM_SERVER_REQUEST_SIZE];
+    UInt                     requestSize;
+    ServerOutput             key;           // <-- parsed request (the text is unused)
+    ServerOutput*            output;        // <-- response being sent ...
+    const Char*              error;         // <-- ... or error message
+    size_t                   numberOfBytesSent;
+    struct serverConnection* nextJob;       // <-- queue of requests to render, then of rendered requests
+    struct serverConnection* previous;      // <-- list of open connections
+    struct serverConnection* next;
+} ServerConnection;
+
+
+typedef struct
+{
+    const Parameters* parameters;
+    Int               epollDescriptor;
+    Int               listenDescriptor;
+    Int               eventDescriptor;      // <-- eventfd: workers finished requests
+    Int               signalDescriptor;     // <-- signalfd: SIGINT and SIGTERM
+    pthread_mutex_t   lock;                 // <-- guards the queues and the caches
+    pthread_cond_t    condition;            // <-- requests were queued, or the server stops
+    pthread_cond_t    imageCondition;       // <-- an image has been decoded
+    ServerConnection* firstJob;             // <-- requests waiting for a worker
+    ServerConnection* lastJob;
+    ServerConnection* finishedJobs;         // <-- rendered requests waiting to be sent
+    ServerConnection* connections;
+    ServerImage**     images;
+    UInt              numberOfImages;
+    size_t            numberOfImageBytes;
+    ServerOutput**    outputs;
+    UInt              numberOfOutputs;
+    size_t            numberOfOutputBytes;
+    size_t            clock;                // <-- use counter of the caches (least recently used go first)
+    Bool              isStopping;
+} Server;
+
+
+/// Parse a "<width>x<height> <mode> <path>" request into the key of its response (false and an error message if invalid).
+Bool _parseServerRequest(ServerConnection* connection)
+{
+    ServerOutput* key = &connection->key;
+    Char mode[16];
+    Int offset = 0;
+    if (sscanf(connection->request, "%dx%d %15s %n", &key->width, &key->height, mode, &offset) != 3 || !offset) {
+        connection->error = "Error: expecting <width>x<height> <mode> <path>\n";
+        return PTERM_FALSE;
+    }
+
+    if (key->width < 0 || key->height < 0 || (!key->width && !key->height) || 65535 < key->width || 65535 < key->height) {
+        connection->error = "Error: invalid size\n";
+        return PTERM_FALSE;
+    }
+
+    if (!parseRenderMode(mode, &key->renderMode)) {
+        connection->error = "Error: unknown render mode\n";
+        return PTERM_FALSE;
+    }
+
+    Char* path = connection->request + offset;
+    const size_t pathSize = strlen(path);
+    if (pathSize && path[pathSize-1] == '\r')
+        path[pathSize-1] = '\0';
+
+    if (!_statThumbnailSource(path, &key->path, &key->modificationTime, &key->fileSize)) {
+        connection->error = "Error: cannot read the file\n";
+        return PTERM_FALSE;
+    }
+
+    unsigned long long hash = _hashBytes(0xcbf29ce484222325ull, key->path, strlen(key->path));
+    hash = _hashBytes(hash, &key->modificationTime, sizeof(key->modificationTime));
+    hash = _hashBytes(hash, &key->fileSize, sizeof(key->fileSize));
+    hash = _hashBytes(hash, &key->width, sizeof(key->width));
+    hash = _hashBytes(hash, &key->height, sizeof(key->height));
+    key->hash = _hashBytes(hash, &key->renderMode, sizeof(key->renderMode));
+    return PTERM_TRUE;
+}
+
+
+/// Find and use a cached response (the lock must be held).
+ServerOutput* _findServerOutput(Server* server, const ServerOutput* key)
+{
+    for (UInt outputIndex=0; outputIndex<server->numberOfOutputs; ++outputIndex) {
+        ServerOutput* output = server->outputs[outputIndex];
+        if (output->hash == key->hash
+            && output->width == key->width
+            && output->height == key->height
+            && output->renderMode == key->renderMode
+            && output->modificationTime == key->modificationTime
+            && output->fileSize == key->fileSize
+            && strcmp(output->path, key->path) == 0) {
+            ++output->numberOfUsers;
+            output->lastUse = ++server->clock;
+            return output;
+        }
+    }
+    return NULL;
+}
+
+
+/// Stop using a response, and free it if it has been evicted (the lock must be held).
+void _releaseServerOutput(ServerOutput* output)
+{
+    if (!--output->numberOfUsers && !output->isCached) {
+        free(output->path);
+        free(output->text);
+        free(output);
+    }
+}
+
+
+/// Evict the least recently used responses beyond PTERM_SERVER_OUTPUT_CACHE_LIMIT (the lock must be held).
+void _evictServerOutputs(Server* server)
+{
+    while (PTERM_SERVER_OUTPUT_CACHE_LIMIT < server->numberOfOutputBytes && server->numberOfOutputs) {
+        UInt oldest = 0;
+        for (UInt outputIndex=1; outputIndex<server->numberOfOutputs; ++outputIndex) {
+            if (server->outputs[outputIndex]->lastUse < server->outputs[oldest]->lastUse)
+                oldest = outputIndex;
+        }
+
+        ServerOutput* output = server->outputs[oldest];
+        server->outputs[oldest] = server->outputs[--server->numberOfOutputs];
+        server->numberOfOutputBytes -= output->size;
+        output->isCached = PTERM_FALSE;
+        ++output->numberOfUsers; // <-- freed right away if unused
+        _releaseServerOutput(output);
+    }
+}
+
+
+/// Stop using an image, and free it if it has been evicted (the lock must be held).
+void _releaseServerImage(ServerImage* image)
+{
+    if (!--image->numberOfUsers && !image->isCached) {
+        UChar* data = image->pyramid.levels[0];
+        freeImagePyramid(&image->pyramid);
+        free(data);
+        free(image->path);
+        free(image);
+    }
+}
+
+
+/// Evict the least recently used images beyond PTERM_SERVER_IMAGE_CACHE_LIMIT (the lock must be held).
+void _evictServerImages(Server* server)
+{
+    while (PTERM_SERVER_IMAGE_CACHE_LIMIT < server->numberOfImageBytes && server->numberOfImages) {
+        UInt oldest = 0;
+        for (UInt imageIndex=1; imageIndex<server->numberOfImages; ++imageIndex) {
+            if (server->images[imageIndex]->lastUse < server->images[oldest]->lastUse)
+                oldest = imageIndex;
+        }
+
+        ServerImage* image = server->images[oldest];
+        server->images[oldest] = server->images[--server->numberOfImages];
+        server->numberOfImageBytes -= image->numberOfBytes;
+        image->isCached = PTERM_FALSE;
+        ++image->numberOfUsers; // <-- freed right away if unused
+        _releaseServerImage(image);
+    }
+}
+
+
+/// Find a decoded image in the cache (waiting if another worker is decoding it), or decode it and cache it.
+ServerImage* _acquireServerImage(Server* server, const ServerOutput* key, Int* status)
+{
+    pthread_mutex_lock(&server->lock);
+    for (UInt imageIndex=0; imageIndex<server->numberOfImages; ++imageIndex) {
+        ServerImage* image = server->images[imageIndex];
+        if (image->modificationTime == key->modificationTime && image->fileSize == key->fileSize && strcmp(image->path, key->path) == 0) {
+            ++image->numberOfUsers;
+            image->lastUse = ++server->clock;
+            while (image->isLoading)
+                pthread_cond_wait(&server->imageCondition, &server->lock);
+
+            *status = image->status;
+            if (*status != PTERM_SUCCESS) {
+                _releaseServerImage(image);
+                image = NULL;
+            }
+            pthread_mutex_unlock(&server->lock);
+            return image;
+        }
+    }
+
+    // The image is decoded outside of the lock, and cached right away for other requests to wait for
+    ServerImage* image = (ServerImage*) calloc(1, sizeof(ServerImage));
+    ServerImage** images = (ServerImage**) realloc(server->images, (server->numberOfImages + 1) * sizeof(ServerImage*));
+    server->images = images ? images : server->images;
+    if (!image || !images || !(image->path = strdup(key->path))) {
+        pthread_mutex_unlock(&server->lock);
+        free(image);
+        *status = PTERM_MEMORY_ERROR;
+        return NULL;
+    }
+
+    image->modificationTime = key->modificationTime;
+    image->fileSize         = key->fileSize;
+    image->numberOfUsers    = 1;
+    image->isCached         = PTERM_TRUE;
+    image->isLoading        = PTERM_TRUE;
+    image->lastUse          = ++server->clock;
+    server->images[server->numberOfImages++] = image;
+    pthread_mutex_unlock(&server->lock);
+
+    Parameters parameters = *server->parameters;
+    parameters.fileName  = key->path;
+    parameters.extension = (Char*) fileExtension(key->path);
+    *status = loadImagePyramid(&parameters, &image->pyramid, PTERM_FALSE); // <-- the status goes back in the response
+    for (UInt level=0; *status == PTERM_SUCCESS && level<image->pyramid.numberOfLevels; ++level)
+        image->numberOfBytes += (size_t) image->pyramid.widths[level] * image->pyramid.heights[level] * image->pyramid.numberOfChannels;
+
+    pthread_mutex_lock(&server->lock);
+    image->isLoading = PTERM_FALSE;
+    image->status    = *status;
+    pthread_cond_broadcast(&server->imageCondition);
+
+    if (*status != PTERM_SUCCESS) { // <-- failures are not cached (the file may be fixed without a new version)
+        for (UInt imageIndex=0; image->isCached && imageIndex<server->numberOfImages; ++imageIndex) {
+            if (server->images[imageIndex] == image) {
+                server->images[imageIndex] = server->images[--server->numberOfImages];
+                image->isCached = PTERM_FALSE;
+            }
+        }
+        _releaseServerImage(image);
+        image = NULL;
+    } else if (image->isCached) {
+        server->numberOfImageBytes += image->numberOfBytes;
+        _evictServerImages(server); // <-- images beyond the limit are only used by the requests waiting for them
+    }
+    pthread_mutex_unlock(&server->lock);
+    return image;
+}
+
+
+/// Render the response to a request, or find it in the cache (on a worker thread).
+void _renderServerRequest(Server* server, ServerConnection* connection)
+{
+    const ServerOutput* key = &connection->key;
+    pthread_mutex_lock(&server->lock);
+    ServerOutput* output = _findServerOutput(server, key); // <-- rendered since it was queued
+    pthread_mutex_unlock(&server->lock);
+    if (output) {
+        connection->output = output;
+        return;
+    }
+
+    Int status = PTERM_SUCCESS;
+    ServerImage* image = _acquireServerImage(server, key, &status);
+    if (!image) {
+        connection->error = status == PTERM_MEMORY_ERROR ? "Error: out of memory\n" : "Error: cannot decode the file\n";
+        return;
+    }
+
+    Parameters parameters = *server->parameters;
+    parameters.width          = key->width;
+    parameters.height         = key->height;
+    parameters.renderMode     = key->renderMode;
+    parameters.backgroundOnly = key->renderMode == PTERM_RENDER_BACKGROUND;
+    getFinalImageSize(&parameters, image->pyramid.widths[0], image->pyramid.heights[0]);
+
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(parameters.renderMode, &cellColumns, &cellRows);
+    const Int sampledWidth  = parameters.width * cellColumns;
+    const Int sampledHeight = parameters.height * cellRows;
+
+    output = (ServerOutput*) calloc(1, sizeof(ServerOutput));
+    if (output) {
+        *output = *key;
+        output->path = strdup(key->path);
+    }
+
+    if (!output || !output->path) {
+        status = PTERM_MEMORY_ERROR;
+    } else if (0 < sampledWidth && 0 < sampledHeight) { // <-- otherwise nothing fits: the response is empty
+        UChar* frame = (UChar*) malloc((size_t) sampledWidth * sampledHeight * 4);
+        status = frame ? resizeImageFromPyramid(&image->pyramid, frame, sampledWidth, sampledHeight) : PTERM_MEMORY_ERROR;
+        if (status == PTERM_SUCCESS)
+            status = encodeImage(&parameters, frame, &output->text, &output->size);
+        free(frame);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    _releaseServerImage(image);
+
+    if (status != PTERM_SUCCESS) {
+        pthread_mutex_unlock(&server->lock);
+        if (output) {
+            free(output->path);
+            free(output->text);
+            free(output);
+        }
+        connection->error = status == PTERM_MEMORY_ERROR ? "Error: out of memory\n" : "Error: cannot render the file\n";
+        return;
+    }
+
+    ServerOutput** outputs = (ServerOutput**) realloc(server->outputs, (server->numberOfOutputs + 1) * sizeof(ServerOutput*));
+    server->outputs = outputs ? outputs : server->outputs;
+    output->numberOfUsers = 1;
+    output->isCached      = outputs != NULL;
+    output->lastUse       = ++server->clock;
+    if (output->isCached) {
+        server->outputs[server->numberOfOutputs++] = output;
+        server->numberOfOutputBytes += output->size;
+        _evictServerOutputs(server);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    connection->output = output;
+}
+
+
+void* _serverWorker(void* p_server)
+{
+    Server* server = (Server*) p_server;
+    pthread_mutex_lock(&server->lock);
+    while (!server->isStopping) {
+        ServerConnection* connection = server->firstJob;
+        if (!connection) {
+            pthread_cond_wait(&server->condition, &server->lock);
+            continue;
+        }
+
+        server->firstJob = connection->nextJob;
+        pthread_mutex_unlock(&server->lock);
+
+        _renderServerRequest(server, connection);
+
+        pthread_mutex_lock(&server->lock);
+        connection->nextJob = server->finishedJobs;
+        server->finishedJobs = connection;
+        eventfd_write(server->eventDescriptor, 1); // <-- wakes up the event loop
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+
+/// Close a connection and stop using its response.
+void _closeServerConnection(Server* server, ServerConnection* connection)
+{
+    if (connection->previous)
+        connection->previous->next = connection->next;
+    else
+        server->connections = connection->next;
+    if (connection->next)
+        connection->next->previous = connection->previous;
+
+    close(connection->fileDescriptor); // <-- removes it from the epoll set as well
+
+    if (connection->output) {
+        pthread_mutex_lock(&server->lock);
+        _releaseServerOutput(connection->output);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    free(connection->key.path);
+    free(connection);
+}
+
+
+/** Send (the rest of) the response of a connection, which is closed once it is sent or if sending fails.
+ *  Otherwise the connection waits for the socket to accept more (the epoll set is changed with @p operation).
+ */
+void _sendServerResponse(Server* server, ServerConnection* connection, Int operation)
+{
+    struct iovec chunks[2];
+    UInt numberOfChunks = 0;
+    if (connection->output) {
+        chunks[numberOfChunks++] = (struct iovec) {connection->output->text, connection->output->size};
+        chunks[numberOfChunks++] = (struct iovec) {(void*) ansiColorReset, ansiColorResetSize};
+    } else {
+        chunks[numberOfChunks++] = (struct iovec) {(void*) connection->error, strlen(connection->error)};
+    }
+
+    // Skip what has been sent already
+    size_t skipped = connection->numberOfBytesSent;
+    UInt firstChunk = 0;
+    for (; firstChunk<numberOfChunks && chunks[firstChunk].iov_len <= skipped; ++firstChunk)
+        skipped -= chunks[firstChunk].iov_len;
+
+    while (firstChunk < numberOfChunks) {
+        chunks[firstChunk].iov_base = (UChar*) chunks[firstChunk].iov_base + skipped;
+        chunks[firstChunk].iov_len -= skipped;
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov    = chunks + firstChunk;
+        message.msg_iovlen = numberOfChunks - firstChunk;
+
+        const ssize_t bytesSent = sendmsg(connection->fileDescriptor, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytesSent < 0 && errno == EINTR)
+            continue;
+        if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct epoll_event event;
+            event.events   = EPOLLOUT;
+            event.data.ptr = connection;
+            if (epoll_ctl(server->epollDescriptor, operation, connection->fileDescriptor, &event) == 0)
+                return;
+        }
+        if (bytesSent <= 0)
+            break; // <-- the client is gone
+
+        connection->numberOfBytesSent += bytesSent;
+        skipped = bytesSent;
+        for (; firstChunk<numberOfChunks && chunks[firstChunk].iov_len <= skipped; ++firstChunk)
+            skipped -= chunks[firstChunk].iov_len;
+    }
+
+    _closeServerConnection(server, connection);
+}
+
+
+/// Read the request of a connection, and answer it from the cache or queue it for the workers once it is complete.
+void _readServerRequest(Server* server, ServerConnection* connection)
+{
+    Bool isComplete = PTERM_FALSE;
+    while (!isComplete) {
+        const UInt capacity = PTERM_SERVER_REQUEST_SIZE - 1 - connection->requestSize;
+        if (!capacity) {
+            connection->error = "Error: request too long\n";
+            _sendServerResponse(server, connection, EPOLL_CTL_MOD);
+            return;
+        }
+
+        const ssize_t bytesRead = recv(connection->fileDescriptor, connection->request + connection->requestSize, capacity, MSG_DONTWAIT);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // <-- wait for the rest
+        if (bytesRead < 0 || (!bytesRead && !connection->requestSize)) {
+            _closeServerConnection(server, connection);
+            return;
+        }
+
+        connection->request[connection->requestSize + bytesRead] = '\0';
+        Char* end = strchr(connection->request + connection->requestSize, '\n');
+        connection->requestSize += bytesRead;
+        if (end)
+            *end = '\0';
+        isComplete = end || !bytesRead; // <-- the end of the input ends the request as well
+    }
+
+    if (!_parseServerRequest(connection)) {
+        _sendServerResponse(server, connection, EPOLL_CTL_MOD);
+        return;
+    }
+
+    // Queued requests belong to the workers until they are finished (so they leave the epoll set first)
+    pthread_mutex_lock(&server->lock);
+    ServerOutput* output = _findServerOutput(server, &connection->key);
+    if (!output) {
+        epoll_ctl(server->epollDescriptor, EPOLL_CTL_DEL, connection->fileDescriptor, NULL);
+        connection->nextJob = NULL;
+        if (server->firstJob)
+            server->lastJob->nextJob = connection;
+        else
+            server->firstJob = connection;
+        server->lastJob = connection;
+        pthread_cond_signal(&server->condition);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (output) {
+        connection->output = output;
+        _sendServerResponse(server, connection, EPOLL_CTL_MOD);
+    }
+}
+
+
+/// Accept the pending connections of the listening socket.
+void _acceptServerConnections(Server* server)
+{
+    for (;;) {
+        const Int fileDescriptor = accept(server->listenDescriptor, NULL, NULL);
+        if (fileDescriptor < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // <-- EAGAIN, or out of file descriptors until connections close
+        }
+        fcntl(fileDescriptor, F_SETFL, O_NONBLOCK);
+        fcntl(fileDescriptor, F_SETFD, FD_CLOEXEC);
+
+        ServerConnection* connection = (ServerConnection*) calloc(1, sizeof(ServerConnection));
+        struct epoll_event event;
+        event.events   = EPOLLIN;
+        event.data.ptr = connection;
+        if (!connection || epoll_ctl(server->epollDescriptor, EPOLL_CTL_ADD, fileDescriptor, &event)) {
+            close(fileDescriptor);
+            free(connection);
+            continue;
+        }
+
+        connection->fileDescriptor = fileDescriptor;
+        connection->next           = server->connections;
+        if (server->connections)
+            server->connections->previous = connection;
+        server->connections = connection;
+    }
+}
+
+
+/// Bind a listening Unix socket, replacing a stale socket file left behind by a server that is gone.
+Int _listenOnSocket(const Char* socketName)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (sizeof(address.sun_path) <= strlen(socketName)) {
+        printf("Error: socket path too long: %s\n", socketName);
+        return -1;
+    }
+    strcpy(address.sun_path, socketName);
+
+    const Int fileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fileDescriptor < 0) {
+        puts("Error: failed to create the server socket");
+        return -1;
+    }
+
+    struct stat status;
+    if (lstat(socketName, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        const Int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const Bool isInUse = 0 <= probe && connect(probe, (struct sockaddr*) &address, sizeof(address)) == 0;
+        if (0 <= probe)
+            close(probe);
+        if (!isInUse)
+            unlink(socketName);
+    }
+
+    if (bind(fileDescriptor, (struct sockaddr*) &address, sizeof(address)) || listen(fileDescriptor, SOMAXCONN)) {
+        printf("Error: failed to listen on %s (%s)\n", socketName, strerror(errno));
+        close(fileDescriptor);
+        return -1;
+    }
+
+    return fileDescriptor;
+}
+
+
+/** Serve renders over a Unix socket until SIGINT or SIGTERM. Every connection sends one
+ *  "<width>x<height> <mode> <path>" line (sizes in cells, one of them may be 0) and receives the
+ *  encoded image, or a line starting with "Error:", before the server closes it.
+ *  The event loop only accepts, reads and sends; a pool of workers decodes and renders. Decoded
+ *  images (with their pyramids, so that any size resizes quickly) and encoded responses are kept
+ *  in memory, keyed by the path and version of the file, and responses are sent straight from
+ *  the cache.
+ */
+Int serveImages(const Parameters* p_parameters)
+{
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.parameters       = p_parameters;
+    server.eventDescriptor  = -1;
+    server.signalDescriptor = -1;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.condition, NULL);
+    pthread_cond_init(&server.imageCondition, NULL);
+
+    server.listenDescriptor = _listenOnSocket(p_parameters->socketName);
+    if (server.listenDescriptor < 0)
+        return PTERM_ENVIRONMENT_ERROR;
+
+    // Signals are read from the event loop
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL); // <-- before any worker starts, so that they inherit it
+
+    server.epollDescriptor  = epoll_create1(EPOLL_CLOEXEC);
+    server.eventDescriptor  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signalDescriptor = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    Int result = PTERM_SUCCESS;
+    Int* descriptors[3] = {&server.listenDescriptor, &server.eventDescriptor, &server.signalDescriptor};
+    for (UInt descriptorIndex=0; descriptorIndex<3; ++descriptorIndex) {
+        struct epoll_event event;
+        event.events   = EPOLLIN;
+        event.data.ptr = descriptors[descriptorIndex]; // <-- connections point to themselves instead
+        if (server.epollDescriptor < 0 || *descriptors[descriptorIndex] < 0
+            || epoll_ctl(server.epollDescriptor, EPOLL_CTL_ADD, *descriptors[descriptorIndex], &event)) {
+            result = PTERM_ENVIRONMENT_ERROR;
+        }
+    }
+
+    // Requests are the unit of parallelism; encoders run serially within each of them
+    UInt numberOfThreads = p_parameters->numberOfJobs ? (UInt) p_parameters->numberOfJobs : getNumberOfThreads();
+    if (1 < numberOfThreads)
+        numberOfWorkerThreads = 1;
+
+    pthread_t* threads = (pthread_t*) malloc(numberOfThreads * sizeof(pthread_t));
+    UInt numberOfStartedThreads = 0;
+    for (; threads && result == PTERM_SUCCESS && numberOfStartedThreads<numberOfThreads; ++numberOfStartedThreads) {
+        if (pthread_create(threads + numberOfStartedThreads, NULL, _serverWorker, &server))
+            break;
+    }
+    if (!numberOfStartedThreads)
+        result = PTERM_ENVIRONMENT_ERROR;
+
+    struct epoll_event events[64];
+    Bool isRunning = result == PTERM_SUCCESS;
+    while (isRunning) {
+        const Int numberOfEvents = epoll_wait(server.epollDescriptor, events, 64, -1);
+        if (numberOfEvents < 0 && errno != EINTR) {
+            result = PTERM_ENVIRONMENT_ERROR;
+            break;
+        }
+
+        for (Int eventIndex=0; eventIndex<numberOfEvents; ++eventIndex) {
+            void* source = events[eventIndex].data.ptr;
+            if (source == &server.listenDescriptor) {
+                _acceptServerConnections(&server);
+            } else if (source == &server.eventDescriptor) {
+                eventfd_t value = 0;
+                eventfd_read(server.eventDescriptor, &value);
+
+                pthread_mutex_lock(&server.lock);
+                ServerConnection* connection = server.finishedJobs;
+                server.finishedJobs = NULL;
+                pthread_mutex_unlock(&server.lock);
+
+                while (connection) {
+                    ServerConnection* next = connection->nextJob;
+                    _sendServerResponse(&server, connection, EPOLL_CTL_ADD);
+                    connection = next;
+                }
+            } else if (source == &server.signalDescriptor) {
+                isRunning = PTERM_FALSE;
+            } else {
+                ServerConnection* connection = (ServerConnection*) source;
+                if (connection->output || connection->error) {
+                    _sendServerResponse(&server, connection, EPOLL_CTL_MOD);
+                } else {
+                    _readServerRequest(&server, connection);
+                }
+            }
+        }
+    }
+
+    // Shut down: stop the workers (after their current request), then drop every connection and cache
+    pthread_mutex_lock(&server.lock);
+    server.isStopping = PTERM_TRUE;
+    pthread_cond_broadcast(&server.condition);
+    pthread_mutex_unlock(&server.lock);
+    for (UInt threadIndex=0; threadIndex<numberOfStartedThreads; ++threadIndex)
+        pthread_join(threads[threadIndex], NULL);
+    free(threads);
+
+    while (server.connections)
+        _closeServerConnection(&server, server.connections);
+
+    for (UInt outputIndex=0; outputIndex<server.numberOfOutputs; ++outputIndex) {
+        server.outputs[outputIndex]->isCached = PTERM_FALSE;
+        ++server.outputs[outputIndex]->numberOfUsers;
+        _releaseServerOutput(server.outputs[outputIndex]);
+    }
+    for (UInt imageIndex=0; imageIndex<server.numberOfImages; ++imageIndex) {
+        server.images[imageIndex]->isCached = PTERM_FALSE;
+        ++server.images[imageIndex]->numberOfUsers;
+        _releaseServerImage(server.images[imageIndex]);
+    }
+    free(server.outputs);
+    free(server.images);
+
+    close(server.listenDescriptor);
+    unlink(p_parameters->socketName);
+    if (0 <= server.epollDescriptor)
+        close(server.epollDescriptor);
+    if (0 <= server.eventDescriptor)
+        close(server.eventDescriptor);
+    if (0 <= server.signalDescriptor)
+        close(server.signalDescriptor);
+    pthread_cond_destroy(&server.condition);
+    pthread_cond_destroy(&server.imageCondition);
+    pthread_mutex_destroy(&server.lock);
+
+    if (result != PTERM_SUCCESS)
+        puts("Error: failed to start the server");
+    return result;
+}
+#endif
+
+
+
+int main(int argc, char const* argv[])
+{
+    // Init
+    Parameters parameters;
+    initializeParameters(&parameters);
+
+    if (!parseArguments(argc, argv, &parameters)) {
+        printHelp();
+        return PTERM_ARGUMENT_ERROR;
+    }
+
+    PipelineStats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (parameters.stats) {
+        pipelineStats = &stats;
+        #ifdef PTERM_PERF_COUNTERS
+        if (!openPerfCounters()) {
+            fputs("Warning: hardware counters are unavailable (check /proc/sys/kernel/perf_event_paranoid)\n", stderr);
+        }
+        #endif
+    }
+
+    if (parameters.traceFileName) {
+        startTrace(1 << 16);
+    }
+
+    // Query the terminal once (it is part of the cache keys as well)
+    if (!parameters.width && !parameters.height && (parameters.isBatch || parameters.cache)) {
+        queryTerminalSize(&parameters);
+    }
+
+    if (parameters.cache) {
+        openCache(parameters.cacheFileName);
+        free(parameters.cacheFileName);
+        parameters.cacheFileName = NULL;
+    }
+
+    #ifdef __linux__
+    if (parameters.socketName) {
+        Int serverOutput = serveImages(&parameters);
+        free(parameters.socketName);
+        free(parameters.extension);
+        return serverOutput;
+    }
+    #endif
+
+    #ifndef _WIN32
+    if (parameters.watch) {
+        return watchImage(&parameters);
+    }
+    if (parameters.view) {
+        return viewImage(&parameters);
+    }
+    #endif
+
+    if (parameters.isStream) {
+        Int streamOutput = playStream(&parameters);
+        free(parameters.fileName);
+        free(parameters.extension);
+
+        if (pipelineStats) {
+            printStats(pipelineStats, parameters.statsJSON);
+            closePerfCounters();
+            pipelineStats = NULL;
+        }
+
+        if (parameters.traceFileName) {
+            traceFrameIndex = -1;
+            Int traceOutput = writeTrace(parameters.traceFileName);
+            free(parameters.traceFileName);
+            if (streamOutput == PTERM_SUCCESS)
+                streamOutput = traceOutput;
+        }
+
+        return streamOutput;
+    }
+
+    if (parameters.isBatch) {
+        Int batchOutput = parameters.tileWidth ? renderGallery(&parameters) : renderBatch(&parameters);
+
+        for (Int fileIndex=0; fileIndex<parameters.numberOfFileNames; ++fileIndex)
+            free(parameters.fileNames[fileIndex]);
+        free(parameters.fileNames);
+        free(parameters.extension);
+
+        if (parameters.traceFileName) {
+            Int traceOutput = writeTrace(parameters.traceFileName);
+            free(parameters.traceFileName);
+            if (batchOutput == PTERM_SUCCESS)
+                batchOutput = traceOutput;
+        }
+
+        closeThumbnailCache(&thumbnailCache);
+        return batchOutput;
+    }
+
+    // Read image (and convert to RGB if necessary)
+    Int imageWidth=0, imageHeight=0, numberOfChannels=0, numberOfSourceChannels=0, numberOfFrames=0;
+    Int* delays = NULL;
+
+    // Block modes sample several subpixels per cell
+    Int cellColumns = 1, cellRows = 1;
+    getCellResolution(parameters.renderMode, &cellColumns, &cellRows);
+
+    const ThumbnailGeometry geometry = getThumbnailGeometry(&parameters);
+    UInt cachedWidth = 0, cachedHeight = 0;
+    const UChar* cachedImage = parameters.fileName ? findThumbnail(&thumbnailCache, parameters.fileName, &geometry, &cachedWidth, &cachedHeight) : NULL;
+
+    UChar* data = NULL;
+    Bool isRefining = PTERM_FALSE; // <-- a preview has been written and is redrawn by the first frame
+    Bool isPreview  = PTERM_FALSE; // <-- the early passes are rendered instead of the full image
+    if (cachedImage) {
+        imageWidth             = cachedWidth;
+        imageHeight            = cachedHeight;
+        numberOfChannels       = 4;
+        numberOfSourceChannels = 4;
+        numberOfFrames         = 1;
+        data   = (UChar*) malloc(cachedWidth * cachedHeight * numberOfChannels);
+        delays = (Int*) calloc(1, sizeof(Int));
+
+        if (!data || !delays) {
+            puts("Error: failed to allocate memory for cached image");
+            exit(PTERM_MEMORY_ERROR);
+        }
+        memcpy(data, cachedImage, cachedWidth * cachedHeight * numberOfChannels);
+    } else if (parameters.fileName && streamImageFile(&parameters,
+                                                      parameters.fileName,
+                                                      &data,
+                                                      &numberOfFrames,
+                                                      &delays,
+                                                      &imageWidth,
+                                                      &imageHeight,
+                                                      &numberOfSourceChannels,
+                                                      &numberOfChannels) == PTERM_SUCCESS) {
+        // <-- huge PNG, decoded straight to the output size
+    } else if (parameters.fileName || parameters.extension) {
+        UInt size = 0;
+        if (parameters.fileName) {
+            data = loadFile(parameters.fileName, &size);
+        } else {
+            readPipe(&data, &size);
+        }
+
+        Bool isDecoded = PTERM_FALSE;
+        if (data && parameters.preview) {
+            isPreview = isDecoded = previewImage(&parameters,
+                                     &data,
+                                     size,
+                                     &numberOfFrames,
+                                     &delays,
+                                     &imageWidth,
+                                     &imageHeight,
+                                     &numberOfSourceChannels,
+                                     &numberOfChannels,
+                                     &isRefining);
+        }
+
+        Int conversionOutput = data ? PTERM_SUCCESS : PTERM_INPUT_ERROR;
+        if (data && !isDecoded) {
+            conversionOutput = decodeImage(&parameters,
+                                           &data,
+                                           size,
+                                           parameters.extension,
+                                           &numberOfFrames,
+                                           &delays,
+                                           &imageWidth,
+                                           &imageHeight,
+                                           &numberOfSourceChannels,
+                                           &numberOfChannels);
+        }
+
+        if (conversionOutput != PTERM_SUCCESS && parameters.fileName) {
+            printf("Error: failed to load %s\n", parameters.fileName);
+            exit(PTERM_INPUT_ERROR);
+        } else if (conversionOutput != PTERM_SUCCESS) {
+            printf("Error: failed to convert image from stdin (%i)\n", conversionOutput);
+            exit(conversionOutput);
+        }
+    } else {
+        puts("Error: no input");
+        printHelp();
+        exit(PTERM_INPUT_ERROR);
+    }
+
+    if (parameters.extension) {
+        free(parameters.extension);
+        parameters.extension = NULL;
+    }
+
+    if (numberOfChannels != 4) {
+        PTERM_DEBUG_PRINTF("Error: invalid number of channels (%i)\n", numberOfChannels);
+        exit(PTERM_FAIL);
+    }
+
+    // Cached images already have the target size (decodeImage sets it otherwise)
+    if (cachedImage) {
+        parameters.width  = imageWidth / cellColumns;
+        parameters.height = imageHeight / cellRows;
+    }
+
+    const Bool isBlockMode = parameters.renderMode == PTERM_RENDER_QUADRANT || parameters.renderMode == PTERM_RENDER_SEXTANT;
+    const Int sampledWidth = parameters.width * cellColumns;
+    const Int sampledHeight = parameters.height * cellRows;
+
+    UChar* frame = data;
+    UChar* resizedImage;
+    UChar* resizedFrame;
+    UInt resizedFrameSize = sampledWidth * sampledHeight * numberOfChannels;
+    UInt frameSize = imageWidth*imageHeight*numberOfChannels;
+
+    // Repeated frames (pauses, loops within the animation) are resized and encoded once
+    UInt* frameSources = (UInt*) malloc(numberOfFrames * sizeof(UInt));
+    if (!frameSources) {
+        printf("Error: failed to allocate memory for %i frames\n", numberOfFrames);
+        exit(PTERM_MEMORY_ERROR);
+    }
+    const UInt numberOfDistinctFrames = findDuplicateFrames(data, numberOfFrames, frameSize, frameSources);
+    PTERM_DEBUG_PRINTF("%u distinct frames out of %u\n", numberOfDistinctFrames, numberOfFrames);
+
+    // Resize frames if necessary
+    if (sampledWidth!=imageWidth || sampledHeight!=imageHeight) {
+        resizedImage = (UChar*) malloc(resizedFrameSize * numberOfFrames);
+        resizedFrame = resizedImage;
+
+        if (!resizedImage) {
+            printf("Error: failed to allocate memory for resized image (%ib)", resizedFrameSize * numberOfFrames);
+            exit(PTERM_MEMORY_ERROR);
+        }
+
+        for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex, frame+=frameSize, resizedFrame+=resizedFrameSize) {
+            if (frameSources[frameIndex] != frameIndex)
+                continue;
+
+            traceFrameIndex = frameIndex;
+            Int resizeOutput = resizeImage(
+                frame,
+                resizedFrame,
+                imageWidth,
+                imageHeight,
+                numberOfChannels,
+                sampledWidth,
+                sampledHeight
+            );
+
+            if (resizeOutput)
+                exit(resizeOutput);
+        }
+
+        free(data);
+    } else { // no resizing needed
+        resizedImage = data;
+        resizedFrame = resizedImage;
+    }
+
+    if (!cachedImage && !isPreview && parameters.fileName && numberOfFrames == 1 && 0 <= thumbnailCache.fileDescriptor) {
+        storeThumbnail(&thumbnailCache, parameters.fileName, &geometry, resizedImage, sampledWidth, sampledHeight);
+    }
+    closeThumbnailCache(&thumbnailCache);
+
+    if (parameters.fileName) {
+        free(parameters.fileName);
+        parameters.fileName = NULL;
+    }
+
+    // Outputs are double buffered: a frame is encoded while the previous one is being written
+    UInt outputSize = 0;
+    UChar* outputs[2] = {NULL, NULL};
+    struct iovec* chunkBuffers[2] = {NULL, NULL};
+    UInt* rowSizeBuffers[2] = {NULL, NULL};
+
+    for (Int bufferIndex=0; bufferIndex<2; ++bufferIndex) {
+        if (isBlockMode) {
+            allocateBlockTextImage(outputs + bufferIndex, &outputSize, parameters.width, parameters.height);
+        } else {
+            allocateANSITextImage(outputs + bufferIndex, &outputSize, parameters.width, parameters.height);
+        }
+
+        if (!outputs[bufferIndex]) {
+            printf("Error: failed to allocate output of size %i\n", outputSize);
+            exit(PTERM_MEMORY_ERROR);
+        }
+
+        // Frames are written straight from the output buffer: a chunk for each
+        // block row (rows are not compacted) plus the playback prefix and suffix
+        chunkBuffers[bufferIndex]   = (struct iovec*) malloc((parameters.height + 2) * sizeof(struct iovec));
+        rowSizeBuffers[bufferIndex] = (UInt*) malloc(parameters.height * sizeof(UInt));
+
+        if (!chunkBuffers[bufferIndex] || !rowSizeBuffers[bufferIndex]) {
+            printf("Error: failed to allocate output chunks for %i rows\n", parameters.height);
+            exit(PTERM_MEMORY_ERROR);
+        }
+    }
+
+    IORing ring;
+    openIORing(&ring, 4);
+
+    // Playback only makes sense for animations
+    const Bool playback = parameters.playback && 1 < numberOfFrames;
+    if (playback) {
+        signal(SIGINT, onPlaybackInterrupt);
+        signal(SIGTERM, onPlaybackInterrupt);
+        struct iovec chunk = {(void*) ansiEnterPlayback, ansiEnterPlaybackSize};
+        writeChunks(STDOUT_FILENO, &chunk, 1);
+    }
+
+    // Encoded frames that are shown again later are kept, and their copies are written as is
+    UInt* lastUses            = NULL;
+    UChar** encodedFrames     = NULL;
+    UInt* encodedFrameSizes   = NULL;
+    if (numberOfDistinctFrames < numberOfFrames) {
+        lastUses          = (UInt*) malloc(numberOfFrames * sizeof(UInt));
+        encodedFrames     = (UChar**) calloc(numberOfFrames, sizeof(UChar*));
+        encodedFrameSizes = (UInt*) calloc(numberOfFrames, sizeof(UInt));
+        if (!lastUses || !encodedFrames || !encodedFrameSizes) {
+            printf("Error: failed to allocate memory for %i frames\n", numberOfFrames);
+            exit(PTERM_MEMORY_ERROR);
+        }
+
+        for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex)
+            lastUses[frameSources[frameIndex]] = frameIndex;
+    }
+
+    // Loop through frames
+    // Frame i is presented delays[i] after frame i-1, measured on the monotonic clock
+    double deadline  = 0.0;
+    UInt bufferIndex = 0;
+    UInt shownFrame  = numberOfFrames; // <-- source of the frame on screen (none yet)
+    Char cursorUp[16];
+    UInt* frameDelay = (UInt*)delays;
+
+    for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex, ++frameDelay) {
+        deadline = frameIndex ? deadline + (*frameDelay) / 1000.0 : getMonotonicTime();
+        traceFrameIndex = frameIndex;
+
+        const UInt source = frameSources[frameIndex];
+        resizedFrame      = resizedImage + source * resizedFrameSize;
+
+        // In playback, a repeat of the frame on screen just stays up until the next frame is due
+        if (playback && source == shownFrame) {
+            if (pipelineStats) {
+                ++pipelineStats->framesMerged;
+            }
+            continue;
+        }
+
+        // Skip frames in playback if the next one is already due
+        if (playback && frameIndex && frameIndex + 1 < numberOfFrames && deadline + frameDelay[1] / 1000.0 < getMonotonicTime()) {
+            if (pipelineStats) {
+                ++pipelineStats->framesDropped;
+            }
+            continue;
+        }
+
+        UChar* output        = outputs[bufferIndex];
+        struct iovec* chunks = chunkBuffers[bufferIndex];
+        UInt* rowSizes       = rowSizeBuffers[bufferIndex];
+        UInt numberOfChunks  = 0;
+        bufferIndex          = 1 - bufferIndex;
+        shownFrame           = source;
+
+        const double encodeBegin = beginStage();
+        if (playback) {
+            chunks[numberOfChunks].iov_base = (void*) ansiFrameBegin;
+            chunks[numberOfChunks++].iov_len = ansiFrameBeginSize;
+        } else if (isRefining && !frameIndex && 0 < parameters.height) {
+            chunks[numberOfChunks].iov_base = (void*) cursorUp;
+            chunks[numberOfChunks++].iov_len = snprintf(cursorUp, sizeof(cursorUp), "\e[%iA", parameters.height);
+        }
+
+        const UInt firstFrameChunk = numberOfChunks;
+        const Bool isEncoded       = !encodedFrames || !encodedFrames[source];
+        if (!isEncoded) {
+            chunks[numberOfChunks].iov_base = encodedFrames[source];
+            chunks[numberOfChunks++].iov_len = encodedFrameSizes[source];
+        } else if (isBlockMode) {
+            _blockTextRowsFromImageInMemory(resizedFrame,
+                                            output,
+                                            rowSizes,
+                                            parameters.width,
+                                            parameters.height,
+                                            numberOfChannels,
+                                            parameters.renderMode);
+
+            const UInt rowCapacity = getBlockRowCapacity(parameters.width);
+            for (Int rowIndex=0; rowIndex<parameters.height; ++rowIndex) {
+                chunks[numberOfChunks].iov_base = output + rowIndex * rowCapacity;
+                chunks[numberOfChunks++].iov_len = rowSizes[rowIndex];
+            }
+        } else if (parameters.renderMode == PTERM_RENDER_SHAPE) {
+            _shapeTextFromImageInMemory(resizedFrame,
+                                        output,
+                                        parameters.width,
+                                        parameters.height,
+                                        numberOfChannels);
+        } else {
+            _textFromImageInMemory(resizedFrame,
+                                   output,
+                                   parameters.width,
+                                   parameters.height,
+                                   numberOfChannels,
+                                   parameters.backgroundOnly);
+        }
+
+        if (isEncoded && !isBlockMode) {
+            chunks[numberOfChunks].iov_base = output;
+            chunks[numberOfChunks++].iov_len = outputSize - 1; // <-- skip \0
+        }
+
+        // Keep a copy for the later repeats of this frame
+        if (isEncoded && encodedFrames && frameIndex < lastUses[source]) {
+            UInt encodedSize = 0;
+            for (UInt chunkIndex=firstFrameChunk; chunkIndex<numberOfChunks; ++chunkIndex)
+                encodedSize += chunks[chunkIndex].iov_len;
+
+            encodedFrames[source] = (UChar*) malloc(encodedSize);
+            if (encodedFrames[source]) {
+                encodedFrameSizes[source] = encodedSize;
+                UChar* cursor = encodedFrames[source];
+                for (UInt chunkIndex=firstFrameChunk; chunkIndex<numberOfChunks; ++chunkIndex) {
+                    memcpy(cursor, chunks[chunkIndex].iov_base, chunks[chunkIndex].iov_len);
+                    cursor += chunks[chunkIndex].iov_len;
+                }
+            }
+        }
+
+        endStage(PTERM_STAGE_ENCODE, encodeBegin);
+
+        if (playback) {
+            chunks[numberOfChunks].iov_base = (void*) ansiFrameEnd;
+            chunks[numberOfChunks++].iov_len = ansiFrameEndSize;
+        }
+
+        // Print
+        double sleepTime = deadline - getMonotonicTime();
+        if (0 < sleepTime) {
+            usleep(1e6 * sleepTime);
+        } else if (pipelineStats && frameIndex && 1e-3 < -sleepTime) {
+            ++pipelineStats->framesLate;
+            if (pipelineStats->maximumLateness < -sleepTime) {
+                pipelineStats->maximumLateness = -sleepTime;
+            }
+        }
+
+        if (pipelineStats) {
+            ++pipelineStats->framesRendered;
+            pipelineStats->cellsEncoded += isEncoded ? parameters.width * parameters.height : 0;
+            for (UInt chunkIndex=0; chunkIndex<numberOfChunks; ++chunkIndex) {
+                pipelineStats->bytesWritten += chunks[chunkIndex].iov_len;
+            }
+        }
+
+        // In playback mode, the frame is redrawn in place and presented atomically.
+        // The write runs in the background if io_uring is available.
+        const double writeBegin = beginStage();
+        if (submitChunks(&ring, STDOUT_FILENO, chunks, numberOfChunks) != PTERM_SUCCESS) {
+            exit(PTERM_IO_ERROR);
+        }
+        endStage(PTERM_STAGE_WRITE, writeBegin);
+    }
+
+    const double writeBegin = beginStage();
+    if (waitForChunks(&ring) != PTERM_SUCCESS) {
+        exit(PTERM_IO_ERROR);
+    }
+    endStage(PTERM_STAGE_WRITE, writeBegin);
+    closeIORing(&ring);
+
+    // Hold merged trailing frames for their delays too
+    const double holdTime = deadline - getMonotonicTime();
+    if (playback && 0 < holdTime) {
+        usleep(1e6 * holdTime);
+    }
+
+    // Clear color
+    struct iovec* chunks = chunkBuffers[0];
+    UInt numberOfChunks = 0;
+    chunks[numberOfChunks].iov_base = (void*) ansiColorReset;
+    chunks[numberOfChunks++].iov_len = ansiColorResetSize;
+
+    if (playback) {
+        chunks[numberOfChunks].iov_base = (void*) ansiLeavePlayback;
+        chunks[numberOfChunks++].iov_len = ansiLeavePlaybackSize;
+    }
+
+    writeChunks(STDOUT_FILENO, chunks, numberOfChunks);
+
+    if (playback) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+
+    // Release resources
+    free(delays);
+    for (Int bufferIndex=0; bufferIndex<2; ++bufferIndex) {
+        free(outputs[bufferIndex]);
+        free(chunkBuffers[bufferIndex]);
+        free(rowSizeBuffers[bufferIndex]);
+    }
+
+    if (encodedFrames) {
+        for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex)
+            free(encodedFrames[frameIndex]);
+    }
+    free(encodedFrames);
+    free(encodedFrameSizes);
+    free(lastUses);
+    free(frameSources);
+
+    if (sampledWidth!=imageWidth || sampledHeight!=imageHeight)
+        free(resizedImage);
+    else
+        free(data);
+
+    if (pipelineStats) {
+        printStats(pipelineStats, parameters.statsJSON);
+        closePerfCounters();
+        pipelineStats = NULL;
+    }
+
+    if (parameters.traceFileName) {
+        traceFrameIndex = -1;
+        Int traceOutput = writeTrace(parameters.traceFileName);
+        free(parameters.traceFileName);
+        if (traceOutput != PTERM_SUCCESS)
+            return traceOutput;
+    }
 
     return PTERM_SUCCESS;
 }
@@ -14,6 +14,52 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+    #include <pthread.h>    // <-- worker threads for row-parallel encoding
+    #include <stdatomic.h>
+    #include <unistd.h>     // <-- for querying the number of processors
+    #include <limits.h>
+    #include <poll.h>
+    #include <sys/uio.h>    // <-- vectored output
+    #include <sys/mman.h>   // <-- thumbnail cache
+    #include <sys/stat.h>
+    #include <sys/file.h>
+    #include <fcntl.h>
+    #ifndef IOV_MAX
+        #define IOV_MAX 1024    // <-- POSIX only guarantees 16, but every supported platform allows 1024
+    #endif
+#else
+    #include <io.h>
+    struct iovec { void* iov_base; size_t iov_len; };
+#endif
+
+#if defined(PTERM_IO_URING) && !defined(__linux__)
+    #undef PTERM_IO_URING
+#endif
+
+#ifdef PTERM_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+#endif
+
+#if defined(PTERM_PERF_COUNTERS) && !defined(__linux__)
+    #undef PTERM_PERF_COUNTERS
+#endif
+
+#ifdef PTERM_PERF_COUNTERS
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define PTERM_SSE2
+#endif
 
 
 // Define PTERM_IMPLEMENTATION for a single source
@@ -22,7 +68,8 @@
 
 
 // Compile options set in CMake
-//#define PTERM_DEBUG     // <-- print debug output
+//#define PTERM_DEBUG           // <-- print debug output
+//#define PTERM_PERF_COUNTERS   // <-- collect hardware counters with the pipeline statistics
 
 // Type aliases
 typedef int             Int;
@@ -59,6 +106,7 @@ typedef UInt            Bool;
  * @param height height of the source image
  * @param numberOfOriginalChannels number of channels in the source image
  * @param numberOfOutputChannels number of channels in the loaded image (always set to 4 for RGBA)
+ * @return decoded frames, or NULL if the file could not be read or decoded (nothing is left allocated)
  */
 UChar* loadImageFile(const Char* fileName,
                      Int* numberOfFrames,
@@ -68,6 +116,219 @@ UChar* loadImageFile(const Char* fileName,
                      Int* numberOfOriginalChannels,
                      Int* numberOfOutputChannels);
 
+/** @brief Read the size of an encoded image from its header, without decoding any pixels
+ *  @details Lets the caller work out the output geometry (and a reduced decoding scale) up front.
+ *           Images with more than PTERM_MAX_IMAGE_PIXELS pixels are rejected here, before any
+ *           memory is allocated for them.
+ *
+ * @param data encoded image
+ * @param size size of the encoded image in bytes
+ * @param width width of the image (first frame of animations)
+ * @param height height of the image
+ * @param numberOfChannels number of channels in the source image
+ * @return PTERM_SUCCESS, PTERM_FAIL if the header could not be read, or PTERM_INPUT_ERROR for oversized images
+ */
+Int probeImage(const UChar* data, Int size, Int* width, Int* height, Int* numberOfChannels);
+
+/** @brief Decode an encoded image in memory, at a reduced scale if it is only needed small
+ *  @details Same as convertImage, but JPEGs at least twice as large as the requested minimum
+ *           size are decoded at 1/2, 1/4 or 1/8 of their resolution: the inverse DCT of each
+ *           block is truncated to its 4x4 or 2x2 lowest frequencies, or only its DC coefficient
+ *           is used. This skips most of the IDCT, upsampling, color conversion and resizing work.
+ *           The reported width and height are those of the decoded (reduced) image. Oversized
+ *           images are rejected before decoding (see probeImage).
+ *
+ * @param data encoded image (replaced by the decoded RGBA frames, or NULL on failure)
+ * @param size size of the encoded image in bytes
+ * @param extension file extension (eg.: ".gif")
+ * @param minimumWidth the decoded image is at least this wide (0: full resolution)
+ * @param minimumHeight the decoded image is at least this high (0: full resolution)
+ * @return PTERM_SUCCESS, PTERM_INPUT_ERROR or PTERM_MEMORY_ERROR
+ */
+Int convertImageScaled(UChar** data,
+                       Int size,
+                       const Char* extension,
+                       Int minimumWidth,
+                       Int minimumHeight,
+                       Int* numberOfFrames,
+                       Int** frameDelaysMS,
+                       Int* width,
+                       Int* height,
+                       Int* numberOfOriginalChannels,
+                       Int* numberOfOutputChannels);
+
+/** @brief Decode a quick preview of a progressive JPEG or an interlaced PNG
+ *  @details Decoding stops as soon as the image is known at the requested minimum size: for
+ *           progressive JPEGs once the scans holding the coefficients of the reduced scale (see
+ *           convertImageScaled) are in, for Adam7-interlaced PNGs once the passes whose pixel
+ *           grid covers the minimum size are. The preview is a subsampled RGBA image; its later
+ *           JPEG scans (refinement bits, higher frequencies) and PNG passes are skipped.
+ *
+ * @param data encoded image (left untouched)
+ * @param size size of the encoded image in bytes
+ * @param minimumWidth the preview is at least this wide
+ * @param minimumHeight the preview is at least this high
+ * @param width width of the preview
+ * @param height height of the preview
+ * @param isComplete set if no scan was skipped: the preview is the fully decoded image at its scale
+ * @return RGBA preview, or NULL if the image has no usable early passes (other formats included)
+ */
+UChar* decodePreview(const UChar* data,
+                     Int size,
+                     Int minimumWidth,
+                     Int minimumHeight,
+                     Int* width,
+                     Int* height,
+                     Bool* isComplete);
+
+/** @brief PNG decoder that reads, inflates and unfilters one scanline at a time
+ *  @details For images too large to be held in memory: the file is read through a small buffer,
+ *           the zlib stream is inflated into a 32 KiB sliding window and every scanline is folded
+ *           into a box-filtered output row as soon as it is complete, so memory stays proportional
+ *           to the width of the image. Interlaced PNGs are not streamed.
+ */
+typedef struct PNGStream PNGStream;
+
+/** @brief Start streaming a PNG
+ *  @details Reads the signature and the chunks up to the first IDAT (the file descriptor stays
+ *           owned by the caller, and is read sequentially from its current position).
+ *
+ * @param fileDescriptor file to read from
+ * @param width width of the image
+ * @param height height of the image
+ * @return stream, or NULL if the input is not a PNG that can be streamed (the position of the file is undefined then)
+ */
+PNGStream* openPNGStream(Int fileDescriptor, Int* width, Int* height);
+
+/** @brief Decode a PNG stream into a downscaled RGBA image
+ *  @details Each output pixel is the mean of the source pixels it covers (the output must not
+ *           be larger than the source in either dimension).
+ *
+ * @param image RGBA output of width x height pixels
+ * @return PTERM_SUCCESS, PTERM_ARGUMENT_ERROR, PTERM_INPUT_ERROR (corrupt or truncated data) or PTERM_MEMORY_ERROR
+ */
+Int decodePNGStream(PNGStream* stream, UChar* image, Int width, Int height);
+
+/// @brief Release a PNG stream (does not close its file descriptor)
+void closePNGStream(PNGStream* stream);
+
+/** @brief Reader of video frames (raw RGBA, YUV4MPEG2, or back-to-back PNG or PNM images) from a pipe or a file
+ *  @details A reader thread fills a ring of PTERM_VIDEO_STREAM_BUFFERS RGBA frames, converting Y4M
+ *           pictures from YUV on the way, and waits while the ring is full. Memory stays bounded
+ *           however long the stream runs, and a slow consumer throttles the producer.
+ *           The images of PNG and PNM streams are delimited as they are read (by the IEND chunk,
+ *           or by the size in the PNM header), and decoded on the reader thread as well.
+ */
+typedef struct VideoStream VideoStream;
+
+/** @brief Start reading a video stream
+ *  @details The file descriptor stays owned by the caller and is read sequentially from its current position.
+ *
+ * @param format PTERM_VIDEO_RGBA, PTERM_VIDEO_Y4M, PTERM_VIDEO_PNG or PTERM_VIDEO_PNM
+ * @param width width of raw RGBA frames, or receives the width from the Y4M header or the first image
+ *              (later images of another size are resized to it)
+ * @param height height of raw RGBA frames, or receives the height from the Y4M header or the first image
+ * @param frameRate receives the frame rate from the Y4M header (0 if unknown)
+ * @return stream, or NULL if the header (or first image) is invalid or unsupported
+ *         (Y4M with more than 8 bits per sample or alpha, PNM other than 8-bit P5 or P6)
+ */
+VideoStream* openVideoStream(Int fileDescriptor, Int format, Int* width, Int* height, double* frameRate);
+
+/** @brief Wait for the next frame of a video stream
+ *  @return RGBA frame, valid until @ref{releaseVideoFrame}, or NULL at the end of the stream
+ */
+const UChar* acquireVideoFrame(VideoStream* stream);
+
+/// @brief Number of frames read ahead of the acquired one
+UInt getNumberOfBufferedFrames(VideoStream* stream);
+
+/// @brief Hand the acquired frame back to the reader
+void releaseVideoFrame(VideoStream* stream);
+
+/// @brief Stop reading and release a video stream (does not close its file descriptor)
+void closeVideoStream(VideoStream* stream);
+
+/** @brief Convert a row of 8-bit YUV samples to RGBA (BT.601)
+ *  @details Uses 16-bit fixed-point arithmetic, 8 pixels at a time with SSE2.
+ *
+ * @param chromaShift 1 if each chroma sample covers two pixels, 0 otherwise
+ * @param isFullRange PTERM_TRUE for samples in [0, 255], PTERM_FALSE for studio swing ([16, 235] luma)
+ */
+void convertYUVRow(const UChar* y, const UChar* u, const UChar* v, UChar* rgba, Int width, Int chromaShift, Bool isFullRange);
+
+/** @brief Find the frames of an animation that repeat an earlier frame
+ *  @details Frames are hashed in parallel, and frames with equal hashes are compared byte by byte.
+ *
+ * @param frames numberOfFrames consecutive frames of frameSize bytes each
+ * @param frameSize size of a frame in bytes
+ * @param sources receives the index of the first frame identical to each frame (its own index if none is)
+ * @return number of distinct frames
+ */
+UInt findDuplicateFrames(const UChar* frames, UInt numberOfFrames, size_t frameSize, UInt* sources);
+
+/** @brief Successive 2x downscales of an image, for resizing it to any size quickly
+ *  @details Level 0 is the image itself and every further level halves the previous one (2x2 box
+ *           filter) down to a single pixel. Resizing from the smallest level that still covers
+ *           the output makes the work depend on the output size rather than on the source size.
+ */
+typedef struct
+{
+    UInt   numberOfLevels;
+    UChar* levels[32];      // <-- level 0 is the source image (not owned)
+    Int    widths[32];
+    Int    heights[32];
+    Int    numberOfChannels;
+} ImagePyramid;
+
+/** @brief Build the downscaled levels of an image pyramid
+ *
+ * @param image source image with 8 bits per channel (must outlive the pyramid)
+ * @return PTERM_SUCCESS or PTERM_MEMORY_ERROR (the pyramid is empty then)
+ */
+Int buildImagePyramid(ImagePyramid* pyramid, UChar* image, Int width, Int height, Int numberOfChannels);
+
+/// @brief Release the levels of an image pyramid (but not its source image)
+void freeImagePyramid(ImagePyramid* pyramid);
+
+/** @brief Resize part of an image
+ *  @details Computes the pixels [regionX, regionX+regionWidth) x [regionY, regionY+regionHeight) of the
+ *           image resized to newWidth x newHeight (the same as a full resize would), reading only the
+ *           source pixels under the filter support of the region.
+ *
+ * @param region output of regionWidth x regionHeight pixels, regionStride bytes apart
+ * @return PTERM_SUCCESS or PTERM_FAIL
+ */
+Int resizeImageRegion(const UChar* image,
+                      UChar* region,
+                      Int width,
+                      Int height,
+                      Int numberOfChannels,
+                      Int newWidth,
+                      Int newHeight,
+                      Int regionX,
+                      Int regionY,
+                      Int regionWidth,
+                      Int regionHeight,
+                      Int regionStride);
+
+/** @brief Resize an image from the smallest level of its pyramid that is at least as large as the output
+ *
+ * @param newImage output of newWidth x newHeight pixels (with the channels of the pyramid)
+ * @return PTERM_SUCCESS or PTERM_FAIL
+ */
+Int resizeImageFromPyramid(const ImagePyramid* pyramid, UChar* newImage, Int newWidth, Int newHeight);
+
+/// @brief Resize part of an image from its pyramid (see @ref{resizeImageRegion} and @ref{resizeImageFromPyramid})
+Int resizeRegionFromPyramid(const ImagePyramid* pyramid,
+                            UChar* region,
+                            Int newWidth,
+                            Int newHeight,
+                            Int regionX,
+                            Int regionY,
+                            Int regionWidth,
+                            Int regionHeight,
+                            Int regionStride);
+
 /** @brief Convert image to text
  *  @details Convert an 8-bit-per-channel image into ANSI-colored text. The function allocates memory
  *           for the output internally. An additional internal allocation happens if the user requests
@@ -122,6 +383,293 @@ void _textFromImageInMemory(const UChar* image,
                              UInt numberOfChannels,
                              Bool backgroundOnly);
 
+/** @brief Get the number of subpixels a single text cell covers in a render mode
+ *  @details Block modes draw each cell from a grid of subpixels, so the source image
+ *           has to be resized to (width*columns)x(height*rows) before encoding.
+ *
+ * @param renderMode one of the PTERM_RENDER_* constants
+ * @param columns number of subpixel columns per cell
+ * @param rows number of subpixel rows per cell
+ */
+void getCellResolution(Int renderMode, Int* columns, Int* rows);
+
+/** @brief Allocate memory for a block-character text 'image'
+ *  @param textImage pointer to unsigned char array
+ *  @param size allocated memory in bytes
+ *  @param width text image width (number of cells)
+ *  @param height text image height (number of cells)
+ */
+void allocateBlockTextImage(UChar** textImage,
+                            UInt* size,
+                            UInt width,
+                            UInt height);
+
+/** @brief Convert image to quadrant or sextant block characters
+ *  @details Each cell is drawn with a foreground and a background color, and a unicode block
+ *           character that partitions the cell into those two colors. The partition and the colors
+ *           are picked by minimizing the squared error over the cell's subpixels. Rows are encoded
+ *           in parallel, so the destination must be allocated with @ref{allocateBlockTextImage}.
+ *
+ * @param image RGBA image with (width*columns)x(height*rows) pixels (see @ref{getCellResolution})
+ * @param destination output array (must have proper size)
+ * @param width output width (number of cells)
+ * @param height output height (number of cells)
+ * @param numberOfChannels number of pixel components in the input image
+ * @param renderMode PTERM_RENDER_QUADRANT or PTERM_RENDER_SEXTANT
+ * @return number of bytes written to the destination (excluding the terminating \0)
+ */
+UInt _blockTextFromImageInMemory(const UChar* image,
+                                 UChar* destination,
+                                 UInt width,
+                                 UInt height,
+                                 UInt numberOfChannels,
+                                 Int renderMode);
+
+/** @brief Convert image to block characters without compacting the rows
+ *  @details Same as @ref{_blockTextFromImageInMemory}, but row i is left at
+ *           destination + i * @ref{getBlockRowCapacity}(width), and its size is stored in
+ *           rowSizes[i]. The rows can then be written directly with @ref{writeChunks}.
+ *  @return total number of bytes in the rows
+ */
+UInt _blockTextRowsFromImageInMemory(const UChar* image,
+                                     UChar* destination,
+                                     UInt* rowSizes,
+                                     UInt width,
+                                     UInt height,
+                                     UInt numberOfChannels,
+                                     Int renderMode);
+
+/// @brief Number of bytes reserved for each row of a block-character text 'image'
+UInt getBlockRowCapacity(UInt width);
+
+/** @brief Write a sequence of buffers to a file descriptor without staging copies
+ *  @details Buffers are submitted with writev in batches of at most IOV_MAX. Partial writes
+ *           resume where they stopped, interrupted calls are retried, and non-blocking
+ *           descriptors are polled until they are writable again.
+ *
+ * @param fileDescriptor destination (eg.: STDOUT_FILENO)
+ * @param chunks buffers to write (modified in place while writing)
+ * @param numberOfChunks number of buffers
+ * @return PTERM_SUCCESS or PTERM_IO_ERROR
+ */
+Int writeChunks(Int fileDescriptor, struct iovec* chunks, UInt numberOfChunks);
+
+/** @brief Submission and completion queues of an io_uring instance
+ *  @details Writes submitted through the ring return immediately, so the caller can keep
+ *           encoding while the terminal drains its pty. At most one write is in flight, which
+ *           keeps frames in order. If io_uring is not compiled in (PTERM_IO_URING) or is
+ *           rejected by the kernel, fileDescriptor is -1 and all operations fall back to
+ *           blocking syscalls.
+ */
+typedef struct
+{
+    Int           fileDescriptor;
+    UInt          numberOfEntries;
+
+    void*         submissionRing;
+    size_t        submissionRingSize;
+    void*         completionRing;
+    size_t        completionRingSize;
+    void*         submissionEntries;
+    size_t        submissionEntriesSize;
+
+    UInt*         submissionTail;
+    UInt*         submissionMask;
+    UInt*         submissionArray;
+    UInt*         completionHead;
+    UInt*         completionTail;
+    UInt*         completionMask;
+    void*         completionEntries;
+
+    Int           pendingFileDescriptor;
+    struct iovec* pendingChunks;
+    UInt          numberOfPendingChunks;
+} IORing;
+
+/** @brief Set up an io_uring with the requested queue depth, or mark it unavailable
+ *  @param ring ring to initialize (must be closed with @ref{closeIORing})
+ *  @param depth number of submission queue entries
+ */
+void openIORing(IORing* ring, UInt depth);
+
+/// @brief Wait for pending writes, then release the ring
+void closeIORing(IORing* ring);
+
+/** @brief Submit a vectored write without waiting for it to finish
+ *  @details Waits for the previously submitted write first, so the chunks of the previous
+ *           call may be reused once this returns. The chunks and the buffers they point to
+ *           must stay valid until the next @ref{submitChunks} or @ref{waitForChunks}.
+ *           Falls back to @ref{writeChunks} if the ring is unavailable.
+ *  @return PTERM_SUCCESS or PTERM_IO_ERROR
+ */
+Int submitChunks(IORing* ring, Int fileDescriptor, struct iovec* chunks, UInt numberOfChunks);
+
+/** @brief Block until the pending write (if any) is complete
+ *  @return PTERM_SUCCESS or PTERM_IO_ERROR
+ */
+Int waitForChunks(IORing* ring);
+
+/** @brief Read everything from a file descriptor until end of file
+ *  @details Regular files are read with several reads in flight on a temporary io_uring,
+ *           pipes are read sequentially. Falls back to read(2) if io_uring is unavailable.
+ *  @param fileDescriptor source (eg.: STDIN_FILENO or an open file)
+ *  @param size number of bytes read
+ *  @return allocated buffer with the contents (NULL on failure or empty input)
+ */
+UChar* readFileDescriptor(Int fileDescriptor, UInt* size);
+
+/** @brief Target geometry that a thumbnail was downscaled for
+ *  @details Images are fitted into width x height cells (0: unconstrained), each cell
+ *           being sampled from cellColumns x cellRows pixels (see @ref{getCellResolution}).
+ */
+typedef struct
+{
+    UInt width;
+    UInt height;
+    UInt cellColumns;
+    UInt cellRows;
+} ThumbnailGeometry;
+
+/** @brief Persistent cache of downscaled RGBA images
+ *  @details Thumbnails are appended to a single pack file, which is mapped into memory when
+ *           the cache is opened and indexed by a hash table. Entries are keyed by the absolute
+ *           path, modification time and size of the source file and by the target geometry,
+ *           so changed files simply miss. Several processes can share a pack: records are
+ *           appended atomically and checksummed (the checksum is verified on lookup). Records
+ *           that would take the pack beyond PTERM_THUMBNAIL_CACHE_LIMIT are not stored; a full
+ *           pack is reset when it is closed (or opened) by a process that has it to itself.
+ *           Not available on Windows.
+ */
+typedef struct
+{
+    Int                 fileDescriptor;     // <-- -1 if the cache is not open
+    UChar*              map;                // <-- records present when the cache was opened
+    size_t              mapSize;
+    unsigned long long* slots;              // <-- hash table of record offsets (0: empty)
+    UInt                numberOfSlots;      // <-- power of 2
+    Bool                isFull;             // <-- a record was refused to stay within the limit
+} ThumbnailCache;
+
+/** @brief Open (or create) a thumbnail pack
+ *  @param cache sets its file descriptor to -1 on failure
+ *  @param fileName path of the pack file (its directory must exist)
+ *  @return PTERM_SUCCESS, PTERM_IO_ERROR or PTERM_MEMORY_ERROR
+ */
+Int openThumbnailCache(ThumbnailCache* cache, const Char* fileName);
+
+/// @brief Unmap and close a thumbnail pack (resetting it if it is full and no other process has it open)
+void closeThumbnailCache(ThumbnailCache* cache);
+
+/** @brief Look up the thumbnail of a file
+ *  @param fileName source image
+ *  @param geometry target geometry of the thumbnail
+ *  @param width width of the thumbnail in pixels
+ *  @param height height of the thumbnail in pixels
+ *  @return RGBA pixels inside the mapped pack (valid until the cache is closed), or NULL on a miss
+ *          (or if the record fails its checksum)
+ */
+const UChar* findThumbnail(const ThumbnailCache* cache,
+                           const Char* fileName,
+                           const ThumbnailGeometry* geometry,
+                           UInt* width,
+                           UInt* height);
+
+/** @brief Append the thumbnail of a file to the pack
+ *  @details Safe to call from several threads. The new entry is visible to caches opened later.
+ *  @return PTERM_SUCCESS, PTERM_FAIL if the pack is full, or PTERM_IO_ERROR
+ */
+Int storeThumbnail(ThumbnailCache* cache,
+                   const Char* fileName,
+                   const ThumbnailGeometry* geometry,
+                   const UChar* pixels,
+                   UInt width,
+                   UInt height);
+
+/** @brief Counters and stage timings of the rendering pipeline
+ *  @details Collected by the library functions while @ref{pipelineStats} points to an
+ *           instance (and skipped otherwise). Stages are indexed by the PTERM_STAGE_* constants.
+ */
+typedef struct
+{
+    double             stageSeconds[5];     // <-- wall time spent in each stage
+    UInt               stageCalls[5];       // <-- number of timed calls of each stage
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned long long cellsEncoded;
+    UInt               framesRendered;
+    UInt               framesLate;          // <-- frames presented after their deadline
+    UInt               framesDropped;       // <-- frames skipped to catch up with the schedule
+    UInt               framesMerged;        // <-- frames identical to the one on screen, which is kept up longer instead
+    double             maximumLateness;     // <-- seconds
+    Bool               hasCounters;         // <-- stageCounters are valid (see @ref{openPerfCounters})
+    unsigned long long stageCounters[5][4]; // <-- hardware counters of each stage (PTERM_COUNTER_*)
+} PipelineStats;
+
+/// @brief Monotonic wall clock in seconds (arbitrary origin)
+double getMonotonicTime();
+
+/// @brief Start timing a pipeline stage (returns 0 if statistics are not collected)
+double beginStage();
+
+/** @brief Stop timing a pipeline stage
+ *  @param stage one of the PTERM_STAGE_* constants
+ *  @param begin value returned by @ref{beginStage}
+ */
+void endStage(Int stage, double begin);
+
+/** @brief Count cycles, instructions, cache misses and branch misses of the timed stages
+ *  @details Only available in builds with PTERM_PERF_COUNTERS on Linux. Only the stages of the
+ *           calling thread are counted, so parallel loops run serially on that thread until the
+ *           counters are closed. The deltas are accumulated into @ref{pipelineStats}.
+ *  @return PTERM_TRUE if the counters could be opened (see perf_event_paranoid otherwise)
+ */
+Bool openPerfCounters();
+
+/// @brief Close the counters opened by @ref{openPerfCounters}
+void closePerfCounters();
+
+/** @brief Start recording trace events
+ *  @details Every thread records into its own ring buffer without locks; if a buffer
+ *           is full, its oldest events are overwritten. Buffers of finished threads are
+ *           reused by new threads, but every thread keeps its own index in the trace.
+ *           Pipeline stages (see @ref{endStage}) and the workers of parallel loops are
+ *           recorded automatically.
+ *  @param eventsPerThread capacity of each thread's ring buffer
+ */
+void startTrace(UInt eventsPerThread);
+
+/** @brief Record a trace event on the calling thread (no-op if tracing is off)
+ *  @param name static string naming the event
+ *  @param begin start time from @ref{getMonotonicTime}
+ *  @param end end time from @ref{getMonotonicTime}
+ */
+void traceEvent(const Char* name, double begin, double end);
+
+/** @brief Stop recording and write the events in Chrome/Perfetto trace-event format
+ *  @param fileName path of the output JSON file
+ *  @return PTERM_SUCCESS or PTERM_IO_ERROR
+ */
+Int writeTrace(const Char* fileName);
+
+/** @brief Convert image to ASCII characters that match the shape of each cell
+ *  @details Each cell is binarized from a 4x8 subpixel patch, and drawn with the printable
+ *           ASCII character whose precomputed 4x8 coverage mask differs from the patch in the
+ *           fewest subpixels. Low contrast cells fall back to the intensity-based characters
+ *           of @ref{_textFromImageInMemory}. The output has the same layout and size, so the
+ *           destination must be allocated with @ref{allocateANSITextImage}.
+ *
+ * @param image RGBA image with (width*4)x(height*8) pixels (see @ref{getCellResolution})
+ * @param destination output array (must have proper size)
+ * @param width output width (number of cells)
+ * @param height output height (number of cells)
+ * @param numberOfChannels number of pixel components in the input image
+ */
+void _shapeTextFromImageInMemory(const UChar* image,
+                                 UChar* destination,
+                                 UInt width,
+                                 UInt height,
+                                 UInt numberOfChannels);
+
 
 // ------------------------------------------------------------------------------------
 // PREPROCESSOR
@@ -140,6 +688,98 @@ void _textFromImageInMemory(const UChar* image,
 
 /// @}
 
+/// @name Render modes
+/// @{
+
+#define PTERM_RENDER_ASCII      0   // <-- colored ASCII characters
+#define PTERM_RENDER_BACKGROUND 1   // <-- colored background
+#define PTERM_RENDER_QUADRANT   2   // <-- 2x2 unicode block characters
+#define PTERM_RENDER_SEXTANT    3   // <-- 2x3 unicode block characters
+#define PTERM_RENDER_SHAPE      4   // <-- ASCII characters matched to the cell's shape
+
+/// @}
+
+/// @name Thumbnail cache
+/// @{
+
+#define PTERM_THUMBNAIL_CACHE_LIMIT (256u << 20)  // <-- bytes; full packs are reset when closed or opened
+
+/// @}
+
+/// @name Viewer
+/// @{
+
+#define PTERM_VIEWER_TILE_COLUMNS 32            // <-- the viewer encodes zoomed images in tiles of this many cells ...
+#define PTERM_VIEWER_TILE_ROWS    16            // <-- ... by this many rows
+#define PTERM_VIEWER_CACHE_LIMIT  (64u << 20)   // <-- bytes of encoded tiles kept around for panning back
+
+/// @}
+
+/// @name Server
+/// @{
+
+#define PTERM_SERVER_IMAGE_CACHE_LIMIT  (256u << 20)  // <-- bytes of decoded images (and their pyramids) kept by the server
+#define PTERM_SERVER_OUTPUT_CACHE_LIMIT (64u << 20)   // <-- bytes of encoded responses kept by the server
+#define PTERM_SERVER_REQUEST_SIZE       4096          // <-- longest request line
+
+/// @}
+
+/// @name Decoding
+/// @{
+
+#ifndef PTERM_MAX_IMAGE_PIXELS
+#define PTERM_MAX_IMAGE_PIXELS (1u << 28) // <-- larger images (1 GiB as RGBA) are rejected before decoding
+#endif
+
+#ifndef PTERM_STREAMING_PIXELS
+#define PTERM_STREAMING_PIXELS (1u << 26) // <-- larger PNG files are decoded scanline by scanline (see PNGStream)
+#endif
+
+#define PTERM_GIF_SEGMENTS_PER_THREAD 4   // <-- animated GIFs are split at keyframes into about this many segments per thread
+
+/// @}
+
+/// @name Video streams
+/// @{
+
+#define PTERM_VIDEO_RGBA            0   // <-- raw frames of 4 bytes per pixel
+#define PTERM_VIDEO_Y4M             1   // <-- YUV4MPEG2 with 8-bit 4:2:0, 4:2:2, 4:4:4 or monochrome pictures
+#define PTERM_VIDEO_PNG             2   // <-- concatenated PNG files
+#define PTERM_VIDEO_PNM             3   // <-- concatenated binary PGM/PPM files
+#define PTERM_VIDEO_STREAM_BUFFERS  4   // <-- frames read ahead of the renderer
+
+/// @}
+
+/// @name Resizing
+/// @{
+
+#ifndef PTERM_PARALLEL_RESIZE_PIXELS
+#define PTERM_PARALLEL_RESIZE_PIXELS (1u << 20) // <-- larger frames are resized in horizontal bands on every thread
+#endif
+
+#define PTERM_RESIZE_BANDS_PER_THREAD 4         // <-- more bands balance the load ...
+#define PTERM_RESIZE_SUPPORT_RATIO 8            // <-- ... but each band reads at least this many times the input rows its filter support adds
+
+/// @}
+
+/// @name Pipeline stages
+/// @{
+
+#define PTERM_STAGE_READ        0
+#define PTERM_STAGE_DECODE      1
+#define PTERM_STAGE_RESIZE      2
+#define PTERM_STAGE_ENCODE      3
+#define PTERM_STAGE_WRITE       4
+#define PTERM_STAGE_COUNT       5
+
+#define PTERM_COUNTER_CYCLES        0
+#define PTERM_COUNTER_INSTRUCTIONS  1
+#define PTERM_COUNTER_CACHE_MISSES  2
+#define PTERM_COUNTER_BRANCH_MISSES 3
+#define PTERM_COUNTER_COUNT         4
+
+/// @}
+
 // Other
 #define PTERM_TRUE              1
 #define PTERM_FALSE             0
@@ -182,6 +822,24 @@ const Int ansiColorSize = 19;
 const Int ansiColorResetSize = 4;
 const UChar ansiColorReset[] = "\e[0m";
 
+// Playback: switch to the alternate screen and hide the cursor (and back)
+const Int ansiEnterPlaybackSize = 14;
+const UChar ansiEnterPlayback[] = "\e[?1049h\e[?25l";
+const Int ansiLeavePlaybackSize = 14;
+const UChar ansiLeavePlayback[] = "\e[?25h\e[?1049l";
+
+// Playback frames: begin synchronized update (DEC mode 2026) and home the cursor
+const Int ansiFrameBeginSize = 11;
+const UChar ansiFrameBegin[] = "\e[?2026h\e[H";
+
+// Playback frames: end synchronized update
+const Int ansiFrameEndSize = 8;
+const UChar ansiFrameEnd[] = "\e[?2026l";
+
+// Watch mode: erase the screen before a redraw (the new size may be smaller)
+const Int ansiClearScreenSize = 4;
+const UChar ansiClearScreen[] = "\e[2J";
+
 
 /// Note: ansi must be allocated and at least [ansiColorSize] long
 PTERM_INLINE void ansiColorCode(UChar red, UChar green, UChar blue, UChar* ansi, Bool backgroundOnly)
@@ -290,25 +948,23 @@ UChar* loadFile(const Char* fileName, UInt* size)
         FILE* file = fopen(fileName, "rb");
 
         if (file) {
-            // Get file size
-            fseek(file, 0, SEEK_END);
-            Int fileSize = ftell(file);
-            fseek(file, 0, SEEK_SET);
-
-            if (fileSize) {
-                // Allocate memory
-                data = (UChar*) malloc(fileSize * sizeof(UChar));
-                *size = (UInt) fread(data, sizeof(UChar), fileSize, file);
-            } else {
+            #ifdef _WIN32
+            Int fileDescriptor = _fileno(file);
+            #else
+            Int fileDescriptor = fileno(file);
+            #endif
+
+            data = readFileDescriptor(fileDescriptor, size);
+            if (!*size) {
                 PTERM_DEBUG_PRINTF("%s\n", "WARNING: empty file");
             }
+
+            fclose(file);
         } else { // if file
-            printf("Failed to open %s (%s)\n", fileName, strerror(errno));
-            exit(PTERM_INPUT_ERROR);
+            PTERM_DEBUG_PRINTF("Failed to open %s (%s)\n", fileName, strerror(errno));
         } // if !file
     } else {
-        puts("No file name provided!");
-        exit(PTERM_INPUT_ERROR);
+        PTERM_DEBUG_PRINTF("%s\n", "No file name provided!");
     }
 
     return data;
@@ -334,95 +990,3684 @@ const Char* fileExtension(const Char* fileName)
 }
 
 
-/// --- IMAGE UTILITIES --- ///
+/// --- THREADING --- ///
 
-// Linear map: grayscale value -> ASCII character
-const UInt asciiIntensityTableSize = 15;
-const UChar asciiIntensityTable[] = { ' ', '.', ',', ':', ';', 'i', 'l', 't', 'f', 'L', 'C', 'G', '0', '8', '@' };
+// Set while trace events are being recorded (see @ref{startTrace})
+Bool isTracing = PTERM_FALSE;
 
-UChar getASCIIFromGrayScale(UChar value)
+typedef void (*ParallelTask)(void* context, UInt index);
+
+// Number of threads used by parallel loops (0 => number of online processors)
+UInt numberOfWorkerThreads = 0;
+
+// Hardware counters of the thread that opened them (-1 if not open); parallel loops run serially meanwhile
+Int perfCounters[PTERM_COUNTER_COUNT] = {-1, -1, -1, -1};
+
+
+UInt getNumberOfThreads()
 {
-    UInt key = ((asciiIntensityTableSize-1) * value) / 256;
-    return asciiIntensityTable[key];
+    if (numberOfWorkerThreads)
+        return numberOfWorkerThreads;
+
+    #ifdef _WIN32
+        return 1;
+    #else
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        return processors < 1 ? 1 : (UInt) processors;
+    #endif
 }
 
 
-UChar getASCIIFromRGB(UChar red, UChar green, UChar blue)
+#ifndef _WIN32
+// Set on threads running parallel loop tasks: loops nested in them run serially
+_Thread_local Bool isInParallelFor = PTERM_FALSE;
+
+
+struct parallelForState
 {
-    return getASCIIFromGrayScale(0.2989*red + 0.587*green + 0.114*blue);
-}
+    atomic_uint  next;
+    UInt         count;
+    ParallelTask task;
+    void*        context;
+};
 
 
-void fitImageSize(Int* width, Int* height, Int targetWidth, Int targetHeight)
+void* _parallelForWorker(void* p_state)
 {
-    if (targetWidth < *width) {
-        *height = (targetWidth*(*height)) / (*width);
-        *width = targetWidth;
-    }
-    if (targetHeight < *height) {
-        *width = (targetHeight*(*width)) / (*height);
-        *height = targetHeight;
+    struct parallelForState* state = (struct parallelForState*) p_state;
+    const double begin = isTracing ? getMonotonicTime() : 0.0;
+    const Bool wasInParallelFor = isInParallelFor;
+    isInParallelFor = PTERM_TRUE;
+
+    for (UInt index=atomic_fetch_add(&state->next, 1); index<state->count; index=atomic_fetch_add(&state->next, 1)) {
+        state->task(state->context, index);
     }
+
+    isInParallelFor = wasInParallelFor;
+
+    if (isTracing)
+        traceEvent("parallelFor", begin, getMonotonicTime());
+    return NULL;
 }
+#endif
 
 
-Int resizeImage(const UChar* image, UChar* newImage, Int width, Int height, Int numberOfChannels, Int newWidth, Int newHeight)
+/** Call task(context, index) for each index in [0, count) on up to @ref{getNumberOfThreads} threads.
+ *  Loops started from within a task run on the thread of that task (the outer loop keeps every thread busy already),
+ *  and so do all loops while the hardware counters are open, which only count the thread that opened them.
+ */
+void parallelFor(UInt count, ParallelTask task, void* context)
 {
-    PTERM_DEBUG_PRINTF("Resizing image to %ix%i\n", newWidth, newHeight);
+    UInt numberOfThreads = getNumberOfThreads();
+    if (count < numberOfThreads)
+        numberOfThreads = count;
 
-    Int resizeResult = stbir_resize_uint8(
-        image, width, height, 0,
-        newImage, newWidth, newHeight, 0, numberOfChannels
-    );
+    #ifndef _WIN32
+    if (1 < numberOfThreads && !isInParallelFor && perfCounters[0] < 0) {
+        struct parallelForState state;
+        atomic_init(&state.next, 0);
+        state.count   = count;
+        state.task    = task;
+        state.context = context;
 
-    if (!resizeResult)
-    {
-        PTERM_DEBUG_PRINTF("Image resizing errored out (error %i)\n", resizeResult);
-        return PTERM_FAIL;
+        pthread_t* threads = (pthread_t*) malloc((numberOfThreads - 1) * sizeof(pthread_t));
+        UInt numberOfStartedThreads = 0;
+        if (threads) {
+            for (; numberOfStartedThreads<numberOfThreads-1; ++numberOfStartedThreads) {
+                if (pthread_create(threads + numberOfStartedThreads, NULL, _parallelForWorker, &state))
+                    break;
+            }
+        }
+
+        _parallelForWorker(&state); // <-- the calling thread takes part too
+
+        for (UInt threadIndex=0; threadIndex<numberOfStartedThreads; ++threadIndex)
+            pthread_join(threads[threadIndex], NULL);
+
+        free(threads);
+        return;
     }
+    #endif
 
-    return PTERM_SUCCESS;
+    for (UInt index=0; index<count; ++index)
+        task(context, index);
 }
 
 
-Int convertImage(UChar** data,
-                 Int size,
-                 const Char* extension,
-                 Int* numberOfFrames,
-                 Int** frameDelaysMS,
-                 Int* width,
-                 Int* height,
-                 Int* numberOfOriginalChannels,
-                 Int* numberOfOutputChannels)
-{
-    // Init
-    *numberOfFrames           = 0;
-    *frameDelaysMS            = NULL;
-    *width                    = 0;
-    *height                   = 0;
-    *numberOfOriginalChannels = 0;
+/// --- STATISTICS --- ///
 
-    // Check file extension
-    Bool isGIF = PTERM_FALSE;
-    if (strcmp(extension, ".gif") == 0) {
-        isGIF = PTERM_TRUE;
-    }
+// Statistics are collected while this points to an instance
+PipelineStats* pipelineStats = NULL;
 
-    // Set output channels
-    *numberOfOutputChannels = 4; // <-- Convert to RGBA no matter how many channels the input has
 
-    // Decode frames
-    if (isGIF == PTERM_TRUE) {
-        UChar* tmp = stbi_load_gif_from_memory(
+double getMonotonicTime()
+{
+    struct timespec time;
+    #ifdef _WIN32
+    timespec_get(&time, TIME_UTC);
+    #else
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    #endif
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+
+#ifdef PTERM_PERF_COUNTERS
+// Counter values at the beginning of the stages in progress on the counting thread (stages may nest)
+#define PTERM_MAX_NESTED_STAGES 8
+_Thread_local Bool               isCountingThread   = PTERM_FALSE;
+_Thread_local UInt               numberOfOpenStages = 0;
+_Thread_local unsigned long long perfCounterBegin[PTERM_MAX_NESTED_STAGES][PTERM_COUNTER_COUNT];
+
+
+/// Read the hardware counters, scaled up if the kernel had to multiplex them.
+void _readPerfCounters(unsigned long long* values)
+{
+    for (Int counter=0; counter<PTERM_COUNTER_COUNT; ++counter) {
+        unsigned long long result[3] = {0, 0, 0}; // <-- value, time enabled, time running
+        if (read(perfCounters[counter], result, sizeof(result)) != sizeof(result))
+            result[0] = 0;
+        else if (result[2] && result[2] < result[1])
+            result[0] = (unsigned long long) ((double) result[0] * result[1] / result[2]);
+        values[counter] = result[0];
+    }
+}
+#endif
+
+
+Bool openPerfCounters()
+{
+    #ifdef PTERM_PERF_COUNTERS
+    const unsigned long long configs[PTERM_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    for (Int counter=0; counter<PTERM_COUNTER_COUNT; ++counter) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.type           = PERF_TYPE_HARDWARE;
+        attributes.size           = sizeof(attributes);
+        attributes.config         = configs[counter];
+        attributes.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv     = 1;
+
+        perfCounters[counter] = (Int) syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+        if (perfCounters[counter] < 0) {
+            PTERM_DEBUG_PRINTF("Failed to open hardware counter %i (%s)\n", counter, strerror(errno));
+            closePerfCounters();
+            return PTERM_FALSE;
+        }
+    }
+
+    isCountingThread   = PTERM_TRUE;
+    numberOfOpenStages = 0;
+    if (pipelineStats)
+        pipelineStats->hasCounters = PTERM_TRUE;
+    return PTERM_TRUE;
+    #else
+    return PTERM_FALSE;
+    #endif
+}
+
+
+void closePerfCounters()
+{
+    #ifdef PTERM_PERF_COUNTERS
+    for (Int counter=0; counter<PTERM_COUNTER_COUNT; ++counter) {
+        if (0 <= perfCounters[counter])
+            close(perfCounters[counter]);
+        perfCounters[counter] = -1;
+    }
+    isCountingThread = PTERM_FALSE;
+    #endif
+}
+
+
+double beginStage()
+{
+    #ifdef PTERM_PERF_COUNTERS
+    if (isCountingThread) {
+        if (numberOfOpenStages < PTERM_MAX_NESTED_STAGES)
+            _readPerfCounters(perfCounterBegin[numberOfOpenStages]);
+        ++numberOfOpenStages;
+    }
+    #endif
+    return (pipelineStats || isTracing) ? getMonotonicTime() : 0.0;
+}
+
+
+void endStage(Int stage, double begin)
+{
+    #ifdef PTERM_PERF_COUNTERS
+    if (isCountingThread && numberOfOpenStages && --numberOfOpenStages < PTERM_MAX_NESTED_STAGES && pipelineStats) {
+        unsigned long long values[PTERM_COUNTER_COUNT];
+        _readPerfCounters(values);
+        for (Int counter=0; counter<PTERM_COUNTER_COUNT; ++counter)
+            pipelineStats->stageCounters[stage][counter] += values[counter] - perfCounterBegin[numberOfOpenStages][counter];
+    }
+    #endif
+
+    if (pipelineStats || isTracing) {
+        const double end = getMonotonicTime();
+        if (pipelineStats) {
+            pipelineStats->stageSeconds[stage] += end - begin;
+            ++pipelineStats->stageCalls[stage];
+        }
+
+        if (isTracing) {
+            const Char* stageNames[PTERM_STAGE_COUNT] = {"read", "decode", "resize", "encode", "write"};
+            traceEvent(stageNames[stage], begin, end);
+        }
+    }
+}
+
+
+/// --- TRACING --- ///
+
+typedef struct
+{
+    const Char* name;
+    double      begin;
+    double      end;
+    Int         frame;
+    Int         thread;     // <-- index of the recording thread (buffers are reused by later threads)
+} TraceEvent;
+
+
+typedef struct traceBuffer
+{
+    TraceEvent*         events;
+    UInt                capacity;
+    #ifndef _WIN32
+    atomic_uint         count;      // <-- number of recorded events (only the owner thread writes)
+    #else
+    UInt                count;
+    #endif
+    Int                 threadIndex;    // <-- of the thread that owns the buffer now
+    Bool                isFree;
+    struct traceBuffer* next;
+} TraceBuffer;
+
+
+// Frame that the events of the pipeline belong to (-1 if none), set by the main thread and read by the others
+#ifndef _WIN32
+atomic_int traceFrameIndex = -1;
+#else
+Int traceFrameIndex = -1;
+#endif
+
+TraceBuffer* traceBuffers       = NULL;
+UInt         traceCapacity      = 0;
+Int          numberOfTraceThreads = 0;
+double       traceOrigin        = 0.0;
+
+#ifndef _WIN32
+pthread_mutex_t       traceMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t         traceKey;
+_Thread_local TraceBuffer* threadTraceBuffer = NULL;
+
+
+/// Return the buffer of a finished thread to the free list.
+void _releaseTraceBuffer(void* p_buffer)
+{
+    pthread_mutex_lock(&traceMutex);
+    ((TraceBuffer*) p_buffer)->isFree = PTERM_TRUE;
+    pthread_mutex_unlock(&traceMutex);
+}
+#else
+TraceBuffer* threadTraceBuffer = NULL;
+#endif
+
+
+/// Get the calling thread's buffer; only its first event takes the lock.
+TraceBuffer* _getTraceBuffer()
+{
+    if (threadTraceBuffer)
+        return threadTraceBuffer;
+
+    #ifndef _WIN32
+    pthread_mutex_lock(&traceMutex);
+    #endif
+
+    TraceBuffer* buffer = traceBuffers;
+    while (buffer && !buffer->isFree)
+        buffer = buffer->next;
+
+    if (!buffer) {
+        buffer = (TraceBuffer*) calloc(1, sizeof(TraceBuffer));
+        if (buffer)
+            buffer->events = (TraceEvent*) malloc(traceCapacity * sizeof(TraceEvent));
+
+        if (!buffer || !buffer->events) {
+            PTERM_DEBUG_PRINTF("Failed to allocate trace buffer (%lub)\n", traceCapacity * sizeof(TraceEvent));
+            free(buffer);
+            #ifndef _WIN32
+            pthread_mutex_unlock(&traceMutex);
+            #endif
+            return NULL;
+        }
+
+        buffer->capacity = traceCapacity;
+        buffer->next     = traceBuffers;
+        traceBuffers     = buffer;
+    }
+    buffer->threadIndex = numberOfTraceThreads++; // <-- every thread gets its own index, even in a reused buffer
+    buffer->isFree      = PTERM_FALSE;
+
+    #ifndef _WIN32
+    pthread_setspecific(traceKey, buffer);
+    pthread_mutex_unlock(&traceMutex);
+    #endif
+
+    threadTraceBuffer = buffer;
+    return buffer;
+}
+
+
+void startTrace(UInt eventsPerThread)
+{
+    #ifndef _WIN32
+    pthread_key_create(&traceKey, _releaseTraceBuffer);
+    #endif
+    traceCapacity = eventsPerThread ? eventsPerThread : 1;
+    traceOrigin   = getMonotonicTime();
+    isTracing     = PTERM_TRUE;
+    _getTraceBuffer(); // <-- the calling thread gets the first buffer
+}
+
+
+void traceEvent(const Char* name, double begin, double end)
+{
+    if (!isTracing)
+        return;
+
+    TraceBuffer* buffer = _getTraceBuffer();
+    if (!buffer)
+        return;
+
+    #ifndef _WIN32
+    const UInt count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    #else
+    const UInt count = buffer->count;
+    #endif
+
+    TraceEvent* event = buffer->events + (count % buffer->capacity);
+    event->name  = name;
+    event->begin = begin;
+    event->end   = end;
+    event->thread = buffer->threadIndex;
+    #ifndef _WIN32
+    event->frame  = atomic_load_explicit(&traceFrameIndex, memory_order_relaxed);
+    #else
+    event->frame  = traceFrameIndex;
+    #endif
+
+    #ifndef _WIN32
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+    #else
+    buffer->count = count + 1;
+    #endif
+}
+
+
+Int writeTrace(const Char* fileName)
+{
+    isTracing = PTERM_FALSE;
+
+    FILE* file = fopen(fileName, "w");
+    if (!file) {
+        printf("Failed to open %s (%s)\n", fileName, strerror(errno));
+        return PTERM_IO_ERROR;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+
+    for (Int threadIndex=0; threadIndex<numberOfTraceThreads; ++threadIndex) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}",
+                threadIndex ? ",\n" : "",
+                threadIndex,
+                threadIndex ? "worker" : "main",
+                threadIndex);
+    }
+
+    for (TraceBuffer* buffer=traceBuffers; buffer; buffer=buffer->next) {
+        #ifndef _WIN32
+        const UInt count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        #else
+        const UInt count = buffer->count;
+        #endif
+
+        // Only the last [capacity] events survive in the ring
+        const UInt first = count < buffer->capacity ? 0 : count - buffer->capacity;
+        for (UInt eventIndex=first; eventIndex<count; ++eventIndex) {
+            const TraceEvent* event = buffer->events + (eventIndex % buffer->capacity);
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f",
+                    event->name,
+                    event->thread,
+                    1e6 * (event->begin - traceOrigin),
+                    1e6 * (event->end - event->begin));
+            if (0 <= event->frame)
+                fprintf(file, ",\"args\":{\"frame\":%i}", event->frame);
+            fputc('}', file);
+        }
+    }
+
+    fputs("\n]}\n", file);
+    Int status = ferror(file) ? PTERM_IO_ERROR : PTERM_SUCCESS;
+    fclose(file);
+    return status;
+}
+
+
+/// --- OUTPUT --- ///
+
+Int writeChunks(Int fileDescriptor, struct iovec* chunks, UInt numberOfChunks)
+{
+    #ifdef _WIN32
+    for (UInt chunkIndex=0; chunkIndex<numberOfChunks; ++chunkIndex) {
+        const UChar* begin = (const UChar*) chunks[chunkIndex].iov_base;
+        size_t remaining = chunks[chunkIndex].iov_len;
+        while (remaining) {
+            int written = _write(fileDescriptor, begin, (unsigned int) remaining);
+            if (written < 0)
+                return PTERM_IO_ERROR;
+            begin += written;
+            remaining -= written;
+        }
+    }
+    #else
+    // Skip empty chunks at the front
+    while (numberOfChunks && !chunks->iov_len) {
+        ++chunks;
+        --numberOfChunks;
+    }
+
+    while (numberOfChunks) {
+        const Int batchSize = numberOfChunks < IOV_MAX ? (Int) numberOfChunks : IOV_MAX;
+        ssize_t written = writev(fileDescriptor, chunks, batchSize);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { // <-- non-blocking tty is full
+                struct pollfd request;
+                request.fd     = fileDescriptor;
+                request.events = POLLOUT;
+                if (poll(&request, 1, -1) < 0 && errno != EINTR)
+                    return PTERM_IO_ERROR;
+                continue;
+            }
+
+            PTERM_DEBUG_PRINTF("Failed to write output (%s)\n", strerror(errno));
+            return PTERM_IO_ERROR;
+        }
+
+        // Drop fully written chunks, and advance into a partially written one
+        while (numberOfChunks && (size_t) written >= chunks->iov_len) {
+            written -= chunks->iov_len;
+            ++chunks;
+            --numberOfChunks;
+        }
+
+        if (written) {
+            chunks->iov_base = (UChar*) chunks->iov_base + written;
+            chunks->iov_len -= written;
+        }
+    }
+    #endif
+
+    return PTERM_SUCCESS;
+}
+
+
+/// --- IO_URING --- ///
+
+#ifdef PTERM_IO_URING
+Int _ioRingEnter(Int fileDescriptor, UInt numberOfSubmissions, UInt minimumCompletions, UInt flags)
+{
+    return (Int) syscall(__NR_io_uring_enter, fileDescriptor, numberOfSubmissions, minimumCompletions, flags, NULL, 0);
+}
+
+
+/// Queue and submit a single entry.
+Int _ioRingSubmit(IORing* ring, UChar opcode, Int fileDescriptor, void* address, UInt length, unsigned long long offset, unsigned long long userData)
+{
+    const UInt tail  = *ring->submissionTail;
+    const UInt index = tail & *ring->submissionMask;
+
+    struct io_uring_sqe* entry = ((struct io_uring_sqe*) ring->submissionEntries) + index;
+    memset(entry, 0, sizeof(struct io_uring_sqe));
+    entry->opcode    = opcode;
+    entry->fd        = fileDescriptor;
+    entry->addr      = (unsigned long long) (size_t) address;
+    entry->len       = length;
+    entry->off       = offset;
+    entry->user_data = userData;
+
+    ring->submissionArray[index] = index;
+    __atomic_store_n(ring->submissionTail, tail + 1, __ATOMIC_RELEASE);
+
+    while (_ioRingEnter(ring->fileDescriptor, 1, 0, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return PTERM_IO_ERROR;
+    }
+
+    return PTERM_SUCCESS;
+}
+
+
+/// Wait for the next completion and pop it.
+Int _ioRingComplete(IORing* ring, Int* result, unsigned long long* userData)
+{
+    UInt head = *ring->completionHead;
+    while (head == __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE)) {
+        if (_ioRingEnter(ring->fileDescriptor, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            return PTERM_IO_ERROR;
+    }
+
+    const struct io_uring_cqe* entry = ((const struct io_uring_cqe*) ring->completionEntries) + (head & *ring->completionMask);
+    *result   = entry->res;
+    *userData = entry->user_data;
+    __atomic_store_n(ring->completionHead, head + 1, __ATOMIC_RELEASE);
+
+    return PTERM_SUCCESS;
+}
+#endif
+
+
+void openIORing(IORing* ring, UInt depth)
+{
+    memset(ring, 0, sizeof(IORing));
+    ring->fileDescriptor        = -1;
+    ring->pendingFileDescriptor = -1;
+
+    #ifdef PTERM_IO_URING
+    struct io_uring_params parameters;
+    memset(&parameters, 0, sizeof(parameters));
+
+    Int fileDescriptor = (Int) syscall(__NR_io_uring_setup, depth, &parameters);
+    if (fileDescriptor < 0) {
+        PTERM_DEBUG_PRINTF("io_uring is unavailable (%s), using blocking IO\n", strerror(errno));
+        return;
+    }
+
+    ring->submissionRingSize    = parameters.sq_off.array + parameters.sq_entries * sizeof(UInt);
+    ring->completionRingSize    = parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+    ring->submissionEntriesSize = parameters.sq_entries * sizeof(struct io_uring_sqe);
+
+    const Bool isSingleMap = parameters.features & IORING_FEAT_SINGLE_MMAP;
+    if (isSingleMap) {
+        if (ring->submissionRingSize < ring->completionRingSize)
+            ring->submissionRingSize = ring->completionRingSize;
+        ring->completionRingSize = ring->submissionRingSize;
+    }
+
+    ring->submissionRing = mmap(NULL, ring->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fileDescriptor, IORING_OFF_SQ_RING);
+    ring->completionRing = isSingleMap ? ring->submissionRing
+                                       : mmap(NULL, ring->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fileDescriptor, IORING_OFF_CQ_RING);
+    ring->submissionEntries = mmap(NULL, ring->submissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fileDescriptor, IORING_OFF_SQES);
+
+    if (ring->submissionRing == MAP_FAILED || ring->completionRing == MAP_FAILED || ring->submissionEntries == MAP_FAILED) {
+        PTERM_DEBUG_PRINTF("Failed to map io_uring queues (%s), using blocking IO\n", strerror(errno));
+        if (ring->submissionEntries != MAP_FAILED)
+            munmap(ring->submissionEntries, ring->submissionEntriesSize);
+        if (!isSingleMap && ring->completionRing != MAP_FAILED)
+            munmap(ring->completionRing, ring->completionRingSize);
+        if (ring->submissionRing != MAP_FAILED)
+            munmap(ring->submissionRing, ring->submissionRingSize);
+        close(fileDescriptor);
+        memset(ring, 0, sizeof(IORing));
+        ring->fileDescriptor        = -1;
+        ring->pendingFileDescriptor = -1;
+        return;
+    }
+
+    UChar* submissionRing = (UChar*) ring->submissionRing;
+    UChar* completionRing = (UChar*) ring->completionRing;
+    ring->submissionTail    = (UInt*) (submissionRing + parameters.sq_off.tail);
+    ring->submissionMask    = (UInt*) (submissionRing + parameters.sq_off.ring_mask);
+    ring->submissionArray   = (UInt*) (submissionRing + parameters.sq_off.array);
+    ring->completionHead    = (UInt*) (completionRing + parameters.cq_off.head);
+    ring->completionTail    = (UInt*) (completionRing + parameters.cq_off.tail);
+    ring->completionMask    = (UInt*) (completionRing + parameters.cq_off.ring_mask);
+    ring->completionEntries = completionRing + parameters.cq_off.cqes;
+    ring->numberOfEntries   = parameters.sq_entries;
+    ring->fileDescriptor    = fileDescriptor;
+    #else
+    (void) depth;
+    #endif
+}
+
+
+void closeIORing(IORing* ring)
+{
+    waitForChunks(ring);
+
+    #ifdef PTERM_IO_URING
+    if (0 <= ring->fileDescriptor) {
+        munmap(ring->submissionEntries, ring->submissionEntriesSize);
+        if (ring->completionRing != ring->submissionRing)
+            munmap(ring->completionRing, ring->completionRingSize);
+        munmap(ring->submissionRing, ring->submissionRingSize);
+        close(ring->fileDescriptor);
+    }
+    #endif
+
+    ring->fileDescriptor = -1;
+}
+
+
+Int waitForChunks(IORing* ring)
+{
+    #ifdef PTERM_IO_URING
+    while (ring->pendingChunks) {
+        Int result = 0;
+        unsigned long long userData = 0;
+        if (_ioRingComplete(ring, &result, &userData) != PTERM_SUCCESS) {
+            ring->pendingChunks = NULL;
+            return PTERM_IO_ERROR;
+        }
+
+        if (result < 0) { // <-- let the blocking path deal with retries and polling
+            Int status = PTERM_IO_ERROR;
+            if (result == -EAGAIN || result == -EINTR || result == -EINVAL || result == -EOPNOTSUPP)
+                status = writeChunks(ring->pendingFileDescriptor, ring->pendingChunks, ring->numberOfPendingChunks);
+            ring->pendingChunks = NULL;
+            return status;
+        }
+
+        // Drop fully written chunks, and resubmit the rest of a short write
+        size_t written = (size_t) result;
+        while (ring->numberOfPendingChunks && written >= ring->pendingChunks->iov_len) {
+            written -= ring->pendingChunks->iov_len;
+            ++ring->pendingChunks;
+            --ring->numberOfPendingChunks;
+        }
+
+        if (!ring->numberOfPendingChunks) {
+            ring->pendingChunks = NULL;
+            break;
+        }
+
+        ring->pendingChunks->iov_base = (UChar*) ring->pendingChunks->iov_base + written;
+        ring->pendingChunks->iov_len -= written;
+
+        const UInt batchSize = ring->numberOfPendingChunks < IOV_MAX ? ring->numberOfPendingChunks : IOV_MAX;
+        if (_ioRingSubmit(ring, IORING_OP_WRITEV, ring->pendingFileDescriptor, ring->pendingChunks, batchSize, (unsigned long long) -1, 0) != PTERM_SUCCESS) {
+            ring->pendingChunks = NULL;
+            return PTERM_IO_ERROR;
+        }
+    }
+    #else
+    (void) ring;
+    #endif
+
+    return PTERM_SUCCESS;
+}
+
+
+Int submitChunks(IORing* ring, Int fileDescriptor, struct iovec* chunks, UInt numberOfChunks)
+{
+    Int status = waitForChunks(ring);
+    if (status != PTERM_SUCCESS)
+        return status;
+
+    #ifdef PTERM_IO_URING
+    if (0 <= ring->fileDescriptor && numberOfChunks) {
+        const UInt batchSize = numberOfChunks < IOV_MAX ? numberOfChunks : IOV_MAX;
+        if (_ioRingSubmit(ring, IORING_OP_WRITEV, fileDescriptor, chunks, batchSize, (unsigned long long) -1, 0) != PTERM_SUCCESS)
+            return PTERM_IO_ERROR;
+
+        ring->pendingFileDescriptor = fileDescriptor;
+        ring->pendingChunks         = chunks;
+        ring->numberOfPendingChunks = numberOfChunks;
+        return PTERM_SUCCESS;
+    }
+    #endif
+
+    return writeChunks(fileDescriptor, chunks, numberOfChunks);
+}
+
+
+UChar* _readFileDescriptorBlocking(Int fileDescriptor, UChar* content, UInt* size, UInt capacity)
+{
+    while (PTERM_TRUE) {
+        // Extend memory if necessary
+        if (*size == capacity) {
+            UChar* tmp = content;
+            capacity = capacity ? 2 * capacity : 4096;
+            content = (UChar*) realloc(content, capacity);
+            if (!content) {
+                PTERM_DEBUG_PRINTF("Failed to extend memory while reading input (%ub)\n", *size);
+                free(tmp);
+                *size = 0;
+                return NULL;
+            }
+        }
+
+        #ifdef _WIN32
+        Int bytesRead = _read(fileDescriptor, content + *size, capacity - *size);
+        #else
+        Int bytesRead = (Int) read(fileDescriptor, content + *size, capacity - *size);
+        #endif
+
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
+            PTERM_DEBUG_PRINTF("Failed to read input (%s)\n", strerror(errno));
+            free(content);
+            *size = 0;
+            return NULL;
+        }
+
+        if (!bytesRead)
+            break;
+
+        *size += bytesRead;
+    }
+
+    return content;
+}
+
+
+UChar* _readFileDescriptor(Int fileDescriptor, UInt* size)
+{
+    *size = 0;
+
+    #ifdef PTERM_IO_URING
+    // Reads start at the current position of the descriptor, like the blocking path
+    struct stat status;
+    const off_t base = lseek(fileDescriptor, 0, SEEK_CUR);
+    if (0 <= base && fstat(fileDescriptor, &status) == 0 && S_ISREG(status.st_mode) && base < status.st_size) {
+        const UInt chunkSize = 1 << 20;
+        const UInt fileSize  = (UInt) (status.st_size - base);
+
+        UChar* content = (UChar*) malloc(fileSize);
+        if (!content) {
+            PTERM_DEBUG_PRINTF("Failed to allocate memory for input (%ub)\n", fileSize);
+            return NULL;
+        }
+
+        IORing ring;
+        openIORing(&ring, 8);
+
+        if (0 <= ring.fileDescriptor) {
+            // Keep the queue full with chunk reads at increasing offsets. A read's user data
+            // holds its offset and the end of its chunk, so short reads can be resubmitted.
+            UInt nextOffset = 0, inFlight = 0, end = fileSize;
+            Bool failed = PTERM_FALSE;
+
+            while (!failed && (nextOffset < end || inFlight)) {
+                while (nextOffset < end && inFlight < ring.numberOfEntries) {
+                    UInt length = end - nextOffset < chunkSize ? end - nextOffset : chunkSize;
+                    const unsigned long long userData = ((unsigned long long) (nextOffset + length) << 32) | nextOffset;
+                    if (_ioRingSubmit(&ring, IORING_OP_READ, fileDescriptor, content + nextOffset, length, base + nextOffset, userData) != PTERM_SUCCESS) {
+                        failed = PTERM_TRUE;
+                        break;
+                    }
+                    nextOffset += length;
+                    ++inFlight;
+                }
+
+                Int result = 0;
+                unsigned long long userData = 0;
+                if (failed || _ioRingComplete(&ring, &result, &userData) != PTERM_SUCCESS) {
+                    failed = PTERM_TRUE;
+                    break;
+                }
+                --inFlight;
+
+                const UInt offset   = (UInt) userData;
+                const UInt chunkEnd = (UInt) (userData >> 32);
+                if (result < 0) {
+                    failed = PTERM_TRUE;
+                } else if (result == 0) { // <-- the file shrank
+                    if (offset < end)
+                        end = offset;
+                } else {
+                    UInt readEnd = offset + (UInt) result;
+                    if (readEnd < chunkEnd && readEnd < end) { // <-- short read: ask for the rest of the same chunk
+                        const unsigned long long restData = ((unsigned long long) chunkEnd << 32) | readEnd;
+                        if (_ioRingSubmit(&ring, IORING_OP_READ, fileDescriptor, content + readEnd, chunkEnd - readEnd, base + readEnd, restData) != PTERM_SUCCESS)
+                            failed = PTERM_TRUE;
+                        else
+                            ++inFlight;
+                    }
+                }
+            }
+
+            // Drain whatever is still in flight before releasing the buffer
+            while (failed && inFlight) {
+                Int result = 0;
+                unsigned long long userData = 0;
+                if (_ioRingComplete(&ring, &result, &userData) != PTERM_SUCCESS)
+                    break;
+                --inFlight;
+            }
+
+            closeIORing(&ring);
+
+            if (!failed) {
+                lseek(fileDescriptor, base + end, SEEK_SET); // <-- leave the position after the data, as reading would
+                *size = end;
+                return content;
+            }
+
+            PTERM_DEBUG_PRINTF("%s\n", "io_uring read failed, falling back to blocking reads");
+            lseek(fileDescriptor, base, SEEK_SET);
+        } else {
+            closeIORing(&ring);
+        }
+
+        return _readFileDescriptorBlocking(fileDescriptor, content, size, fileSize);
+    }
+    #endif
+
+    return _readFileDescriptorBlocking(fileDescriptor, NULL, size, 0);
+}
+
+
+UChar* readFileDescriptor(Int fileDescriptor, UInt* size)
+{
+    const double begin = beginStage();
+    UChar* content = _readFileDescriptor(fileDescriptor, size);
+    endStage(PTERM_STAGE_READ, begin);
+
+    if (pipelineStats)
+        pipelineStats->bytesRead += *size;
+
+    return content;
+}
+
+
+/// --- THUMBNAIL CACHE --- ///
+
+// Pack layout: header, then records of [ThumbnailRecord, path, pixels], each padded to 8 bytes
+const UChar thumbnailPackMagic[8] = {'P', 'T', 'E', 'R', 'M', 'T', 'C', '1'};
+const UInt  thumbnailRecordMagic  = 0x48544d54; // <-- "TMTH"
+
+typedef struct
+{
+    UInt               magic;
+    UInt               pathSize;            // <-- including \0
+    unsigned long long modificationTime;    // <-- nanoseconds
+    unsigned long long fileSize;
+    ThumbnailGeometry  geometry;
+    UInt               width;
+    UInt               height;
+    unsigned long long checksum;            // <-- of the path and the pixels
+} ThumbnailRecord;
+
+
+#ifndef _WIN32
+pthread_mutex_t thumbnailCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+unsigned long long _hashBytes(unsigned long long hash, const void* bytes, size_t size)
+{
+    const UChar* begin = (const UChar*) bytes;
+    for (size_t index=0; index<size; ++index)
+        hash = (hash ^ begin[index]) * 0x100000001b3ull; // <-- FNV-1a
+    return hash;
+}
+
+
+unsigned long long _hashThumbnailKey(const Char* path, unsigned long long modificationTime, unsigned long long fileSize, const ThumbnailGeometry* geometry)
+{
+    unsigned long long hash = _hashBytes(0xcbf29ce484222325ull, path, strlen(path));
+    hash = _hashBytes(hash, &modificationTime, sizeof(modificationTime));
+    hash = _hashBytes(hash, &fileSize, sizeof(fileSize));
+    return _hashBytes(hash, geometry, sizeof(ThumbnailGeometry));
+}
+
+
+size_t _getThumbnailRecordSize(const ThumbnailRecord* record)
+{
+    const size_t pixelsSize = (size_t) record->width * record->height * 4;
+    return sizeof(ThumbnailRecord) + ((record->pathSize + 7) & ~(size_t) 7) + ((pixelsSize + 7) & ~(size_t) 7);
+}
+
+
+/// Get the absolute path and the modification time and size of a source file.
+Bool _statThumbnailSource(const Char* fileName, Char** path, unsigned long long* modificationTime, unsigned long long* fileSize)
+{
+    #ifndef _WIN32
+    struct stat status;
+    if (stat(fileName, &status) || !S_ISREG(status.st_mode))
+        return PTERM_FALSE;
+
+    *path = realpath(fileName, NULL);
+    if (!*path)
+        return PTERM_FALSE;
+
+    #ifdef __linux__
+    *modificationTime = status.st_mtim.tv_sec * 1000000000ull + status.st_mtim.tv_nsec;
+    #else
+    *modificationTime = status.st_mtime * 1000000000ull;
+    #endif
+    *fileSize = (unsigned long long) status.st_size;
+    return PTERM_TRUE;
+    #else
+    return PTERM_FALSE;
+    #endif
+}
+
+
+Int openThumbnailCache(ThumbnailCache* cache, const Char* fileName)
+{
+    cache->fileDescriptor = -1;
+    cache->map            = NULL;
+    cache->mapSize        = 0;
+    cache->slots          = NULL;
+    cache->numberOfSlots  = 0;
+    cache->isFull         = PTERM_FALSE;
+
+    #ifndef _WIN32
+    Int fileDescriptor = open(fileName, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fileDescriptor < 0) {
+        PTERM_DEBUG_PRINTF("Failed to open thumbnail cache %s (%s)\n", fileName, strerror(errno));
+        return PTERM_IO_ERROR;
+    }
+
+    // Other processes may append while the pack is open, but it is only
+    // created or reset by a process that has it to itself
+    struct stat status;
+    if (flock(fileDescriptor, LOCK_EX | LOCK_NB) == 0 && fstat(fileDescriptor, &status) == 0) {
+        if (PTERM_THUMBNAIL_CACHE_LIMIT < (size_t) status.st_size) {
+            PTERM_DEBUG_PRINTF("Resetting thumbnail cache %s (%lib)\n", fileName, (long) status.st_size);
+            status.st_size = ftruncate(fileDescriptor, 0) ? status.st_size : 0;
+        }
+
+        if (!status.st_size && write(fileDescriptor, thumbnailPackMagic, sizeof(thumbnailPackMagic)) != sizeof(thumbnailPackMagic)) {
+            close(fileDescriptor);
+            return PTERM_IO_ERROR;
+        }
+    }
+    flock(fileDescriptor, LOCK_SH);
+
+    if (fstat(fileDescriptor, &status)) {
+        close(fileDescriptor);
+        return PTERM_IO_ERROR;
+    }
+
+    cache->fileDescriptor = fileDescriptor;
+    if ((size_t) status.st_size <= sizeof(thumbnailPackMagic))
+        return PTERM_SUCCESS;
+
+    cache->mapSize = (size_t) status.st_size;
+    cache->map = (UChar*) mmap(NULL, cache->mapSize, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+    if (cache->map == MAP_FAILED) {
+        PTERM_DEBUG_PRINTF("Failed to map thumbnail cache %s (%s)\n", fileName, strerror(errno));
+        cache->map = NULL;
+        cache->mapSize = 0;
+        return PTERM_SUCCESS; // <-- still usable for storing
+    }
+
+    if (cache->mapSize < sizeof(thumbnailPackMagic) || memcmp(cache->map, thumbnailPackMagic, sizeof(thumbnailPackMagic))) {
+        PTERM_DEBUG_PRINTF("%s is not a thumbnail cache\n", fileName);
+        closeThumbnailCache(cache);
+        return PTERM_IO_ERROR;
+    }
+
+    // Count records to size the table (at most half full)
+    UInt numberOfRecords = 0;
+    size_t offset = sizeof(thumbnailPackMagic);
+    while (offset + sizeof(ThumbnailRecord) <= cache->mapSize) {
+        const ThumbnailRecord* record = (const ThumbnailRecord*) (cache->map + offset);
+        const size_t recordSize = _getThumbnailRecordSize(record);
+        if (record->magic != thumbnailRecordMagic || cache->mapSize - offset < recordSize)
+            break;
+        ++numberOfRecords;
+        offset += recordSize;
+    }
+
+    cache->numberOfSlots = 16;
+    while (cache->numberOfSlots < 2 * numberOfRecords)
+        cache->numberOfSlots *= 2;
+
+    cache->slots = (unsigned long long*) calloc(cache->numberOfSlots, sizeof(unsigned long long));
+    if (!cache->slots) {
+        PTERM_DEBUG_PRINTF("Failed to allocate thumbnail index (%lub)\n", cache->numberOfSlots * sizeof(unsigned long long));
+        closeThumbnailCache(cache);
+        return PTERM_MEMORY_ERROR;
+    }
+
+    // Index the record headers (the pixels are only checksummed when found); later records of the same key
+    // replace earlier ones
+    offset = sizeof(thumbnailPackMagic);
+    for (UInt recordIndex=0; recordIndex<numberOfRecords; ++recordIndex) {
+        const ThumbnailRecord* record = (const ThumbnailRecord*) (cache->map + offset);
+        const Char* path = (const Char*) (record + 1);
+
+        if (record->pathSize && path[record->pathSize - 1] == '\0') {
+            const unsigned long long hash = _hashThumbnailKey(path, record->modificationTime, record->fileSize, &record->geometry);
+            UInt slot = (UInt) hash & (cache->numberOfSlots - 1);
+            while (cache->slots[slot]) {
+                const ThumbnailRecord* other = (const ThumbnailRecord*) (cache->map + cache->slots[slot]);
+                if (other->modificationTime == record->modificationTime
+                    && other->fileSize == record->fileSize
+                    && !memcmp(&other->geometry, &record->geometry, sizeof(ThumbnailGeometry))
+                    && !strcmp((const Char*) (other + 1), path))
+                    break;
+                slot = (slot + 1) & (cache->numberOfSlots - 1);
+            }
+            cache->slots[slot] = offset;
+        }
+
+        offset += _getThumbnailRecordSize(record);
+    }
+    #endif
+
+    return PTERM_SUCCESS;
+}
+
+
+void closeThumbnailCache(ThumbnailCache* cache)
+{
+    #ifndef _WIN32
+    if (cache->map)
+        munmap(cache->map, cache->mapSize);
+    if (0 <= cache->fileDescriptor) {
+        if (cache->isFull && flock(cache->fileDescriptor, LOCK_EX | LOCK_NB) == 0) { // <-- no other process has it open
+            PTERM_DEBUG_PRINTF("Resetting full thumbnail cache\n");
+            if (ftruncate(cache->fileDescriptor, 0) == 0 && write(cache->fileDescriptor, thumbnailPackMagic, sizeof(thumbnailPackMagic)) < 0)
+                PTERM_DEBUG_PRINTF("Failed to reset thumbnail cache (%s)\n", strerror(errno));
+        }
+        close(cache->fileDescriptor); // <-- also releases the lock
+    }
+    #endif
+    free(cache->slots);
+
+    cache->fileDescriptor = -1;
+    cache->map            = NULL;
+    cache->mapSize        = 0;
+    cache->slots          = NULL;
+    cache->numberOfSlots  = 0;
+    cache->isFull         = PTERM_FALSE;
+}
+
+
+const UChar* findThumbnail(const ThumbnailCache* cache,
+                           const Char* fileName,
+                           const ThumbnailGeometry* geometry,
+                           UInt* width,
+                           UInt* height)
+{
+    if (!cache->slots)
+        return NULL;
+
+    Char* path = NULL;
+    unsigned long long modificationTime = 0, fileSize = 0;
+    if (!_statThumbnailSource(fileName, &path, &modificationTime, &fileSize))
+        return NULL;
+
+    const UChar* pixels = NULL;
+    UInt slot = (UInt) _hashThumbnailKey(path, modificationTime, fileSize, geometry) & (cache->numberOfSlots - 1);
+    for (; cache->slots[slot]; slot=(slot + 1) & (cache->numberOfSlots - 1)) {
+        const ThumbnailRecord* record = (const ThumbnailRecord*) (cache->map + cache->slots[slot]);
+        if (record->modificationTime == modificationTime
+            && record->fileSize == fileSize
+            && !memcmp(&record->geometry, geometry, sizeof(ThumbnailGeometry))
+            && !strcmp((const Char*) (record + 1), path)) {
+            // Only the record that is used is checksummed: torn or corrupt records miss
+            const UChar* recordPixels = (const UChar*) (record + 1) + ((record->pathSize + 7) & ~7u);
+            unsigned long long checksum = _hashBytes(0xcbf29ce484222325ull, record + 1, record->pathSize);
+            checksum = _hashBytes(checksum, recordPixels, (size_t) record->width * record->height * 4);
+
+            if (checksum == record->checksum) {
+                *width  = record->width;
+                *height = record->height;
+                pixels  = recordPixels;
+            }
+            break;
+        }
+    }
+
+    free(path);
+    return pixels;
+}
+
+
+Int storeThumbnail(ThumbnailCache* cache,
+                   const Char* fileName,
+                   const ThumbnailGeometry* geometry,
+                   const UChar* pixels,
+                   UInt width,
+                   UInt height)
+{
+    if (cache->fileDescriptor < 0)
+        return PTERM_IO_ERROR;
+
+    ThumbnailRecord record;
+    memset(&record, 0, sizeof(record));
+    Char* path = NULL;
+    if (!_statThumbnailSource(fileName, &path, &record.modificationTime, &record.fileSize))
+        return PTERM_IO_ERROR;
+
+    const size_t pixelsSize = (size_t) width * height * 4;
+    record.magic    = thumbnailRecordMagic;
+    record.pathSize = (UInt) strlen(path) + 1;
+    record.geometry = *geometry;
+    record.width    = width;
+    record.height   = height;
+    record.checksum = _hashBytes(_hashBytes(0xcbf29ce484222325ull, path, record.pathSize), pixels, pixelsSize);
+
+    // A single append keeps concurrent writers from interleaving
+    const UChar padding[8] = {0};
+    struct iovec chunks[5] = {
+        {&record, sizeof(record)},
+        {path, record.pathSize},
+        {(void*) padding, ((record.pathSize + 7) & ~7u) - record.pathSize},
+        {(void*) pixels, pixelsSize},
+        {(void*) padding, ((pixelsSize + 7) & ~(size_t) 7) - pixelsSize}
+    };
+
+    const size_t recordSize = _getThumbnailRecordSize(&record);
+    long writtenSize = -1;
+
+    #ifndef _WIN32
+    // Nothing is appended past the limit (other processes may still append in between, the reset at open catches those)
+    // (a record larger than the whole pack is refused without resetting it)
+    pthread_mutex_lock(&thumbnailCacheMutex);
+    struct stat status;
+    if (!cache->isFull && recordSize <= PTERM_THUMBNAIL_CACHE_LIMIT && fstat(cache->fileDescriptor, &status) == 0) {
+        if (PTERM_THUMBNAIL_CACHE_LIMIT - recordSize < (size_t) status.st_size)
+            cache->isFull = PTERM_TRUE;
+        else
+            writtenSize = (long) writev(cache->fileDescriptor, chunks, 5);
+    }
+    const Bool isFull = cache->isFull || PTERM_THUMBNAIL_CACHE_LIMIT < recordSize;
+    pthread_mutex_unlock(&thumbnailCacheMutex);
+    #else
+    const Bool isFull = PTERM_FALSE;
+    #endif
+
+    free(path);
+    if (isFull)
+        return PTERM_FAIL;
+    return writtenSize == (long) recordSize ? PTERM_SUCCESS : PTERM_IO_ERROR;
+}
+
+
+/// --- REDUCED JPEG DECODING --- ///
+
+// Basis of the N-point inverse DCTs that replace stb_image's 8-point one: [n][u] = C(u)/2 * cos((2n+1)u*pi/2N),
+// with C(0) = 1/sqrt(2). Keeping the NxN lowest frequencies of a block yields an NxN image of it.
+const float jpegReducedBasis2[2][2] = {
+    {0.35355339f,  0.35355339f},
+    {0.35355339f, -0.35355339f}
+};
+
+const float jpegReducedBasis4[4][4] = {
+    {0.35355339f,  0.46193977f,  0.35355339f,  0.19134172f},
+    {0.35355339f,  0.19134172f, -0.35355339f, -0.46193977f},
+    {0.35355339f, -0.19134172f, -0.35355339f,  0.46193977f},
+    {0.35355339f, -0.46193977f,  0.35355339f, -0.19134172f}
+};
+
+
+PTERM_INLINE UChar _clampSample(float value)
+{
+    value += 128.5f;
+    return value <= 0.0f ? 0 : (255.0f <= value ? 255 : (UChar) value);
+}
+
+
+/// 4x4 inverse DCT of the dequantized coefficients (row-major, natural order) into the block's top left corner.
+void _idctBlock4(stbi_uc* output, int outputStride, short data[64])
+{
+    float rows[4][4]; // <-- [v][n]
+    for (Int v=0; v<4; ++v) {
+        const short* coefficients = data + 8 * v;
+        for (Int n=0; n<4; ++n) {
+            rows[v][n] = jpegReducedBasis4[n][0] * coefficients[0]
+                       + jpegReducedBasis4[n][1] * coefficients[1]
+                       + jpegReducedBasis4[n][2] * coefficients[2]
+                       + jpegReducedBasis4[n][3] * coefficients[3];
+        }
+    }
+
+    for (Int m=0; m<4; ++m, output+=outputStride) {
+        for (Int n=0; n<4; ++n) {
+            output[n] = _clampSample(jpegReducedBasis4[m][0] * rows[0][n]
+                                   + jpegReducedBasis4[m][1] * rows[1][n]
+                                   + jpegReducedBasis4[m][2] * rows[2][n]
+                                   + jpegReducedBasis4[m][3] * rows[3][n]);
+        }
+    }
+}
+
+
+/// 2x2 inverse DCT (see @ref{_idctBlock4}).
+void _idctBlock2(stbi_uc* output, int outputStride, short data[64])
+{
+    const float left  = jpegReducedBasis2[0][0] * data[0] + jpegReducedBasis2[0][1] * data[1];
+    const float right = jpegReducedBasis2[1][0] * data[0] + jpegReducedBasis2[1][1] * data[1];
+    const float bottomLeft  = jpegReducedBasis2[0][0] * data[8] + jpegReducedBasis2[0][1] * data[9];
+    const float bottomRight = jpegReducedBasis2[1][0] * data[8] + jpegReducedBasis2[1][1] * data[9];
+
+    output[0] = _clampSample(jpegReducedBasis2[0][0] * left + jpegReducedBasis2[0][1] * bottomLeft);
+    output[1] = _clampSample(jpegReducedBasis2[0][0] * right + jpegReducedBasis2[0][1] * bottomRight);
+    output[outputStride]     = _clampSample(jpegReducedBasis2[1][0] * left + jpegReducedBasis2[1][1] * bottomLeft);
+    output[outputStride + 1] = _clampSample(jpegReducedBasis2[1][0] * right + jpegReducedBasis2[1][1] * bottomRight);
+}
+
+
+/// DC only: the mean of the block.
+void _idctBlock1(stbi_uc* output, int outputStride, short data[64])
+{
+    (void) outputStride;
+    *output = _clampSample(data[0] * 0.125f);
+}
+
+
+/// @return largest reduction (log2) of a width x height JPEG that still covers the minimum size
+Int getJPEGScaleShift(Int width, Int height, Int minimumWidth, Int minimumHeight)
+{
+    for (Int scaleShift=3; 0<scaleShift; --scaleShift) {
+        const Int scale = 1 << scaleShift;
+        if (minimumWidth <= (width + scale - 1) / scale && minimumHeight <= (height + scale - 1) / scale)
+            return scaleShift;
+    }
+
+    return 0;
+}
+
+
+// Reduced IDCT of each scale (none at full scale)
+void (*const jpegReducedKernels[4])(stbi_uc*, int, short[64]) = {NULL, _idctBlock4, _idctBlock2, _idctBlock1};
+
+
+/// Decoder whose IDCT writes (8>>scaleShift)^2 samples into the top left corner of each block.
+stbi__jpeg* _openReducedJPEG(stbi__context* context, Int scaleShift)
+{
+    stbi__jpeg* jpeg = (stbi__jpeg*) malloc(sizeof(stbi__jpeg));
+    if (!jpeg)
+        return NULL;
+
+    jpeg->s = context;
+    stbi__setup_jpeg(jpeg);
+    if (scaleShift)
+        jpeg->idct_block_kernel = jpegReducedKernels[scaleShift];
+    context->img_n = 0; // <-- make stbi__cleanup_jpeg safe
+    return jpeg;
+}
+
+
+void _closeReducedJPEG(stbi__jpeg* jpeg)
+{
+    stbi__cleanup_jpeg(jpeg);
+    free(jpeg);
+}
+
+
+/// Gather the reduced blocks of a decoded JPEG into an RGBA image (NULL if out of memory).
+UChar* _assembleReducedJPEG(stbi__jpeg* jpeg, Int scaleShift, Int* width, Int* height)
+{
+    const stbi__context* context = jpeg->s;
+    const Int blockSize    = 8 >> scaleShift;
+    const Int outputWidth  = (context->img_x + (1 << scaleShift) - 1) >> scaleShift;
+    const Int outputHeight = (context->img_y + (1 << scaleShift) - 1) >> scaleShift;
+    const Int numberOfComponents = context->img_n;
+    const Bool isRGB = numberOfComponents == 3 && (jpeg->rgb == 3 || (jpeg->app14_color_transform == 0 && !jpeg->jfif));
+
+    UChar* output = (UChar*) malloc((size_t) outputWidth * outputHeight * 4);
+    UChar* rows   = (UChar*) malloc((size_t) outputWidth * 4);
+    Int* offsets  = (Int*) malloc((size_t) outputWidth * numberOfComponents * sizeof(Int));
+
+    if (!output || !rows || !offsets) {
+        PTERM_DEBUG_PRINTF("Failed to allocate memory for a %ix%i JPEG\n", outputWidth, outputHeight);
+        free(output);
+        free(rows);
+        free(offsets);
+        return NULL;
+    }
+
+    // Column of each output pixel within the component planes (subsampled components are replicated)
+    for (Int component=0; component<numberOfComponents; ++component) {
+        const Int horizontalStep = jpeg->img_h_max / jpeg->img_comp[component].h;
+        for (Int columnIndex=0; columnIndex<outputWidth; ++columnIndex) {
+            const Int sample = columnIndex / horizontalStep;
+            offsets[component * outputWidth + columnIndex] = (sample / blockSize) * 8 + sample % blockSize;
+        }
+    }
+
+    for (Int rowIndex=0; rowIndex<outputHeight; ++rowIndex) {
+        UChar* componentRows[4] = {NULL, NULL, NULL, NULL};
+        for (Int component=0; component<numberOfComponents; ++component) {
+            const Int sample = rowIndex / (jpeg->img_v_max / jpeg->img_comp[component].v);
+            const UChar* plane = jpeg->img_comp[component].data + ((sample / blockSize) * 8 + sample % blockSize) * jpeg->img_comp[component].w2;
+            const Int* componentOffsets = offsets + component * outputWidth;
+
+            componentRows[component] = rows + component * outputWidth;
+            for (Int columnIndex=0; columnIndex<outputWidth; ++columnIndex)
+                componentRows[component][columnIndex] = plane[componentOffsets[columnIndex]];
+        }
+
+        // Color conversion as in stb_image
+        UChar* pixel = output + (size_t) rowIndex * outputWidth * 4;
+        if (numberOfComponents == 3 && !isRGB) {
+            jpeg->YCbCr_to_RGB_kernel(pixel, componentRows[0], componentRows[1], componentRows[2], outputWidth, 4);
+        } else if (numberOfComponents == 4 && jpeg->app14_color_transform != 0) {
+            jpeg->YCbCr_to_RGB_kernel(pixel, componentRows[0], componentRows[1], componentRows[2], outputWidth, 4);
+            if (jpeg->app14_color_transform == 2) { // YCCK
+                for (Int columnIndex=0; columnIndex<outputWidth; ++columnIndex, pixel+=4) {
+                    const UChar black = componentRows[3][columnIndex];
+                    pixel[0] = stbi__blinn_8x8(255 - pixel[0], black);
+                    pixel[1] = stbi__blinn_8x8(255 - pixel[1], black);
+                    pixel[2] = stbi__blinn_8x8(255 - pixel[2], black);
+                }
+            }
+        } else {
+            for (Int columnIndex=0; columnIndex<outputWidth; ++columnIndex, pixel+=4) {
+                if (numberOfComponents == 1) {
+                    pixel[0] = pixel[1] = pixel[2] = componentRows[0][columnIndex];
+                } else if (numberOfComponents == 4) { // CMYK
+                    const UChar black = componentRows[3][columnIndex];
+                    pixel[0] = stbi__blinn_8x8(componentRows[0][columnIndex], black);
+                    pixel[1] = stbi__blinn_8x8(componentRows[1][columnIndex], black);
+                    pixel[2] = stbi__blinn_8x8(componentRows[2][columnIndex], black);
+                } else { // RGB
+                    pixel[0] = componentRows[0][columnIndex];
+                    pixel[1] = componentRows[1][columnIndex];
+                    pixel[2] = componentRows[2][columnIndex];
+                }
+                pixel[3] = 255;
+            }
+        }
+    }
+
+    free(rows);
+    free(offsets);
+
+    *width  = outputWidth;
+    *height = outputHeight;
+    return output;
+}
+
+
+Int _convertJPEGReduced(UChar** data,
+                        Int size,
+                        Int scaleShift,
+                        Int* numberOfFrames,
+                        Int** frameDelaysMS,
+                        Int* width,
+                        Int* height,
+                        Int* numberOfOriginalChannels,
+                        Int* numberOfOutputChannels)
+{
+    stbi__context context;
+    stbi__start_mem(&context, *data, size);
+
+    stbi__jpeg* jpeg = _openReducedJPEG(&context, scaleShift);
+    if (!jpeg)
+        return PTERM_MEMORY_ERROR;
+
+    // Every 8x8 block of the component planes now holds a (8>>scaleShift)^2 image in its top left corner
+    if (!stbi__decode_jpeg_image(jpeg)) {
+        PTERM_DEBUG_PRINTF("Reduced JPEG decoding failed (%s)\n", stbi_failure_reason());
+        _closeReducedJPEG(jpeg);
+        return PTERM_INPUT_ERROR;
+    }
+
+    Int outputWidth = 0, outputHeight = 0;
+    UChar* output = _assembleReducedJPEG(jpeg, scaleShift, &outputWidth, &outputHeight);
+    *frameDelaysMS = (Int*) calloc(1, sizeof(Int));
+    const Int numberOfComponents = context.img_n;
+    _closeReducedJPEG(jpeg);
+
+    if (!output || !*frameDelaysMS) {
+        free(output);
+        free(*frameDelaysMS);
+        *frameDelaysMS = NULL;
+        return PTERM_MEMORY_ERROR;
+    }
+
+    free(*data);
+    *data                     = output;
+    *numberOfFrames           = 1;
+    *width                    = outputWidth;
+    *height                   = outputHeight;
+    *numberOfOriginalChannels = numberOfComponents >= 3 ? 3 : 1;
+    *numberOfOutputChannels   = 4;
+    return PTERM_SUCCESS;
+}
+
+
+/// --- PREVIEW DECODING --- ///
+
+/// Read the header of a progressive JPEG, up to its first scan.
+Bool _readJPEGPreviewHeader(stbi__jpeg* jpeg)
+{
+    for (Int component=0; component<4; ++component) {
+        jpeg->img_comp[component].raw_data  = NULL;
+        jpeg->img_comp[component].raw_coeff = NULL;
+    }
+    jpeg->restart_interval = 0;
+    return stbi__decode_jpeg_header(jpeg, STBI__SCAN_load) && jpeg->progressive;
+}
+
+
+/// Decode the scans that follow the header until the coefficients needed at the reduced scale have arrived.
+Bool _decodeJPEGPreviewScans(stbi__jpeg* jpeg, Int scaleShift, Bool* isComplete)
+{
+    // Natural-order coefficients that the reduced IDCT reads
+    const Int blockSize = 8 >> scaleShift;
+    unsigned long long neededCoefficients = 0;
+    for (Int v=0; v<blockSize; ++v)
+        for (Int u=0; u<blockSize; ++u)
+            neededCoefficients |= 1ull << (8 * v + u);
+
+    // Same scan loop as stbi__decode_jpeg_image, which stops once the first pass of every needed coefficient
+    // is in (refinement scans only add precision)
+    unsigned long long receivedCoefficients[4] = {0, 0, 0, 0};
+    *isComplete = PTERM_TRUE;
+    for (Int marker=stbi__get_marker(jpeg); !stbi__EOI(marker); marker=stbi__get_marker(jpeg)) {
+        if (stbi__SOS(marker)) {
+            if (!stbi__process_scan_header(jpeg) || !stbi__parse_entropy_coded_data(jpeg))
+                return PTERM_FALSE;
+
+            if (jpeg->marker == STBI__MARKER_none) {
+                while (!stbi__at_eof(jpeg->s)) {
+                    if (stbi__get8(jpeg->s) == 255) {
+                        jpeg->marker = stbi__get8(jpeg->s);
+                        break;
+                    }
+                }
+            }
+
+            if (jpeg->succ_high == 0) {
+                for (Int scanIndex=0; scanIndex<jpeg->scan_n; ++scanIndex)
+                    for (Int k=jpeg->spec_start; k<=jpeg->spec_end; ++k)
+                        receivedCoefficients[jpeg->order[scanIndex]] |= 1ull << stbi__jpeg_dezigzag[k];
+            }
+
+            Bool isCovered = PTERM_TRUE;
+            for (Int component=0; component<jpeg->s->img_n; ++component)
+                isCovered &= (receivedCoefficients[component] & neededCoefficients) == neededCoefficients;
+
+            if (isCovered) {
+                *isComplete = stbi__EOI(stbi__get_marker(jpeg));
+                break;
+            }
+        } else if (stbi__DNL(marker)) {
+            const Int length = stbi__get16be(jpeg->s);
+            const UInt numberOfLines = stbi__get16be(jpeg->s);
+            if (length != 4 || numberOfLines != jpeg->s->img_y)
+                return PTERM_FALSE;
+        } else if (!stbi__process_marker(jpeg, marker)) {
+            return PTERM_FALSE;
+        }
+    }
+
+    stbi__jpeg_finish(jpeg);
+    return PTERM_TRUE;
+}
+
+
+UChar* _decodeJPEGPreview(const UChar* data, Int size, Int minimumWidth, Int minimumHeight, Int* width, Int* height, Bool* isComplete)
+{
+    stbi__context context;
+    stbi__start_mem(&context, data, size);
+
+    stbi__jpeg* jpeg = _openReducedJPEG(&context, 0);
+    if (!jpeg)
+        return NULL;
+
+    // The header is parsed once: its dimensions select the scale, then the scans follow
+    UChar* preview = NULL;
+    const Int scaleShift = _readJPEGPreviewHeader(jpeg) ? getJPEGScaleShift(context.img_x, context.img_y, minimumWidth, minimumHeight) : 0;
+    if (scaleShift) { // <-- otherwise every coefficient is needed anyway
+        jpeg->idct_block_kernel = jpegReducedKernels[scaleShift];
+        if (_decodeJPEGPreviewScans(jpeg, scaleShift, isComplete))
+            preview = _assembleReducedJPEG(jpeg, scaleShift, width, height);
+    }
+
+    _closeReducedJPEG(jpeg);
+    return preview;
+}
+
+
+// Adam7 passes: origins and spacings, and the pixel grid covered after the first N passes
+const Int adam7Origins[7][2]   = {{0, 0}, {4, 0}, {0, 4}, {2, 0}, {0, 2}, {1, 0}, {0, 1}};
+const Int adam7Spacings[7][2]  = {{8, 8}, {8, 8}, {4, 8}, {4, 4}, {2, 4}, {2, 2}, {1, 2}};
+const Int adam7GridSteps[7][2] = {{8, 8}, {4, 8}, {4, 4}, {2, 4}, {2, 2}, {1, 2}, {1, 1}};
+
+
+UChar* _decodePNGPreview(const UChar* data, Int size, Int minimumWidth, Int minimumHeight, Int* width, Int* height)
+{
+    stbi__context context;
+    stbi__start_mem(&context, data, size);
+    context.img_x = 0;
+    context.img_y = 0;
+    context.img_n = 0;
+    if (!stbi__check_png_header(&context))
+        return NULL;
+
+    // Collect the header, palette, transparency and compressed pixels
+    stbi_uc palette[1024], transparentColor[3] = {0, 0, 0};
+    stbi__uint16 transparentColor16[3] = {0, 0, 0}; // <-- 16-bit images are keyed before their samples are reduced
+    UInt paletteSize = 0, compressedSize = 0, compressedCapacity = 0;
+    Int depth = 0, colorType = 0, isInterlaced = 0, hasTransparency = 0, numberOfPaletteChannels = 0;
+    UChar* compressed = NULL;
+    Bool isValid = PTERM_TRUE;
+
+    for (Bool isDone=PTERM_FALSE, isFirstChunk=PTERM_TRUE; isValid && !isDone; isFirstChunk=PTERM_FALSE) {
+        const stbi__pngchunk chunk = stbi__get_chunk_header(&context);
+        if (stbi__at_eof(&context) || isFirstChunk != (chunk.type == STBI__PNG_TYPE('I','H','D','R'))) {
+            isValid = PTERM_FALSE; // <-- the header comes first, and only once (as in stbi__parse_png_file)
+            break;
+        }
+
+        switch (chunk.type) {
+            case STBI__PNG_TYPE('I','H','D','R'):
+                context.img_x = stbi__get32be(&context);
+                context.img_y = stbi__get32be(&context);
+                depth         = stbi__get8(&context);
+                colorType     = stbi__get8(&context);
+                stbi__skip(&context, 2);
+                isInterlaced  = stbi__get8(&context);
+                isValid = chunk.length == 13 && context.img_x && context.img_y && isInterlaced == 1
+                       && context.img_x <= STBI_MAX_DIMENSIONS && context.img_y <= STBI_MAX_DIMENSIONS
+                       && (size_t) context.img_x * context.img_y <= PTERM_MAX_IMAGE_PIXELS
+                       && (depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16)
+                       && (colorType == 3 ? depth <= 8 : (colorType <= 6 && !(colorType & 1)));
+                numberOfPaletteChannels = colorType == 3 ? 3 : 0;
+                context.img_n = colorType == 3 ? 1 : (colorType & 2 ? 3 : 1) + (colorType & 4 ? 1 : 0);
+                break;
+
+            case STBI__PNG_TYPE('P','L','T','E'):
+                paletteSize = chunk.length / 3;
+                isValid = !compressed && paletteSize <= 256 && paletteSize * 3 == chunk.length;
+                for (UInt index=0; isValid && index<paletteSize; ++index) {
+                    palette[4*index]     = stbi__get8(&context);
+                    palette[4*index + 1] = stbi__get8(&context);
+                    palette[4*index + 2] = stbi__get8(&context);
+                    palette[4*index + 3] = 255;
+                }
+                break;
+
+            case STBI__PNG_TYPE('t','R','N','S'):
+                if (compressed) {
+                    isValid = PTERM_FALSE;
+                } else if (numberOfPaletteChannels) {
+                    isValid = chunk.length <= paletteSize;
+                    numberOfPaletteChannels = 4;
+                    for (UInt index=0; isValid && index<chunk.length; ++index)
+                        palette[4*index + 3] = stbi__get8(&context);
+                } else {
+                    isValid = (context.img_n & 1) && chunk.length == (UInt) context.img_n * 2;
+                    hasTransparency = 1;
+                    for (Int channel=0; isValid && channel<context.img_n; ++channel) {
+                        const UInt value = stbi__get16be(&context);
+                        transparentColor16[channel] = (stbi__uint16) value;
+                        transparentColor[channel]   = (value & 255) * stbi__depth_scale_table[depth == 16 ? 8 : depth];
+                    }
+                }
+                break;
+
+            case STBI__PNG_TYPE('I','D','A','T'):
+                if (compressedCapacity < compressedSize + chunk.length) {
+                    compressedCapacity = 2 * (compressedSize + chunk.length);
+                    UChar* grown = (UChar*) realloc(compressed, compressedCapacity);
+                    isValid = grown != NULL;
+                    compressed = grown ? grown : compressed;
+                }
+                isValid = isValid && stbi__getn(&context, compressed + compressedSize, chunk.length);
+                compressedSize += chunk.length;
+                break;
+
+            case STBI__PNG_TYPE('I','E','N','D'):
+                isDone = PTERM_TRUE;
+                break;
+
+            case STBI__PNG_TYPE('C','g','B','I'): // <-- Apple's variant is left to stb_image
+                isValid = PTERM_FALSE;
+                break;
+
+            default:
+                stbi__skip(&context, chunk.length);
+                break;
+        }
+        stbi__get32be(&context); // <-- CRC
+    }
+
+    // Number of passes whose pixel grid covers the minimum size
+    Int numberOfPasses = 1;
+    while (numberOfPasses < 7
+           && ((Int) (context.img_x + adam7GridSteps[numberOfPasses-1][0] - 1) / adam7GridSteps[numberOfPasses-1][0] < minimumWidth
+           ||  (Int) (context.img_y + adam7GridSteps[numberOfPasses-1][1] - 1) / adam7GridSteps[numberOfPasses-1][1] < minimumHeight))
+        ++numberOfPasses;
+
+    if (!isValid || !compressed || (numberOfPaletteChannels && !paletteSize) || numberOfPasses == 7) {
+        free(compressed);
+        return NULL;
+    }
+
+    // Only inflate the filtered scanlines of these passes (the output limit makes the inflater stop early)
+    const Int numberOfOutputChannels = context.img_n + hasTransparency;
+    const Int bytesPerChannel = depth == 16 ? 2 : 1;
+    UInt passSizes[7] = {0}, rawSize = 0;
+    for (Int pass=0; pass<numberOfPasses; ++pass) {
+        const UInt passWidth  = (context.img_x - adam7Origins[pass][0] + adam7Spacings[pass][0] - 1) / adam7Spacings[pass][0];
+        const UInt passHeight = (context.img_y - adam7Origins[pass][1] + adam7Spacings[pass][1] - 1) / adam7Spacings[pass][1];
+        passSizes[pass] = passWidth && passHeight ? (((context.img_n * passWidth * depth) + 7) / 8 + 1) * passHeight : 0;
+        rawSize += passSizes[pass];
+    }
+
+    stbi__zbuf inflater;
+    const UInt rawCapacity = rawSize + 65536; // <-- a stored block or a match is only written if it fits completely
+    char* raw = (char*) malloc(rawCapacity);
+    inflater.zbuffer     = compressed;
+    inflater.zbuffer_end = compressed + compressedSize;
+    if (raw) {
+        stbi__do_zlib(&inflater, raw, rawCapacity, 0, 1);
+    }
+    free(compressed);
+
+    if (!raw || (UInt) (inflater.zout - raw) < rawSize) {
+        free(raw);
+        return NULL;
+    }
+
+    // Unfilter the passes and put their pixels on the grid
+    const Int gridStepX = adam7GridSteps[numberOfPasses-1][0];
+    const Int gridStepY = adam7GridSteps[numberOfPasses-1][1];
+    const Int previewWidth  = (context.img_x + gridStepX - 1) / gridStepX;
+    const Int previewHeight = (context.img_y + gridStepY - 1) / gridStepY;
+    stbi__png png;
+    png.s     = &context;
+    png.depth = depth;
+    png.out   = NULL;
+
+    UChar* preview = (UChar*) malloc((size_t) previewWidth * previewHeight * numberOfOutputChannels);
+    stbi_uc* passData = (stbi_uc*) raw;
+    for (Int pass=0; preview && pass<numberOfPasses; passData+=passSizes[pass], ++pass) {
+        if (!passSizes[pass])
+            continue;
+
+        const UInt passWidth  = (context.img_x - adam7Origins[pass][0] + adam7Spacings[pass][0] - 1) / adam7Spacings[pass][0];
+        const UInt passHeight = (context.img_y - adam7Origins[pass][1] + adam7Spacings[pass][1] - 1) / adam7Spacings[pass][1];
+        if (!stbi__create_png_image_raw(&png, passData, passSizes[pass], numberOfOutputChannels, passWidth, passHeight, depth, colorType)) {
+            free(png.out);
+            free(preview);
+            preview = NULL;
+            break;
+        }
+
+        for (UInt rowIndex=0; rowIndex<passHeight; ++rowIndex) {
+            const Int y = (rowIndex * adam7Spacings[pass][1] + adam7Origins[pass][1]) / gridStepY;
+            for (UInt columnIndex=0; columnIndex<passWidth; ++columnIndex) {
+                const Int x = (columnIndex * adam7Spacings[pass][0] + adam7Origins[pass][0]) / gridStepX;
+                const size_t source = ((size_t) rowIndex * passWidth + columnIndex) * numberOfOutputChannels;
+                UChar* pixel = preview + ((size_t) y * previewWidth + x) * numberOfOutputChannels;
+                for (Int channel=0; channel<numberOfOutputChannels; ++channel)
+                    pixel[channel] = bytesPerChannel == 2 ? ((stbi__uint16*) png.out)[source + channel] >> 8 : png.out[source + channel];
+
+                if (bytesPerChannel == 2 && hasTransparency) { // <-- compared at full precision, like stbi__compute_transparency16
+                    const stbi__uint16* samples = (stbi__uint16*) png.out + source;
+                    Bool isTransparent = PTERM_TRUE;
+                    for (Int channel=0; channel<context.img_n; ++channel)
+                        isTransparent &= samples[channel] == transparentColor16[channel];
+                    pixel[context.img_n] = isTransparent ? 0 : 255;
+                }
+            }
+        }
+
+        free(png.out);
+        png.out = NULL;
+    }
+    free(raw);
+
+    if (!preview)
+        return NULL;
+
+    // Transparency and palette as in stb_image, then RGBA
+    context.img_x = previewWidth;
+    context.img_y = previewHeight;
+    png.out       = preview;
+    if (hasTransparency && depth != 16) {
+        stbi__compute_transparency(&png, transparentColor, numberOfOutputChannels);
+    }
+
+    if (numberOfPaletteChannels) {
+        preview = stbi__expand_png_palette(&png, palette, paletteSize, 4) ? png.out : NULL;
+        if (!preview)
+            free(png.out);
+    } else if (numberOfOutputChannels != 4) {
+        preview = stbi__convert_format(preview, numberOfOutputChannels, 4, previewWidth, previewHeight);
+    }
+
+    *width  = previewWidth;
+    *height = previewHeight;
+    return preview;
+}
+
+
+UChar* decodePreview(const UChar* data,
+                     Int size,
+                     Int minimumWidth,
+                     Int minimumHeight,
+                     Int* width,
+                     Int* height,
+                     Bool* isComplete)
+{
+    const double begin = beginStage();
+    *isComplete = PTERM_FALSE;
+
+    UChar* preview = _decodeJPEGPreview(data, size, minimumWidth, minimumHeight, width, height, isComplete);
+    if (!preview && !*isComplete) {
+        preview = _decodePNGPreview(data, size, minimumWidth, minimumHeight, width, height);
+    }
+
+    endStage(PTERM_STAGE_DECODE, begin);
+    return preview;
+}
+
+
+/// --- STREAMING PNG DECODING --- ///
+
+#define PTERM_PNG_STREAM_BUFFER    65536u   // <-- bytes of file and compressed input buffered at a time
+#define PTERM_PNG_STREAM_LOOKAHEAD 1024u    // <-- compressed bytes kept ahead of the inflater (a dynamic block header fits)
+#define PTERM_PNG_STREAM_HISTORY   32768u   // <-- deflate window
+
+struct PNGStream
+{
+    // Input
+    Int        fileDescriptor;
+    UChar*     fileBuffer;
+    UInt       fileBufferSize;
+    UInt       fileBufferPosition;
+    UInt       chunkRemaining;      // <-- bytes of the current IDAT chunk not read yet
+    Bool       isEndOfData;         // <-- no more IDAT chunks
+    UChar*     input;               // <-- compressed bytes the inflater reads from
+
+    // Inflater
+    stbi__zbuf inflater;
+    Int        blockType;           // <-- -1 between blocks
+    Bool       isFinalBlock;
+    UInt       storedRemaining;     // <-- bytes left in a stored block
+    UChar*     window;              // <-- inflated bytes: history, then scanlines not consumed yet
+    UInt       windowSize;
+    UInt       windowStart;         // <-- first byte not consumed yet
+    UInt       windowCapacity;
+
+    // Header
+    UInt       width;
+    UInt       height;
+    Int        depth;
+    Int        colorType;
+    Int        numberOfChannels;    // <-- samples per pixel in the scanlines
+    UInt       rowSize;             // <-- bytes per scanline (without the filter byte)
+    UInt       filterOffset;        // <-- bytes per complete pixel (at least 1)
+    stbi_uc    palette[1024];
+    UInt       paletteSize;
+    Bool       hasTransparentColor;
+    UInt       transparentColor[3];
+};
+
+
+/// Buffered read from the file (returns the number of bytes read).
+UInt _readPNGStream(PNGStream* stream, UChar* destination, UInt size)
+{
+    UInt copied = 0;
+    while (copied < size) {
+        if (stream->fileBufferPosition == stream->fileBufferSize) {
+            #ifdef _WIN32
+            Int bytesRead = _read(stream->fileDescriptor, stream->fileBuffer, PTERM_PNG_STREAM_BUFFER);
+            #else
+            Int bytesRead = (Int) read(stream->fileDescriptor, stream->fileBuffer, PTERM_PNG_STREAM_BUFFER);
+            #endif
+
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0)
+                break;
+
+            stream->fileBufferSize     = bytesRead;
+            stream->fileBufferPosition = 0;
+            if (pipelineStats)
+                pipelineStats->bytesRead += bytesRead;
+        }
+
+        UInt available = stream->fileBufferSize - stream->fileBufferPosition;
+        if (size - copied < available)
+            available = size - copied;
+        if (destination) {
+            memcpy(destination + copied, stream->fileBuffer + stream->fileBufferPosition, available);
+        }
+        stream->fileBufferPosition += available;
+        copied += available;
+    }
+
+    return copied;
+}
+
+
+Bool _readPNGStream32(PNGStream* stream, UInt* value)
+{
+    UChar bytes[4];
+    if (_readPNGStream(stream, bytes, 4) != 4)
+        return PTERM_FALSE;
+    *value = ((UInt) bytes[0] << 24) | ((UInt) bytes[1] << 16) | ((UInt) bytes[2] << 8) | bytes[3];
+    return PTERM_TRUE;
+}
+
+
+/// Skip the CRC of the current IDAT and any chunk up to the next IDAT.
+Bool _nextPNGStreamChunk(PNGStream* stream)
+{
+    UInt length = 0, type = 0;
+    if (_readPNGStream(stream, NULL, 4) != 4)
+        return PTERM_FALSE;
+
+    while (_readPNGStream32(stream, &length) && _readPNGStream32(stream, &type)) {
+        if (type == STBI__PNG_TYPE('I','D','A','T')) {
+            stream->chunkRemaining = length;
+            return PTERM_TRUE;
+        }
+        if (type == STBI__PNG_TYPE('I','E','N','D') || _readPNGStream(stream, NULL, length + 4) != length + 4)
+            break;
+    }
+
+    return PTERM_FALSE;
+}
+
+
+/// Move the unread compressed bytes to the front of the input and append more from the IDAT chunks.
+void _refillPNGStream(PNGStream* stream)
+{
+    stbi__zbuf* inflater = &stream->inflater;
+    if (stream->isEndOfData || PTERM_PNG_STREAM_LOOKAHEAD <= (UInt) (inflater->zbuffer_end - inflater->zbuffer))
+        return;
+
+    UInt size = inflater->zbuffer_end - inflater->zbuffer;
+    memmove(stream->input, inflater->zbuffer, size);
+
+    while (size < PTERM_PNG_STREAM_BUFFER && !stream->isEndOfData) {
+        if (!stream->chunkRemaining) {
+            stream->isEndOfData = !_nextPNGStreamChunk(stream);
+            continue;
+        }
+
+        UInt requested = PTERM_PNG_STREAM_BUFFER - size;
+        if (stream->chunkRemaining < requested)
+            requested = stream->chunkRemaining;
+
+        const UInt copied = _readPNGStream(stream, stream->input + size, requested);
+        size += copied;
+        stream->chunkRemaining -= copied;
+        stream->isEndOfData = copied < requested; // <-- truncated file
+    }
+
+    inflater->zbuffer     = stream->input;
+    inflater->zbuffer_end = stream->input + size;
+}
+
+
+/// Inflate until the window holds at least size unconsumed bytes (false on corrupt or truncated data).
+Bool _inflatePNGStream(PNGStream* stream, UInt size)
+{
+    stbi__zbuf* inflater = &stream->inflater;
+
+    while (stream->windowSize - stream->windowStart < size) {
+        // Drop consumed bytes beyond the deflate history when the next match might not fit
+        if (stream->windowCapacity < stream->windowSize + 258) {
+            UInt keepFrom = stream->windowSize - PTERM_PNG_STREAM_HISTORY;
+            if (stream->windowStart < keepFrom)
+                keepFrom = stream->windowStart;
+
+            memmove(stream->window, stream->window + keepFrom, stream->windowSize - keepFrom);
+            stream->windowSize  -= keepFrom;
+            stream->windowStart -= keepFrom;
+        }
+
+        _refillPNGStream(stream);
+
+        if (stream->blockType < 0) { // <-- block header (same as stbi__parse_zlib)
+            if (stream->isFinalBlock)
+                return PTERM_FALSE;
+
+            stream->isFinalBlock = stbi__zreceive(inflater, 1);
+            stream->blockType    = stbi__zreceive(inflater, 2);
+
+            if (stream->blockType == 0) {
+                UChar header[4];
+                Int headerSize = 0;
+                stbi__zreceive(inflater, inflater->num_bits & 7);
+                for (; 0 < inflater->num_bits; inflater->num_bits -= 8, inflater->code_buffer >>= 8)
+                    header[headerSize++] = (UChar) (inflater->code_buffer & 255);
+                while (headerSize < 4)
+                    header[headerSize++] = stbi__zget8(inflater);
+
+                stream->storedRemaining = header[0] | (header[1] << 8);
+                if ((UInt) (header[2] | (header[3] << 8)) != (stream->storedRemaining ^ 0xffff))
+                    return PTERM_FALSE;
+            } else if (stream->blockType == 1) {
+                if (!stbi__zbuild_huffman(&inflater->z_length, stbi__zdefault_length, 288)
+                    || !stbi__zbuild_huffman(&inflater->z_distance, stbi__zdefault_distance, 32))
+                    return PTERM_FALSE;
+            } else if (stream->blockType != 2 || !stbi__compute_huffman_codes(inflater)) {
+                return PTERM_FALSE;
+            }
+
+            if (stream->blockType == 0 && !stream->storedRemaining)
+                stream->blockType = -1;
+            continue;
+        }
+
+        if (stream->blockType == 0) {
+            UInt copied = stream->storedRemaining;
+            if ((UInt) (inflater->zbuffer_end - inflater->zbuffer) < copied)
+                copied = inflater->zbuffer_end - inflater->zbuffer;
+            if (stream->windowCapacity - stream->windowSize < copied)
+                copied = stream->windowCapacity - stream->windowSize;
+            if (!copied)
+                return PTERM_FALSE;
+
+            memcpy(stream->window + stream->windowSize, inflater->zbuffer, copied);
+            inflater->zbuffer       += copied;
+            stream->windowSize      += copied;
+            stream->storedRemaining -= copied;
+            if (!stream->storedRemaining)
+                stream->blockType = -1;
+            continue;
+        }
+
+        // Compressed block (as in stbi__parse_huffman_block), as long as the window and the lookahead have room
+        const UInt target = stream->windowStart + size;
+        const UInt limit  = stream->windowCapacity - 258;
+        UChar* window     = stream->window;
+        UInt windowSize   = stream->windowSize;
+
+        while (windowSize < target && windowSize <= limit && (stream->isEndOfData || 64 <= inflater->zbuffer_end - inflater->zbuffer)) {
+            Int symbol = stbi__zhuffman_decode(inflater, &inflater->z_length);
+            if (symbol < 256) {
+                if (symbol < 0)
+                    return PTERM_FALSE;
+                window[windowSize++] = (UChar) symbol;
+                continue;
+            }
+
+            if (symbol == 256) {
+                stream->blockType = -1;
+                break;
+            }
+
+            symbol -= 257;
+            if (29 <= symbol)
+                return PTERM_FALSE;
+            Int length = stbi__zlength_base[symbol];
+            if (stbi__zlength_extra[symbol])
+                length += stbi__zreceive(inflater, stbi__zlength_extra[symbol]);
+
+            symbol = stbi__zhuffman_decode(inflater, &inflater->z_distance);
+            if (symbol < 0 || 30 <= symbol)
+                return PTERM_FALSE;
+            UInt distance = stbi__zdist_base[symbol];
+            if (stbi__zdist_extra[symbol])
+                distance += stbi__zreceive(inflater, stbi__zdist_extra[symbol]);
+            if (windowSize < distance)
+                return PTERM_FALSE;
+
+            UChar* output = window + windowSize;
+            const UChar* source = output - distance;
+            windowSize += length;
+            if (distance == 1) { // <-- run of one byte
+                memset(output, *source, length);
+            } else if (distance >= (UInt) length) {
+                memcpy(output, source, length);
+            } else {
+                while (length--)
+                    *output++ = *source++;
+            }
+        }
+
+        stream->windowSize = windowSize;
+    }
+
+    return PTERM_TRUE;
+}
+
+
+PNGStream* openPNGStream(Int fileDescriptor, Int* width, Int* height)
+{
+    static const UChar signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    PNGStream* stream = (PNGStream*) calloc(1, sizeof(PNGStream));
+    if (!stream)
+        return NULL;
+
+    stream->fileDescriptor = fileDescriptor;
+    stream->fileBuffer     = (UChar*) malloc(PTERM_PNG_STREAM_BUFFER);
+    stream->input          = (UChar*) malloc(PTERM_PNG_STREAM_BUFFER);
+    stream->blockType      = -1;
+
+    UChar header[13];
+    UInt length = 0, type = 0;
+    Bool isValid = stream->fileBuffer && stream->input
+                && _readPNGStream(stream, header, 8) == 8 && memcmp(header, signature, 8) == 0
+                && _readPNGStream32(stream, &length) && _readPNGStream32(stream, &type)
+                && type == STBI__PNG_TYPE('I','H','D','R') && length == 13
+                && _readPNGStream(stream, header, 17) == 17; // <-- and the CRC
+
+    if (isValid) {
+        stream->width     = ((UInt) header[0] << 24) | ((UInt) header[1] << 16) | ((UInt) header[2] << 8) | header[3];
+        stream->height    = ((UInt) header[4] << 24) | ((UInt) header[5] << 16) | ((UInt) header[6] << 8) | header[7];
+        stream->depth     = header[8];
+        stream->colorType = header[9];
+        stream->numberOfChannels = stream->colorType == 3 ? 1 : (stream->colorType & 2 ? 3 : 1) + (stream->colorType & 4 ? 1 : 0);
+        isValid = stream->width && stream->height && stream->width <= (1u << 30) && stream->height <= (1u << 30)
+               && (stream->depth == 1 || stream->depth == 2 || stream->depth == 4 || stream->depth == 8 || stream->depth == 16)
+               && (stream->colorType == 3 ? stream->depth <= 8 : (stream->colorType <= 6 && !(stream->colorType & 1)))
+               && (stream->colorType == 0 || stream->colorType == 3 || 8 <= stream->depth)
+               && !header[10] && !header[11] && !header[12]; // <-- deflate, adaptive filtering, not interlaced
+    }
+
+    // Palette and transparency, up to the first IDAT
+    while (isValid && _readPNGStream32(stream, &length) && _readPNGStream32(stream, &type)) {
+        if (type == STBI__PNG_TYPE('I','D','A','T')) {
+            stream->chunkRemaining = length;
+            break;
+        } else if (type == STBI__PNG_TYPE('P','L','T','E') && length <= 768 && length % 3 == 0) {
+            UChar entries[768];
+            isValid = _readPNGStream(stream, entries, length) == length;
+            stream->paletteSize = length / 3;
+            for (UInt index=0; index<stream->paletteSize; ++index) {
+                stream->palette[4*index]     = entries[3*index];
+                stream->palette[4*index + 1] = entries[3*index + 1];
+                stream->palette[4*index + 2] = entries[3*index + 2];
+                stream->palette[4*index + 3] = 255;
+            }
+        } else if (type == STBI__PNG_TYPE('t','R','N','S') && stream->colorType == 3 && length <= stream->paletteSize) {
+            UChar alphas[256];
+            isValid = _readPNGStream(stream, alphas, length) == length;
+            for (UInt index=0; index<length; ++index)
+                stream->palette[4*index + 3] = alphas[index];
+        } else if (type == STBI__PNG_TYPE('t','R','N','S') && (stream->colorType == 0 || stream->colorType == 2)
+                   && length == 2u * stream->numberOfChannels) {
+            UChar values[6];
+            isValid = _readPNGStream(stream, values, length) == length;
+            stream->hasTransparentColor = PTERM_TRUE;
+            for (Int channel=0; channel<stream->numberOfChannels; ++channel)
+                stream->transparentColor[channel] = (values[2*channel] << 8) | values[2*channel + 1];
+        } else {
+            isValid = !(type == STBI__PNG_TYPE('I','E','N','D') || type == STBI__PNG_TYPE('C','g','B','I'))
+                   && (type & (1 << 29)) // <-- ancillary chunks only
+                   && _readPNGStream(stream, NULL, length) == length;
+        }
+
+        isValid = isValid && _readPNGStream(stream, NULL, 4) == 4; // <-- CRC
+    }
+
+    isValid = isValid && type == STBI__PNG_TYPE('I','D','A','T') && (stream->colorType != 3 || stream->paletteSize);
+
+    const unsigned long long rowSize = ((unsigned long long) stream->width * stream->numberOfChannels * stream->depth + 7) / 8;
+    isValid = isValid && rowSize <= (1u << 28);
+
+    if (isValid) {
+        stream->rowSize        = (UInt) rowSize;
+        stream->filterOffset   = 8 <= stream->depth ? stream->numberOfChannels * stream->depth / 8 : 1;
+        stream->windowCapacity = 2 * (PTERM_PNG_STREAM_HISTORY + stream->rowSize + 1 + 258);
+        stream->window         = (UChar*) malloc(stream->windowCapacity);
+
+        stream->inflater.zbuffer     = stream->input;
+        stream->inflater.zbuffer_end = stream->input;
+        _refillPNGStream(stream);
+        isValid = stream->window && stbi__parse_zlib_header(&stream->inflater);
+        stream->inflater.num_bits    = 0;
+        stream->inflater.code_buffer = 0;
+    }
+
+    if (!isValid) {
+        PTERM_DEBUG_PRINTF("%s\n", "Input is not a PNG that can be streamed");
+        closePNGStream(stream);
+        return NULL;
+    }
+
+    *width  = stream->width;
+    *height = stream->height;
+    return stream;
+}
+
+
+/// Undo the filter of a scanline in place (prior: the previous unfiltered scanline).
+Bool _unfilterPNGRow(UChar* row, const UChar* prior, UInt size, UInt offset, Int filter)
+{
+    switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (UInt index=offset; index<size; ++index)
+                row[index] += row[index - offset];
+            break;
+        case 2:
+            for (UInt index=0; index<size; ++index)
+                row[index] += prior[index];
+            break;
+        case 3:
+            for (UInt index=0; index<size; ++index)
+                row[index] += ((offset <= index ? row[index - offset] : 0) + prior[index]) >> 1;
+            break;
+        case 4:
+            for (UInt index=0; index<size; ++index)
+                row[index] += stbi__paeth(offset <= index ? row[index - offset] : 0,
+                                          prior[index],
+                                          offset <= index ? prior[index - offset] : 0);
+            break;
+        default:
+            return PTERM_FALSE;
+    }
+    return PTERM_TRUE;
+}
+
+
+/// Convert an unfiltered scanline into RGBA (transparency and palette as in stb_image).
+void _expandPNGRow(const PNGStream* stream, const UChar* row, UChar* pixels)
+{
+    const Int depth = stream->depth;
+    const Int numberOfChannels = stream->numberOfChannels;
+    const UInt mask = (1u << (depth < 8 ? depth : 8)) - 1;
+
+    if (depth == 8 && numberOfChannels == 3 && !stream->hasTransparentColor) { // <-- common case
+        for (UInt columnIndex=0; columnIndex<stream->width; ++columnIndex, pixels+=4, row+=3) {
+            pixels[0] = row[0];
+            pixels[1] = row[1];
+            pixels[2] = row[2];
+            pixels[3] = 255;
+        }
+        return;
+    }
+
+    for (UInt columnIndex=0; columnIndex<stream->width; ++columnIndex, pixels+=4) {
+        UInt samples[4] = {0, 0, 0, 0};
+        for (Int channel=0; channel<numberOfChannels; ++channel) {
+            const unsigned long long sampleIndex = (unsigned long long) columnIndex * numberOfChannels + channel;
+            if (depth == 16) {
+                samples[channel] = (row[2*sampleIndex] << 8) | row[2*sampleIndex + 1];
+            } else if (depth == 8) {
+                samples[channel] = row[sampleIndex];
+            } else {
+                const unsigned long long bit = sampleIndex * depth;
+                samples[channel] = (row[bit >> 3] >> (8 - depth - (bit & 7))) & mask;
+            }
+        }
+
+        if (stream->colorType == 3) {
+            memcpy(pixels, stream->palette + 4 * (samples[0] < stream->paletteSize ? samples[0] : 0), 4);
+            continue;
+        }
+
+        const Bool isTransparent = stream->hasTransparentColor
+                                && samples[0] == stream->transparentColor[0]
+                                && (numberOfChannels == 1 || (samples[1] == stream->transparentColor[1] && samples[2] == stream->transparentColor[2]));
+
+        for (Int channel=0; channel<numberOfChannels; ++channel)
+            samples[channel] = depth == 16 ? samples[channel] >> 8 : samples[channel] * stbi__depth_scale_table[depth];
+
+        if (numberOfChannels <= 2) { // <-- gray (and alpha)
+            pixels[0] = pixels[1] = pixels[2] = samples[0];
+            pixels[3] = numberOfChannels == 2 ? samples[1] : 255;
+        } else {
+            pixels[0] = samples[0];
+            pixels[1] = samples[1];
+            pixels[2] = samples[2];
+            pixels[3] = numberOfChannels == 4 ? samples[3] : 255;
+        }
+
+        if (isTransparent)
+            pixels[3] = 0;
+    }
+}
+
+
+Int decodePNGStream(PNGStream* stream, UChar* image, Int width, Int height)
+{
+    if (width <= 0 || height <= 0 || stream->width < (UInt) width || stream->height < (UInt) height)
+        return PTERM_ARGUMENT_ERROR;
+
+    const double begin = beginStage();
+
+    // Box filter: output column i covers source columns [columnEnds[i-1], columnEnds[i])
+    UChar* rows                  = (UChar*) calloc(2, stream->rowSize);
+    UChar* pixels                = (UChar*) malloc((size_t) stream->width * 4);
+    UInt* columnEnds             = (UInt*) malloc(width * sizeof(UInt));
+    unsigned long long* sums     = (unsigned long long*) calloc(4 * width, sizeof(unsigned long long));
+
+    if (!rows || !pixels || !columnEnds || !sums) {
+        free(rows);
+        free(pixels);
+        free(columnEnds);
+        free(sums);
+        endStage(PTERM_STAGE_DECODE, begin);
+        return PTERM_MEMORY_ERROR;
+    }
+
+    for (Int columnIndex=0; columnIndex<width; ++columnIndex)
+        columnEnds[columnIndex] = ((unsigned long long) (columnIndex + 1) * stream->width + width - 1) / width;
+
+    Int result = PTERM_SUCCESS;
+    UInt rowBegin = 0;
+    for (Int outputRowIndex=0; result==PTERM_SUCCESS && outputRowIndex<height; ++outputRowIndex) {
+        const UInt rowEnd = ((unsigned long long) (outputRowIndex + 1) * stream->height + height - 1) / height;
+
+        for (UInt rowIndex=rowBegin; rowIndex<rowEnd; ++rowIndex) {
+            UChar* row = rows + (rowIndex & 1) * stream->rowSize;
+            const UChar* prior = rows + (~rowIndex & 1) * stream->rowSize;
+
+            if (!_inflatePNGStream(stream, stream->rowSize + 1)) {
+                PTERM_DEBUG_PRINTF("Corrupt or truncated PNG data at row %u\n", rowIndex);
+                result = PTERM_INPUT_ERROR;
+                break;
+            }
+
+            const UChar* filtered = stream->window + stream->windowStart;
+            memcpy(row, filtered + 1, stream->rowSize);
+            stream->windowStart += stream->rowSize + 1;
+            if (!_unfilterPNGRow(row, prior, stream->rowSize, stream->filterOffset, filtered[0])) {
+                result = PTERM_INPUT_ERROR;
+                break;
+            }
+
+            _expandPNGRow(stream, row, pixels);
+
+            const UChar* pixel = pixels;
+            for (Int columnIndex=0, columnBegin=0; columnIndex<width; columnBegin=columnEnds[columnIndex++]) {
+                unsigned long long* sum = sums + 4 * columnIndex;
+                for (UInt sourceIndex=columnBegin; sourceIndex<columnEnds[columnIndex]; ++sourceIndex, pixel+=4) {
+                    sum[0] += pixel[0];
+                    sum[1] += pixel[1];
+                    sum[2] += pixel[2];
+                    sum[3] += pixel[3];
+                }
+            }
+        }
+
+        // Emit the output row
+        UChar* output = image + (size_t) outputRowIndex * width * 4;
+        for (Int columnIndex=0, columnBegin=0; columnIndex<width; columnBegin=columnEnds[columnIndex++]) {
+            const unsigned long long count = (unsigned long long) (columnEnds[columnIndex] - columnBegin) * (rowEnd - rowBegin);
+            for (Int channel=0; channel<4; ++channel) {
+                output[4*columnIndex + channel] = (UChar) ((sums[4*columnIndex + channel] + count / 2) / count);
+                sums[4*columnIndex + channel] = 0;
+            }
+        }
+        rowBegin = rowEnd;
+    }
+
+    free(rows);
+    free(pixels);
+    free(columnEnds);
+    free(sums);
+    endStage(PTERM_STAGE_DECODE, begin);
+    return result;
+}
+
+
+void closePNGStream(PNGStream* stream)
+{
+    if (stream) {
+        free(stream->fileBuffer);
+        free(stream->input);
+        free(stream->window);
+        free(stream);
+    }
+}
+
+
+/// --- VIDEO STREAMS --- ///
+
+#define PTERM_VIDEO_STREAM_BUFFER 65536u // <-- bytes read from the input at a time (larger payloads are read directly)
+#define PTERM_VIDEO_PNG_SIZE ((size_t) INT_MAX) // <-- largest PNG that stb_image decodes from memory
+#define PTERM_VIDEO_PNM_HEADER_SIZE 4096u // <-- PNM headers (with comments) longer than this are rejected
+
+// Fixed-point BT.601 coefficients: chroma (and luma) is scaled by 128 and multiplied by these with
+// a 16-bit high multiply, which leaves the contributions in eighths of a level (see convertYUVRow)
+#define PTERM_YUV_LUMA_LIMITED      4769    // <-- 1.164 * 4096
+#define PTERM_YUV_LUMA_FULL         4096
+#define PTERM_YUV_RED_V_LIMITED     6537    // <-- 1.596 * 4096
+#define PTERM_YUV_GREEN_U_LIMITED  -1605    // <-- -0.392 * 4096
+#define PTERM_YUV_GREEN_V_LIMITED  -3330    // <-- -0.813 * 4096
+#define PTERM_YUV_BLUE_U_LIMITED    8263    // <-- 2.017 * 4096
+#define PTERM_YUV_RED_V_FULL        5743    // <-- 1.402 * 4096
+#define PTERM_YUV_GREEN_U_FULL     -1410    // <-- -0.344 * 4096
+#define PTERM_YUV_GREEN_V_FULL     -2925    // <-- -0.714 * 4096
+#define PTERM_YUV_BLUE_U_FULL       7258    // <-- 1.772 * 4096
+
+struct VideoStream
+{
+    // Input
+    Int        fileDescriptor;
+    Int        format;
+    UChar*     fileBuffer;
+    UInt       fileBufferSize;
+    UInt       fileBufferPosition;
+    UChar*     picture;             // <-- planes of the current Y4M frame
+    UChar*     neutralChroma;       // <-- chroma row of monochrome pictures
+    UChar*     image;               // <-- file of the current image of PNG and PNM streams
+    size_t     imageSize;
+    size_t     imageCapacity;
+
+    // Header
+    Int        width;
+    Int        height;
+    Int        chromaShiftX;        // <-- log2 of the chroma subsampling
+    Int        chromaShiftY;
+    Bool       hasChroma;
+    Bool       isFullRange;
+    size_t     pictureSize;         // <-- bytes of the payload of a frame
+
+    // Ring of RGBA frames: the reader fills the slots after the acquired ones
+    UChar*     frames[PTERM_VIDEO_STREAM_BUFFERS];
+    UInt       firstFrame;          // <-- slot acquired (or acquired next) by the consumer
+    UInt       numberOfFrames;      // <-- slots filled by the reader and not released yet
+    Bool       isEndOfStream;
+    #ifndef _WIN32
+    pthread_t       reader;
+    Bool            hasReader;
+    pthread_mutex_t lock;
+    pthread_cond_t  condition;
+    #endif
+
+    // Statistics of the reader (added to pipelineStats when the stream is closed)
+    double             readSeconds;
+    double             decodeSeconds;
+    UInt               numberOfReads;
+    UInt               numberOfDecodes;
+    unsigned long long bytesRead;
+};
+
+
+/// Buffered read from the input (returns the number of bytes read).
+size_t _readVideoStream(VideoStream* stream, UChar* destination, size_t size)
+{
+    size_t copied = 0;
+    while (copied < size) {
+        UInt available = stream->fileBufferSize - stream->fileBufferPosition;
+        if (available) {
+            if (size - copied < available)
+                available = (UInt)(size - copied);
+            memcpy(destination + copied, stream->fileBuffer + stream->fileBufferPosition, available);
+            stream->fileBufferPosition += available;
+            copied += available;
+            continue;
+        }
+
+        // Large payloads skip the buffer
+        const Bool isDirect = PTERM_VIDEO_STREAM_BUFFER <= size - copied;
+        UChar* target       = isDirect ? destination + copied : stream->fileBuffer;
+        const size_t wanted = isDirect ? size - copied : PTERM_VIDEO_STREAM_BUFFER;
+
+        #ifdef _WIN32
+        Int bytesRead = _read(stream->fileDescriptor, target, (UInt) wanted);
+        #else
+        // The reader thread can only be cancelled while it waits for input
+        Int state = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        Int bytesRead = (Int) read(stream->fileDescriptor, target, wanted < INT_MAX ? wanted : INT_MAX);
+        pthread_setcancelstate(state, &state);
+        #endif
+
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0)
+            break;
+
+        stream->bytesRead += bytesRead;
+        if (isDirect) {
+            copied += bytesRead;
+        } else {
+            stream->fileBufferSize     = bytesRead;
+            stream->fileBufferPosition = 0;
+        }
+    }
+
+    return copied;
+}
+
+
+/// Read a header line of a Y4M stream without its new line (false if it does not fit or the input ends).
+Bool _readVideoStreamLine(VideoStream* stream, Char* line, UInt capacity)
+{
+    for (UInt length=0; length<capacity; ++length) {
+        if (_readVideoStream(stream, (UChar*) line + length, 1) != 1)
+            return PTERM_FALSE;
+        if (line[length] == '\n') {
+            line[length] = '\0';
+            return PTERM_TRUE;
+        }
+    }
+
+    return PTERM_FALSE;
+}
+
+
+/// Parse the stream header of a Y4M stream (YUV4MPEG2 W<width> H<height> F<rate> C<chroma> ...).
+Bool _readY4MHeader(VideoStream* stream, double* frameRate)
+{
+    Char line[1024];
+    if (!_readVideoStreamLine(stream, line, sizeof(line)) || strncmp(line, "YUV4MPEG2", 9) != 0)
+        return PTERM_FALSE;
+
+    stream->chromaShiftX = 1; // <-- 4:2:0 unless stated otherwise
+    stream->chromaShiftY = 1;
+    stream->hasChroma    = PTERM_TRUE;
+
+    // Split in place rather than with strtok, whose hidden state is shared with the other threads
+    for (Char* token=line + 9, *next=token; *token; token=next) {
+        Char* end = token + strcspn(token, " ");
+        next = *end ? end + 1 : end;
+        *end = '\0';
+
+        switch (token[0]) {
+            case 'W': stream->width  = atoi(token + 1); break;
+            case 'H': stream->height = atoi(token + 1); break;
+            case 'F': {
+                Int numerator = 0, denominator = 0;
+                if (sscanf(token + 1, "%i:%i", &numerator, &denominator) == 2 && 0 < numerator && 0 < denominator)
+                    *frameRate = (double) numerator / denominator;
+                break;
+            }
+            case 'C':
+                if (strncmp(token + 1, "420", 3) == 0 && (!token[4] || strcmp(token + 4, "jpeg") == 0 || strcmp(token + 4, "mpeg2") == 0 || strcmp(token + 4, "paldv") == 0)) {
+                    stream->chromaShiftX = 1;
+                    stream->chromaShiftY = 1;
+                } else if (strcmp(token + 1, "422") == 0) {
+                    stream->chromaShiftX = 1;
+                    stream->chromaShiftY = 0;
+                } else if (strcmp(token + 1, "444") == 0) {
+                    stream->chromaShiftX = 0;
+                    stream->chromaShiftY = 0;
+                } else if (strcmp(token + 1, "mono") == 0) {
+                    stream->hasChroma = PTERM_FALSE;
+                } else {
+                    PTERM_DEBUG_PRINTF("Unsupported Y4M chroma format: %s\n", token + 1);
+                    return PTERM_FALSE; // <-- more than 8 bits per sample, or alpha
+                }
+                break;
+            case 'X':
+                if (strcmp(token + 1, "COLORRANGE=FULL") == 0)
+                    stream->isFullRange = PTERM_TRUE;
+                break;
+            default: // interlacing and aspect ratio don't matter here
+                break;
+        }
+    }
+
+    return 0 < stream->width && 0 < stream->height;
+}
+
+
+void convertYUVRow(const UChar* y, const UChar* u, const UChar* v, UChar* rgba, Int width, Int chromaShift, Bool isFullRange)
+{
+    const short lumaOffset = isFullRange ? 0 : 16;
+    const short luma       = isFullRange ? PTERM_YUV_LUMA_FULL : PTERM_YUV_LUMA_LIMITED;
+    const short redV       = isFullRange ? PTERM_YUV_RED_V_FULL : PTERM_YUV_RED_V_LIMITED;
+    const short greenU     = isFullRange ? PTERM_YUV_GREEN_U_FULL : PTERM_YUV_GREEN_U_LIMITED;
+    const short greenV     = isFullRange ? PTERM_YUV_GREEN_V_FULL : PTERM_YUV_GREEN_V_LIMITED;
+    const short blueU      = isFullRange ? PTERM_YUV_BLUE_U_FULL : PTERM_YUV_BLUE_U_LIMITED;
+
+    Int column = 0;
+
+    #ifdef PTERM_SSE2
+    // 8 pixels at a time in 16-bit lanes
+    const __m128i zero     = _mm_setzero_si128();
+    const __m128i vOffset  = _mm_set1_epi16(lumaOffset);
+    const __m128i vCenter  = _mm_set1_epi16(128);
+    const __m128i vRound   = _mm_set1_epi16(4);
+    const __m128i vLuma    = _mm_set1_epi16(luma);
+    const __m128i vRedV    = _mm_set1_epi16(redV);
+    const __m128i vGreenU  = _mm_set1_epi16(greenU);
+    const __m128i vGreenV  = _mm_set1_epi16(greenV);
+    const __m128i vBlueU   = _mm_set1_epi16(blueU);
+    const __m128i vAlpha   = _mm_set1_epi8((char) 0xFF);
+
+    for (; column+8<=width; column+=8, rgba+=32) {
+        __m128i vy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + column)), zero);
+        __m128i vu, vv;
+        if (chromaShift) { // <-- each chroma sample covers two pixels
+            Int chroma = 0, chromaV = 0;
+            memcpy(&chroma, u + (column >> 1), 4);
+            memcpy(&chromaV, v + (column >> 1), 4);
+            vu = _mm_cvtsi32_si128(chroma);
+            vv = _mm_cvtsi32_si128(chromaV);
+            vu = _mm_unpacklo_epi8(_mm_unpacklo_epi8(vu, vu), zero);
+            vv = _mm_unpacklo_epi8(_mm_unpacklo_epi8(vv, vv), zero);
+        } else {
+            vu = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + column)), zero);
+            vv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + column)), zero);
+        }
+
+        vy = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(vy, vOffset), 7), vLuma);
+        vu = _mm_slli_epi16(_mm_sub_epi16(vu, vCenter), 7);
+        vv = _mm_slli_epi16(_mm_sub_epi16(vv, vCenter), 7);
+
+        __m128i red   = _mm_add_epi16(vy, _mm_mulhi_epi16(vv, vRedV));
+        __m128i green = _mm_add_epi16(_mm_add_epi16(vy, _mm_mulhi_epi16(vu, vGreenU)), _mm_mulhi_epi16(vv, vGreenV));
+        __m128i blue  = _mm_add_epi16(vy, _mm_mulhi_epi16(vu, vBlueU));
+        red   = _mm_srai_epi16(_mm_add_epi16(red, vRound), 3);
+        green = _mm_srai_epi16(_mm_add_epi16(green, vRound), 3);
+        blue  = _mm_srai_epi16(_mm_add_epi16(blue, vRound), 3);
+
+        // Saturate to bytes and interleave as RGBA
+        const __m128i redGreen  = _mm_unpacklo_epi8(_mm_packus_epi16(red, red), _mm_packus_epi16(green, green));
+        const __m128i blueAlpha = _mm_unpacklo_epi8(_mm_packus_epi16(blue, blue), vAlpha);
+        _mm_storeu_si128((__m128i*) rgba, _mm_unpacklo_epi16(redGreen, blueAlpha));
+        _mm_storeu_si128((__m128i*)(rgba + 16), _mm_unpackhi_epi16(redGreen, blueAlpha));
+    }
+    #endif
+
+    // Same arithmetic as above, one pixel at a time
+    for (; column<width; ++column, rgba+=4) {
+        const Int chromaColumn = column >> chromaShift;
+        const Int lumaTerm     = ((y[column] - lumaOffset) * 128 * luma) >> 16;
+        const Int uTerm        = (u[chromaColumn] - 128) * 128;
+        const Int vTerm        = (v[chromaColumn] - 128) * 128;
+
+        const Int red   = (lumaTerm + ((vTerm * redV) >> 16) + 4) >> 3;
+        const Int green = (lumaTerm + ((uTerm * greenU) >> 16) + ((vTerm * greenV) >> 16) + 4) >> 3;
+        const Int blue  = (lumaTerm + ((uTerm * blueU) >> 16) + 4) >> 3;
+
+        rgba[0] = (UChar)(red < 0 ? 0 : 255 < red ? 255 : red);
+        rgba[1] = (UChar)(green < 0 ? 0 : 255 < green ? 255 : green);
+        rgba[2] = (UChar)(blue < 0 ? 0 : 255 < blue ? 255 : blue);
+        rgba[3] = 255;
+    }
+}
+
+
+/// Append the next bytes of the input to the current image of a PNG or PNM stream, if it stays within maximumSize bytes.
+Bool _appendStreamImage(VideoStream* stream, size_t size, size_t maximumSize)
+{
+    if (maximumSize < stream->imageSize || maximumSize - stream->imageSize < size)
+        return PTERM_FALSE;
+
+    if (stream->imageCapacity < stream->imageSize + size) {
+        size_t capacity = stream->imageCapacity ? 2 * stream->imageCapacity : PTERM_VIDEO_STREAM_BUFFER;
+        while (capacity < stream->imageSize + size)
+            capacity *= 2;
+        if (maximumSize < capacity) // <-- no larger than the image can get
+            capacity = maximumSize;
+
+        UChar* image = (UChar*) realloc(stream->image, capacity);
+        if (!image)
+            return PTERM_FALSE;
+        stream->image         = image;
+        stream->imageCapacity = capacity;
+    }
+
+    const size_t bytesRead = _readVideoStream(stream, stream->image + stream->imageSize, size);
+    stream->imageSize += bytesRead;
+    return bytesRead == size;
+}
+
+
+/// Read the chunks of the next PNG of the stream up to its IEND chunk.
+Bool _readPNGImage(VideoStream* stream)
+{
+    static const UChar signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    stream->imageSize = 0;
+    if (!_appendStreamImage(stream, 8, PTERM_VIDEO_PNG_SIZE) || memcmp(stream->image, signature, 8) != 0)
+        return PTERM_FALSE;
+
+    for (;;) {
+        if (!_appendStreamImage(stream, 8, PTERM_VIDEO_PNG_SIZE))
+            return PTERM_FALSE;
+
+        const UChar* header = stream->image + stream->imageSize - 8;
+        const UInt length   = ((UInt) header[0] << 24) | ((UInt) header[1] << 16) | ((UInt) header[2] << 8) | header[3];
+        const Bool isEnd    = memcmp(header + 4, "IEND", 4) == 0;
+
+        if ((1u << 31) <= length || !_appendStreamImage(stream, (size_t) length + 4, PTERM_VIDEO_PNG_SIZE)) // <-- data and CRC
+            return PTERM_FALSE;
+        if (isEnd)
+            return PTERM_TRUE;
+    }
+}
+
+
+/// Append the next byte of a PNM header and return it (-1 at the end of the input).
+Int _nextPNMByte(VideoStream* stream)
+{
+    return _appendStreamImage(stream, 1, PTERM_VIDEO_PNM_HEADER_SIZE) ? stream->image[stream->imageSize - 1] : -1;
+}
+
+
+/** Read the next binary PNM (P5 or P6 with 8-bit samples) of the stream: the header is parsed like
+ *  stbi__pnm_info does, and gives the size of the raster that follows its single separator byte.
+ */
+Bool _readPNMImage(VideoStream* stream)
+{
+    Int byte = 0;
+    do { // <-- some writers separate images with new lines
+        stream->imageSize = 0;
+        byte = _nextPNMByte(stream);
+    } while (byte == ' ' || ('\t' <= byte && byte <= '\r'));
+
+    const Int type = _nextPNMByte(stream);
+    if (byte != 'P' || (type != '5' && type != '6'))
+        return PTERM_FALSE;
+
+    UInt values[3] = {0, 0, 0}; // <-- width, height and maximum value
+    byte = _nextPNMByte(stream);
+    for (Int valueIndex=0; valueIndex<3; ++valueIndex) {
+        // Whitespace and comments
+        for (;;) {
+            while (byte == ' ' || ('\t' <= byte && byte <= '\r'))
+                byte = _nextPNMByte(stream);
+            if (byte != '#')
+                break;
+            while (0 <= byte && byte != '\n' && byte != '\r')
+                byte = _nextPNMByte(stream);
+        }
+
+        for (; '0' <= byte && byte <= '9' && values[valueIndex] < (1u << 24); byte = _nextPNMByte(stream))
+            values[valueIndex] = 10 * values[valueIndex] + (byte - '0');
+    }
+
+    // The byte after the maximum value has been read already
+    if (byte < 0 || !values[0] || !values[1] || !values[2] || 255 < values[2]
+        || PTERM_MAX_IMAGE_PIXELS < (size_t) values[0] * values[1])
+        return PTERM_FALSE;
+
+    // The buffer holds the header and exactly the raster it announces
+    const size_t rasterSize = (size_t) values[0] * values[1] * (type == '6' ? 3 : 1);
+    return _appendStreamImage(stream, rasterSize, stream->imageSize + rasterSize);
+}
+
+
+/// Decode the current image of a PNG or PNM stream into a slot of the ring, at the size of the stream.
+Bool _decodeStreamImage(VideoStream* stream, UInt frameIndex)
+{
+    Int width = 0, height = 0, numberOfChannels = 0;
+    if (!stbi_info_from_memory(stream->image, (Int) stream->imageSize, &width, &height, &numberOfChannels)
+        || PTERM_MAX_IMAGE_PIXELS < (size_t) width * height)
+        return PTERM_FALSE;
+
+    UChar* image = stbi_load_from_memory(stream->image, (Int) stream->imageSize, &width, &height, &numberOfChannels, 4);
+    if (!image) {
+        PTERM_DEBUG_PRINTF("Failed to decode a streamed image (%s)\n", stbi_failure_reason());
+        return PTERM_FALSE;
+    }
+
+    if (width == stream->width && height == stream->height) { // <-- the decoded image takes the place of the slot
+        free(stream->frames[frameIndex]);
+        stream->frames[frameIndex] = image;
+        return PTERM_TRUE;
+    }
+
+    // Images of another size are fitted to the first one (not timed as a stage: this runs on the reader)
+    const Bool isResized = stbir_resize_uint8(image, width, height, 0, stream->frames[frameIndex], stream->width, stream->height, 0, 4);
+    free(image);
+    return isResized;
+}
+
+
+/// Read the next frame of the stream into a slot of the ring (false at the end of the stream).
+Bool _readVideoFrame(VideoStream* stream, UInt frameIndex)
+{
+    UChar* frame = stream->frames[frameIndex];
+    double begin = getMonotonicTime();
+
+    if (stream->format == PTERM_VIDEO_PNG || stream->format == PTERM_VIDEO_PNM) {
+        if (!(stream->format == PTERM_VIDEO_PNG ? _readPNGImage(stream) : _readPNMImage(stream)))
+            return PTERM_FALSE;
+
+        double end = getMonotonicTime();
+        stream->readSeconds += end - begin;
+        ++stream->numberOfReads;
+        traceEvent("read", begin, end);
+        begin = end;
+
+        const Bool isDecoded = _decodeStreamImage(stream, frameIndex);
+        end = getMonotonicTime();
+        stream->decodeSeconds += end - begin;
+        ++stream->numberOfDecodes;
+        traceEvent("decode", begin, end);
+        return isDecoded;
+    }
+
+    if (stream->format == PTERM_VIDEO_RGBA) {
+        const Bool isComplete = _readVideoStream(stream, frame, stream->pictureSize) == stream->pictureSize;
+        const double end = getMonotonicTime();
+        stream->readSeconds += end - begin;
+        ++stream->numberOfReads;
+        traceEvent("read", begin, end);
+        return isComplete;
+    }
+
+    Char line[256];
+    if (!_readVideoStreamLine(stream, line, sizeof(line)) || strncmp(line, "FRAME", 5) != 0
+        || _readVideoStream(stream, stream->picture, stream->pictureSize) != stream->pictureSize)
+        return PTERM_FALSE;
+
+    double end = getMonotonicTime();
+    stream->readSeconds += end - begin;
+    ++stream->numberOfReads;
+    traceEvent("read", begin, end);
+    begin = end;
+
+    const Int width        = stream->width;
+    const Int chromaWidth  = (width + (1 << stream->chromaShiftX) - 1) >> stream->chromaShiftX;
+    const Int chromaHeight = (stream->height + (1 << stream->chromaShiftY) - 1) >> stream->chromaShiftY;
+    const UChar* lumaPlane = stream->picture;
+    const UChar* uPlane    = lumaPlane + (size_t) width * stream->height;
+    const UChar* vPlane    = uPlane + (size_t) chromaWidth * chromaHeight;
+
+    for (Int rowIndex=0; rowIndex<stream->height; ++rowIndex) {
+        const size_t chromaRow = (size_t)(rowIndex >> stream->chromaShiftY) * chromaWidth;
+        convertYUVRow(lumaPlane + (size_t) rowIndex * width,
+                      stream->hasChroma ? uPlane + chromaRow : stream->neutralChroma,
+                      stream->hasChroma ? vPlane + chromaRow : stream->neutralChroma,
+                      frame + (size_t) rowIndex * width * 4,
+                      width,
+                      stream->hasChroma ? stream->chromaShiftX : 0,
+                      stream->isFullRange);
+    }
+
+    end = getMonotonicTime();
+    stream->decodeSeconds += end - begin;
+    ++stream->numberOfDecodes;
+    traceEvent("convert", begin, end);
+    return PTERM_TRUE;
+}
+
+
+#ifndef _WIN32
+/// Fill the free slots of the ring until the stream ends (or the stream is closed).
+void* _videoStreamReader(void* p_stream)
+{
+    VideoStream* stream = (VideoStream*) p_stream;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for (Bool isReading=PTERM_TRUE; isReading; ) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->numberOfFrames == PTERM_VIDEO_STREAM_BUFFERS)
+            pthread_cond_wait(&stream->condition, &stream->lock);
+        const UInt frameIndex = (stream->firstFrame + stream->numberOfFrames) % PTERM_VIDEO_STREAM_BUFFERS;
+        pthread_mutex_unlock(&stream->lock);
+
+        isReading = _readVideoFrame(stream, frameIndex); // <-- the slot is not visible to the consumer yet
+
+        pthread_mutex_lock(&stream->lock);
+        if (isReading) {
+            ++stream->numberOfFrames;
+        } else {
+            stream->isEndOfStream = PTERM_TRUE;
+        }
+        pthread_cond_signal(&stream->condition);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    return NULL;
+}
+#endif
+
+
+VideoStream* openVideoStream(Int fileDescriptor, Int format, Int* width, Int* height, double* frameRate)
+{
+    VideoStream* stream = (VideoStream*) calloc(1, sizeof(VideoStream));
+    if (!stream)
+        return NULL;
+
+    stream->fileDescriptor = fileDescriptor;
+    stream->format         = format;
+    stream->fileBuffer     = (UChar*) malloc(PTERM_VIDEO_STREAM_BUFFER);
+    *frameRate             = 0.0;
+
+    Bool isValid = stream->fileBuffer != NULL;
+    if (isValid && format == PTERM_VIDEO_Y4M) {
+        isValid = _readY4MHeader(stream, frameRate);
+    } else if (format == PTERM_VIDEO_PNG || format == PTERM_VIDEO_PNM) {
+        // The first image sets the size of the stream
+        Int numberOfChannels = 0;
+        isValid = isValid
+               && (format == PTERM_VIDEO_PNG ? _readPNGImage(stream) : _readPNMImage(stream))
+               && stbi_info_from_memory(stream->image, (Int) stream->imageSize, &stream->width, &stream->height, &numberOfChannels);
+    } else {
+        stream->width  = *width;
+        stream->height = *height;
+        isValid = isValid && format == PTERM_VIDEO_RGBA && 0 < stream->width && 0 < stream->height;
+    }
+
+    isValid = isValid && (size_t) stream->width * stream->height <= PTERM_MAX_IMAGE_PIXELS;
+    if (isValid && format == PTERM_VIDEO_Y4M) {
+        const size_t chromaWidth  = (stream->width + (1 << stream->chromaShiftX) - 1) >> stream->chromaShiftX;
+        const size_t chromaHeight = (stream->height + (1 << stream->chromaShiftY) - 1) >> stream->chromaShiftY;
+        stream->pictureSize   = (size_t) stream->width * stream->height + (stream->hasChroma ? 2 * chromaWidth * chromaHeight : 0);
+        stream->picture       = (UChar*) malloc(stream->pictureSize);
+        stream->neutralChroma = (UChar*) malloc(stream->width);
+        isValid = stream->picture && stream->neutralChroma;
+        if (isValid)
+            memset(stream->neutralChroma, 128, stream->width);
+    } else if (isValid) {
+        stream->pictureSize = (size_t) stream->width * stream->height * 4;
+    }
+
+    // The frames in flight are all the memory a stream ever needs
+    for (UInt frameIndex=0; isValid && frameIndex<PTERM_VIDEO_STREAM_BUFFERS; ++frameIndex) {
+        stream->frames[frameIndex] = (UChar*) malloc((size_t) stream->width * stream->height * 4);
+        isValid = stream->frames[frameIndex] != NULL;
+    }
+
+    if (isValid && stream->imageSize) {
+        isValid = _decodeStreamImage(stream, 0);
+        stream->numberOfFrames = 1;
+    }
+
+    #ifndef _WIN32
+    if (isValid) {
+        pthread_mutex_init(&stream->lock, NULL);
+        pthread_cond_init(&stream->condition, NULL);
+        stream->hasReader = pthread_create(&stream->reader, NULL, _videoStreamReader, stream) == 0;
+        isValid = stream->hasReader;
+        if (!isValid) {
+            pthread_cond_destroy(&stream->condition);
+            pthread_mutex_destroy(&stream->lock);
+        }
+    }
+    #endif
+
+    if (!isValid) {
+        PTERM_DEBUG_PRINTF("Failed to open a video stream (format %i)\n", format);
+        closeVideoStream(stream);
+        return NULL;
+    }
+
+    *width  = stream->width;
+    *height = stream->height;
+    return stream;
+}
+
+
+const UChar* acquireVideoFrame(VideoStream* stream)
+{
+    #ifdef _WIN32
+    // Frames are read on demand into the first slot
+    if (!stream->numberOfFrames && !stream->isEndOfStream) {
+        if (_readVideoFrame(stream, 0)) {
+            stream->numberOfFrames = 1;
+        } else {
+            stream->isEndOfStream = PTERM_TRUE;
+        }
+    }
+    return stream->numberOfFrames ? stream->frames[0] : NULL;
+    #else
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->numberOfFrames && !stream->isEndOfStream)
+        pthread_cond_wait(&stream->condition, &stream->lock);
+    const UChar* frame = stream->numberOfFrames ? stream->frames[stream->firstFrame] : NULL;
+    pthread_mutex_unlock(&stream->lock);
+    return frame;
+    #endif
+}
+
+
+UInt getNumberOfBufferedFrames(VideoStream* stream)
+{
+    #ifdef _WIN32
+    return 0;
+    #else
+    pthread_mutex_lock(&stream->lock);
+    const UInt numberOfFrames = stream->numberOfFrames ? stream->numberOfFrames - 1 : 0;
+    pthread_mutex_unlock(&stream->lock);
+    return numberOfFrames;
+    #endif
+}
+
+
+void releaseVideoFrame(VideoStream* stream)
+{
+    #ifdef _WIN32
+    stream->numberOfFrames = 0;
+    #else
+    pthread_mutex_lock(&stream->lock);
+    if (stream->numberOfFrames) {
+        stream->firstFrame = (stream->firstFrame + 1) % PTERM_VIDEO_STREAM_BUFFERS;
+        --stream->numberOfFrames;
+        pthread_cond_signal(&stream->condition);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    #endif
+}
+
+
+void closeVideoStream(VideoStream* stream)
+{
+    if (!stream)
+        return;
+
+    #ifndef _WIN32
+    if (stream->hasReader) {
+        pthread_cancel(stream->reader); // <-- takes effect if it is (or next) waiting for input
+        pthread_mutex_lock(&stream->lock);
+        stream->numberOfFrames = 0;     // <-- or wakes it up to read into a free slot
+        pthread_cond_signal(&stream->condition);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->reader, NULL);
+        pthread_cond_destroy(&stream->condition);
+        pthread_mutex_destroy(&stream->lock);
+    }
+    #endif
+
+    if (pipelineStats) {
+        pipelineStats->stageSeconds[PTERM_STAGE_READ]   += stream->readSeconds;
+        pipelineStats->stageCalls[PTERM_STAGE_READ]     += stream->numberOfReads;
+        pipelineStats->stageSeconds[PTERM_STAGE_DECODE] += stream->decodeSeconds;
+        pipelineStats->stageCalls[PTERM_STAGE_DECODE]   += stream->numberOfDecodes;
+        pipelineStats->bytesRead                        += stream->bytesRead;
+    }
+
+    for (UInt frameIndex=0; frameIndex<PTERM_VIDEO_STREAM_BUFFERS; ++frameIndex)
+        free(stream->frames[frameIndex]);
+    free(stream->fileBuffer);
+    free(stream->picture);
+    free(stream->neutralChroma);
+    free(stream->image);
+    free(stream);
+}
+
+
+/// --- PARALLEL GIF DECODING --- ///
+
+// A GIF frame is drawn over what the previous frames (and their disposal methods) left on the canvas, so
+// stbi_load_gif_from_memory decodes them one after the other. Frames that cover the whole canvas with opaque
+// pixels and keep it for the next frame (disposal 0 or 1) cut that dependency: the block structure is scanned
+// first (skipping the LZW data), the stream is split at such keyframes and the segments are decoded in parallel.
+// The frame decoder below mirrors stbi__gif_load_next, so the frames are the same as stb_image's.
+
+typedef struct
+{
+    Int        firstFrame;
+    Int        numberOfFrames;        // <-- up to the next segment
+    Int        numberOfDecodedFrames;
+    Bool       isIndependent;         // <-- cleared if the first frame turned out to show earlier frames
+    Int        offset;                // <-- of the first frame's image descriptor
+    stbi__gif* state;                 // <-- decoder state (palettes, transparency, delay) right before that descriptor
+} GIFSegment;
+
+
+typedef struct
+{
+    const UChar* data;
+    Int          size;
+    Int          width;
+    Int          height;
+    GIFSegment*  segments;
+    UChar*       frames;
+    Int*         frameDelaysMS;
+} GIFDecodeContext;
+
+
+/// Process extension blocks up to the next image descriptor the way stbi__gif_load_next does.
+/// @return 1 after an image separator, 0 at the trailer and -1 on corrupt data
+Int _readGIFExtensions(stbi__context* s, stbi__gif* g)
+{
+    for (;;) {
+        const Int tag = stbi__get8(s);
+        if (tag == 0x2C)
+            return 1;
+        if (tag == 0x3B)
+            return 0;
+        if (tag != 0x21)
+            return -1;
+
+        int length;
+        if (stbi__get8(s) == 0xF9) { // Graphic Control Extension
+            length = stbi__get8(s);
+            if (length != 4) {
+                stbi__skip(s, length);
+                continue; // <-- like stb_image, read the following sub-blocks as tags
+            }
+
+            g->eflags = stbi__get8(s);
+            g->delay = 10 * stbi__get16le(s);
+            if (0 <= g->transparent)
+                g->pal[g->transparent][3] = 255;
+            if (g->eflags & 0x01) {
+                g->transparent = stbi__get8(s);
+                g->pal[g->transparent][3] = 0;
+            } else {
+                stbi__skip(s, 1);
+                g->transparent = -1;
+            }
+        }
+
+        while ((length = stbi__get8(s)) != 0)
+            stbi__skip(s, length);
+    }
+}
+
+
+/// Read an image descriptor, its color table and its raster into g->out (or skip the raster).
+Bool _readGIFImage(stbi__context* s, stbi__gif* g, Bool isSkipped, Bool isFirstFrame)
+{
+    const Int x = stbi__get16le(s);
+    const Int y = stbi__get16le(s);
+    const Int w = stbi__get16le(s);
+    const Int h = stbi__get16le(s);
+    if (g->w < x + w || g->h < y + h)
+        return PTERM_FALSE;
+
+    g->line_size = g->w * 4;
+    g->start_x   = x * 4;
+    g->start_y   = y * g->line_size;
+    g->max_x     = g->start_x + w * 4;
+    g->max_y     = g->start_y + h * g->line_size;
+    g->cur_x     = g->start_x;
+    g->cur_y     = w ? g->start_y : g->max_y;
+
+    g->lflags = stbi__get8(s);
+    if (g->lflags & 0x40) {
+        g->step  = 8 * g->line_size;
+        g->parse = 3;
+    } else {
+        g->step  = g->line_size;
+        g->parse = 0;
+    }
+
+    if (g->lflags & 0x80) {
+        stbi__gif_parse_colortable(s, g->lpal, 2 << (g->lflags & 7), g->eflags & 0x01 ? g->transparent : -1);
+        g->color_table = (stbi_uc*) g->lpal;
+    } else if (g->flags & 0x80) {
+        g->color_table = (stbi_uc*) g->pal;
+    } else {
+        return PTERM_FALSE;
+    }
+
+    if (isSkipped) {
+        if (12 < stbi__get8(s)) // <-- LZW code size
+            return PTERM_FALSE;
+        for (Int length=stbi__get8(s); length; length=stbi__get8(s))
+            stbi__skip(s, length);
+        return PTERM_TRUE;
+    }
+
+    if (!stbi__process_gif_raster(s, g))
+        return PTERM_FALSE;
+
+    // Pixels the first frame does not draw get the background color
+    if (isFirstFrame && 0 < g->bgindex) {
+        const Int pixelCount = g->w * g->h;
+        for (Int pixelIndex=0; pixelIndex<pixelCount; ++pixelIndex) {
+            if (!g->history[pixelIndex]) {
+                g->pal[g->bgindex][3] = 255;
+                memcpy(g->out + 4 * pixelIndex, g->pal[g->bgindex], 4);
+            }
+        }
+    }
+
+    return PTERM_TRUE;
+}
+
+
+/// Apply the previous frame's disposal method to the canvas.
+void _disposeGIFFrame(stbi__gif* g, const UChar* twoBack)
+{
+    const Int pixelCount = g->w * g->h;
+    Int dispose = (g->eflags & 0x1C) >> 2;
+    if (dispose == 3 && !twoBack)
+        dispose = 2;
+
+    if (dispose == 2 || dispose == 3) {
+        const UChar* restore = dispose == 3 ? twoBack : g->background;
+        for (Int pixelIndex=0; pixelIndex<pixelCount; ++pixelIndex) {
+            if (g->history[pixelIndex])
+                memcpy(g->out + 4 * pixelIndex, restore + 4 * pixelIndex, 4);
+        }
+    }
+
+    memcpy(g->background, g->out, 4 * pixelCount);
+}
+
+
+void _decodeGIFSegment(void* p_context, UInt segmentIndex)
+{
+    GIFDecodeContext* context = (GIFDecodeContext*) p_context;
+    GIFSegment* segment       = context->segments + segmentIndex;
+    const size_t pixelCount   = (size_t) context->width * context->height;
+    const size_t frameSize    = 4 * pixelCount;
+
+    segment->numberOfDecodedFrames = 0;
+    segment->isIndependent         = PTERM_TRUE;
+
+    stbi__gif* g = (stbi__gif*) malloc(sizeof(stbi__gif));
+    if (!g)
+        return;
+    memcpy(g, segment->state, sizeof(stbi__gif));
+    g->out        = (stbi_uc*) calloc(frameSize, 1); // <-- transparent, so that undrawn pixels are detected
+    g->background = (stbi_uc*) calloc(frameSize, 1);
+    g->history    = (stbi_uc*) calloc(pixelCount, 1);
+
+    stbi__context s;
+    stbi__start_mem(&s, context->data, context->size);
+    s.img_buffer += segment->offset;
+
+    const Int endFrame = segment->firstFrame + segment->numberOfFrames;
+    for (Int frameIndex=segment->firstFrame; g->out && g->background && g->history && frameIndex<endFrame; ++frameIndex) {
+        if (frameIndex != segment->firstFrame) {
+            _disposeGIFFrame(g, 2 <= frameIndex ? context->frames + (frameIndex - 2) * frameSize : NULL);
+            memset(g->history, 0, pixelCount);
+            if (_readGIFExtensions(&s, g) != 1)
+                break;
+        }
+
+        if (!_readGIFImage(&s, g, PTERM_FALSE, frameIndex == 0))
+            break;
+
+        if (frameIndex == segment->firstFrame && frameIndex) {
+            for (size_t pixelIndex=0; pixelIndex<pixelCount; ++pixelIndex) {
+                if (g->out[4 * pixelIndex + 3] != 255) {
+                    PTERM_DEBUG_PRINTF("GIF frame %i is not a keyframe\n", frameIndex);
+                    segment->isIndependent = PTERM_FALSE;
+                    break;
+                }
+            }
+            if (!segment->isIndependent)
+                break;
+        }
+
+        memcpy(context->frames + frameIndex * frameSize, g->out, frameSize);
+        context->frameDelaysMS[frameIndex] = g->delay;
+        ++segment->numberOfDecodedFrames;
+    }
+
+    free(g->out);
+    free(g->background);
+    free(g->history);
+    free(g);
+}
+
+
+/// Decode every frame of an animated GIF as RGBA (like stbi_load_gif_from_memory), in parallel between keyframes.
+UChar* _loadGIF(const UChar* data, Int size, Int** frameDelaysMS, Int* width, Int* height, Int* numberOfFrames)
+{
+    *frameDelaysMS  = NULL;
+    *numberOfFrames = 0;
+
+    stbi__context s;
+    stbi__start_mem(&s, data, size);
+
+    stbi__gif* g = (stbi__gif*) calloc(1, sizeof(stbi__gif));
+    Int numberOfComponents;
+    if (!g || !stbi__gif_header(&s, g, &numberOfComponents, 0) || !stbi__mad3sizes_valid(4, g->w, g->h, 0)) {
+        free(g);
+        return NULL;
+    }
+    *width  = g->w;
+    *height = g->h;
+
+    // Scan: cut a segment at keyframes at least segmentSize bytes apart
+    const UInt numberOfThreads = getNumberOfThreads();
+    const Int segmentSize = 1 < numberOfThreads ? size / (Int)(numberOfThreads * PTERM_GIF_SEGMENTS_PER_THREAD) : size;
+
+    GIFSegment* segments = NULL;
+    Int numberOfSegments = 0;
+    Int frameCount       = 0;
+    Bool isValid         = PTERM_TRUE;
+    for (; isValid && _readGIFExtensions(&s, g) == 1; ++frameCount) {
+        const Int offset = (Int)(s.img_buffer - s.img_buffer_original);
+        const UChar* descriptor = s.img_buffer;
+
+        Bool isKeyframe = !frameCount;
+        if (!isKeyframe && segmentSize <= offset - segments[numberOfSegments-1].offset && 9 <= s.img_buffer_end - s.img_buffer) {
+            const Int x = descriptor[0] | (descriptor[1] << 8);
+            const Int y = descriptor[2] | (descriptor[3] << 8);
+            const Int w = descriptor[4] | (descriptor[5] << 8);
+            const Int h = descriptor[6] | (descriptor[7] << 8);
+            const Int dispose = (g->eflags & 0x1C) >> 2;
+            isKeyframe = !x && !y && w == g->w && h == g->h && dispose <= 1 && !(g->eflags & 0x01);
+        }
+
+        if (isKeyframe) {
+            GIFSegment* newSegments = (GIFSegment*) realloc(segments, (numberOfSegments + 1) * sizeof(GIFSegment));
+            stbi__gif* state = (stbi__gif*) malloc(sizeof(stbi__gif));
+            if (newSegments)
+                segments = newSegments;
+            if (!newSegments || !state) {
+                free(state);
+                isValid = PTERM_FALSE;
+                break;
+            }
+            memcpy(state, g, sizeof(stbi__gif));
+
+            GIFSegment* segment     = segments + numberOfSegments++;
+            segment->firstFrame     = frameCount;
+            segment->numberOfFrames = 0;
+            segment->offset         = offset;
+            segment->state          = state;
+        }
+
+        if (!_readGIFImage(&s, g, PTERM_TRUE, PTERM_FALSE))
+            break;
+        ++segments[numberOfSegments-1].numberOfFrames;
+    }
+    free(g);
+
+    const size_t frameSize = 4 * (size_t) *width * *height;
+    GIFDecodeContext context;
+    context.data          = data;
+    context.size          = size;
+    context.width         = *width;
+    context.height        = *height;
+    context.segments      = segments;
+    context.frames        = isValid && frameCount ? (UChar*) malloc(frameCount * frameSize) : NULL;
+    context.frameDelaysMS = context.frames ? (Int*) malloc(frameCount * sizeof(Int)) : NULL;
+
+    if (context.frameDelaysMS) {
+        PTERM_DEBUG_PRINTF("Decoding %i GIF frames in %i segments\n", frameCount, numberOfSegments);
+        parallelFor(numberOfSegments, _decodeGIFSegment, &context); // <-- serially when the GIF is decoded in a parallel task (gallery tiles)
+
+        // Frames stop at the first error; a segment that did not start at a keyframe is redone serially
+        Int segmentIndex = 0;
+        for (; segmentIndex<numberOfSegments; ++segmentIndex) {
+            if (!segments[segmentIndex].isIndependent || segments[segmentIndex].numberOfDecodedFrames < segments[segmentIndex].numberOfFrames)
+                break;
+        }
+        if (segmentIndex < numberOfSegments && !segments[segmentIndex].isIndependent) {
+            segments[0].numberOfFrames = frameCount;
+            _decodeGIFSegment(&context, 0);
+            segmentIndex = 0;
+        }
+
+        *numberOfFrames = segmentIndex < numberOfSegments ? segments[segmentIndex].firstFrame + segments[segmentIndex].numberOfDecodedFrames : frameCount;
+    }
+
+    for (Int segmentIndex=0; segmentIndex<numberOfSegments; ++segmentIndex)
+        free(segments[segmentIndex].state);
+    free(segments);
+
+    if (!*numberOfFrames) {
+        free(context.frames);
+        free(context.frameDelaysMS);
+        return NULL;
+    }
+
+    *frameDelaysMS = context.frameDelaysMS;
+    return context.frames;
+}
+
+
+/// --- IMAGE UTILITIES --- ///
+
+// Linear map: grayscale value -> ASCII character
+const UInt asciiIntensityTableSize = 15;
+const UChar asciiIntensityTable[] = { ' ', '.', ',', ':', ';', 'i', 'l', 't', 'f', 'L', 'C', 'G', '0', '8', '@' };
+
+UChar getASCIIFromGrayScale(UChar value)
+{
+    UInt key = ((asciiIntensityTableSize-1) * value) / 256;
+    return asciiIntensityTable[key];
+}
+
+
+UChar getASCIIFromRGB(UChar red, UChar green, UChar blue)
+{
+    return getASCIIFromGrayScale(0.2989*red + 0.587*green + 0.114*blue);
+}
+
+
+void fitImageSize(Int* width, Int* height, Int targetWidth, Int targetHeight)
+{
+    if (targetWidth < *width) {
+        *height = (targetWidth*(*height)) / (*width);
+        *width = targetWidth;
+    }
+    if (targetHeight < *height) {
+        *width = (targetHeight*(*width)) / (*height);
+        *height = targetHeight;
+    }
+}
+
+
+Int resizeImageRegion(const UChar* image,
+                      UChar* region,
+                      Int width,
+                      Int height,
+                      Int numberOfChannels,
+                      Int newWidth,
+                      Int newHeight,
+                      Int regionX,
+                      Int regionY,
+                      Int regionWidth,
+                      Int regionHeight,
+                      Int regionStride)
+{
+    const float scaleX = (float) newWidth / width;
+    const float scaleY = (float) newHeight / height;
+
+    // The default filters (Catmull-Rom up, Mitchell down) reach 2 pixels on the coarser side
+    const Int supportColumns = (Int) ceil(2.0f / (scaleX < 1.0f ? scaleX : 1.0f)) + 1;
+    const Int supportRows    = (Int) ceil(2.0f / (scaleY < 1.0f ? scaleY : 1.0f)) + 1;
+
+    // Map the region's edge pixel centers back to the input, then widen by the filter support
+    Int inputX0 = (Int) floor((regionX + 0.5) / scaleX - 0.5) - supportColumns;
+    Int inputX1 = (Int) ceil((regionX + regionWidth - 0.5) / scaleX - 0.5) + supportColumns + 1;
+    Int inputY0 = (Int) floor((regionY + 0.5) / scaleY - 0.5) - supportRows;
+    Int inputY1 = (Int) ceil((regionY + regionHeight - 0.5) / scaleY - 0.5) + supportRows + 1;
+    inputX0 = inputX0 < 0 ? 0 : inputX0;
+    inputY0 = inputY0 < 0 ? 0 : inputY0;
+    inputX1 = width < inputX1 ? width : inputX1;
+    inputY1 = height < inputY1 ? height : inputY1;
+
+    const Int stride = width * numberOfChannels;
+
+    // Same scale as the whole image, shifted so the region lands where it would in a single pass
+    // (stb maps input to output as out = in*scale - offset, in output pixels)
+    Int resizeResult = stbir_resize_subpixel(
+        image + (size_t) inputY0 * stride + (size_t) inputX0 * numberOfChannels, inputX1 - inputX0, inputY1 - inputY0, stride,
+        region, regionWidth, regionHeight, regionStride,
+        STBIR_TYPE_UINT8, numberOfChannels, STBIR_ALPHA_CHANNEL_NONE, 0,
+        STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP,
+        STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT,
+        STBIR_COLORSPACE_LINEAR, NULL,
+        scaleX, scaleY,
+        regionX - inputX0 * scaleX, regionY - inputY0 * scaleY
+    );
+
+    return resizeResult ? PTERM_SUCCESS : PTERM_FAIL;
+}
+
+
+typedef struct
+{
+    const UChar* image;
+    UChar*       newImage;
+    Int          width;
+    Int          height;
+    Int          numberOfChannels;
+    Int          newWidth;
+    Int          newHeight;
+    Int          rowsPerBand;
+    UChar*       bandResults;  // <-- nonzero once a band succeeded
+} ResizeBandContext;
+
+
+/// Resize output rows [rowsPerBand*bandIndex, rowsPerBand*(bandIndex+1)) from the input rows under the filter
+void _resizeBand(void* p_context, UInt bandIndex)
+{
+    ResizeBandContext* context = (ResizeBandContext*) p_context;
+
+    const Int outputBegin = bandIndex * context->rowsPerBand;
+    const Int outputEnd   = outputBegin + context->rowsPerBand < context->newHeight ? outputBegin + context->rowsPerBand : context->newHeight;
+    const Int newStride   = context->newWidth * context->numberOfChannels;
+
+    context->bandResults[bandIndex] = resizeImageRegion(context->image,
+                                                        context->newImage + (size_t) outputBegin * newStride,
+                                                        context->width,
+                                                        context->height,
+                                                        context->numberOfChannels,
+                                                        context->newWidth,
+                                                        context->newHeight,
+                                                        0,
+                                                        outputBegin,
+                                                        context->newWidth,
+                                                        outputEnd - outputBegin,
+                                                        newStride) == PTERM_SUCCESS;
+}
+
+
+Int resizeImage(const UChar* image, UChar* newImage, Int width, Int height, Int numberOfChannels, Int newWidth, Int newHeight)
+{
+    PTERM_DEBUG_PRINTF("Resizing image to %ix%i\n", newWidth, newHeight);
+
+    const double begin = beginStage();
+    Int resizeResult;
+
+    // Bands overlap by the filter support (see resizeImageRegion)
+    const float scaleY      = (float) newHeight / height;
+    const Int supportRows   = (Int) ceil(2.0f / (scaleY < 1.0f ? scaleY : 1.0f)) + 1;
+    const Int minimumRows   = (Int) ceil(PTERM_RESIZE_SUPPORT_RATIO * supportRows * scaleY);
+
+    const UInt numberOfThreads = getNumberOfThreads();
+    Int numberOfBands = numberOfThreads * PTERM_RESIZE_BANDS_PER_THREAD;
+    if (newHeight / minimumRows < numberOfBands)
+        numberOfBands = newHeight / minimumRows;
+
+    UChar* bandResults = NULL;
+    if (1 < numberOfThreads && 1 < numberOfBands && PTERM_PARALLEL_RESIZE_PIXELS <= (size_t) width * height)
+        bandResults = (UChar*) calloc(numberOfBands, 1);
+
+    if (bandResults) {
+        ResizeBandContext context;
+        context.image            = image;
+        context.newImage         = newImage;
+        context.width            = width;
+        context.height           = height;
+        context.numberOfChannels = numberOfChannels;
+        context.newWidth         = newWidth;
+        context.newHeight        = newHeight;
+        context.rowsPerBand      = (newHeight + numberOfBands - 1) / numberOfBands;
+        context.bandResults      = bandResults;
+
+        numberOfBands = (newHeight + context.rowsPerBand - 1) / context.rowsPerBand;
+        parallelFor(numberOfBands, _resizeBand, &context);
+
+        resizeResult = 1;
+        for (Int bandIndex=0; bandIndex<numberOfBands; ++bandIndex)
+            resizeResult &= bandResults[bandIndex];
+        free(bandResults);
+    } else {
+        resizeResult = stbir_resize_uint8(
+            image, width, height, 0,
+            newImage, newWidth, newHeight, 0, numberOfChannels
+        );
+    }
+    endStage(PTERM_STAGE_RESIZE, begin);
+
+    if (!resizeResult)
+    {
+        PTERM_DEBUG_PRINTF("Image resizing errored out (error %i)\n", resizeResult);
+        return PTERM_FAIL;
+    }
+
+    return PTERM_SUCCESS;
+}
+
+
+typedef struct
+{
+    const UChar* image;
+    UChar*       newImage;
+    Int          width;
+    Int          height;
+    Int          newWidth;
+    Int          numberOfChannels;
+} HalveImageContext;
+
+
+void _halveImageRow(void* p_context, UInt rowIndex)
+{
+    const HalveImageContext* context = (const HalveImageContext*) p_context;
+    const Int channels = context->numberOfChannels;
+    const Int stride   = context->width * channels;
+
+    // Odd edges repeat their last row or column
+    const UChar* top    = context->image + (size_t) 2 * rowIndex * stride;
+    const UChar* bottom = (Int)(2 * rowIndex + 1) < context->height ? top + stride : top;
+    UChar* destination  = context->newImage + (size_t) rowIndex * context->newWidth * channels;
+
+    for (Int columnIndex=0; columnIndex<context->newWidth; ++columnIndex) {
+        const Int left  = 2 * columnIndex * channels;
+        const Int right = 2 * columnIndex + 1 < context->width ? left + channels : left;
+        for (Int channel=0; channel<channels; ++channel) {
+            *destination++ = (top[left + channel] + top[right + channel] + bottom[left + channel] + bottom[right + channel] + 2) >> 2;
+        }
+    }
+}
+
+
+Int buildImagePyramid(ImagePyramid* pyramid, UChar* image, Int width, Int height, Int numberOfChannels)
+{
+    const double begin = beginStage();
+
+    pyramid->numberOfLevels   = 1;
+    pyramid->levels[0]        = image;
+    pyramid->widths[0]        = width;
+    pyramid->heights[0]       = height;
+    pyramid->numberOfChannels = numberOfChannels;
+
+    for (UInt level=1; level<sizeof(pyramid->levels)/sizeof(pyramid->levels[0]); ++level) {
+        const Int levelWidth  = pyramid->widths[level-1];
+        const Int levelHeight = pyramid->heights[level-1];
+        if (levelWidth <= 1 && levelHeight <= 1)
+            break;
+
+        HalveImageContext context;
+        context.image            = pyramid->levels[level-1];
+        context.width            = levelWidth;
+        context.height           = levelHeight;
+        context.newWidth         = (levelWidth + 1) / 2;
+        context.numberOfChannels = numberOfChannels;
+        context.newImage         = (UChar*) malloc((size_t) context.newWidth * ((levelHeight + 1) / 2) * numberOfChannels);
+
+        if (!context.newImage) {
+            PTERM_DEBUG_PRINTF("Failed to allocate level %u of an image pyramid\n", level);
+            freeImagePyramid(pyramid);
+            endStage(PTERM_STAGE_RESIZE, begin);
+            return PTERM_MEMORY_ERROR;
+        }
+
+        parallelFor((levelHeight + 1) / 2, _halveImageRow, &context);
+        pyramid->levels[level]  = context.newImage;
+        pyramid->widths[level]  = context.newWidth;
+        pyramid->heights[level] = (levelHeight + 1) / 2;
+        ++pyramid->numberOfLevels;
+    }
+
+    endStage(PTERM_STAGE_RESIZE, begin);
+    return PTERM_SUCCESS;
+}
+
+
+void freeImagePyramid(ImagePyramid* pyramid)
+{
+    for (UInt level=1; level<pyramid->numberOfLevels; ++level)
+        free(pyramid->levels[level]);
+    pyramid->numberOfLevels = 0;
+}
+
+
+/// Smallest level of a pyramid that covers an output size (level 0 if none does)
+UInt _getPyramidLevel(const ImagePyramid* pyramid, Int newWidth, Int newHeight)
+{
+    UInt level = pyramid->numberOfLevels - 1;
+    while (level && (pyramid->widths[level] < newWidth || pyramid->heights[level] < newHeight))
+        --level;
+    return level;
+}
+
+
+Int resizeImageFromPyramid(const ImagePyramid* pyramid, UChar* newImage, Int newWidth, Int newHeight)
+{
+    if (!pyramid->numberOfLevels)
+        return PTERM_FAIL;
+
+    const UInt level = _getPyramidLevel(pyramid, newWidth, newHeight);
+    PTERM_DEBUG_PRINTF("Resizing from pyramid level %u (%ix%i)\n", level, pyramid->widths[level], pyramid->heights[level]);
+    return resizeImage(pyramid->levels[level],
+                       newImage,
+                       pyramid->widths[level],
+                       pyramid->heights[level],
+                       pyramid->numberOfChannels,
+                       newWidth,
+                       newHeight);
+}
+
+
+Int resizeRegionFromPyramid(const ImagePyramid* pyramid,
+                            UChar* region,
+                            Int newWidth,
+                            Int newHeight,
+                            Int regionX,
+                            Int regionY,
+                            Int regionWidth,
+                            Int regionHeight,
+                            Int regionStride)
+{
+    if (!pyramid->numberOfLevels)
+        return PTERM_FAIL;
+
+    const UInt level = _getPyramidLevel(pyramid, newWidth, newHeight);
+    return resizeImageRegion(pyramid->levels[level],
+                             region,
+                             pyramid->widths[level],
+                             pyramid->heights[level],
+                             pyramid->numberOfChannels,
+                             newWidth,
+                             newHeight,
+                             regionX,
+                             regionY,
+                             regionWidth,
+                             regionHeight,
+                             regionStride);
+}
+
+
+typedef struct
+{
+    const UChar*        frames;
+    size_t              frameSize;
+    unsigned long long* hashes;
+} FrameHashContext;
+
+
+void _hashFrame(void* p_context, UInt frameIndex)
+{
+    const FrameHashContext* context = (const FrameHashContext*) p_context;
+    const UChar* frame = context->frames + frameIndex * context->frameSize;
+
+    // FNV-1a over 64-bit words (collisions are resolved by comparing the frames)
+    unsigned long long hash = 0xcbf29ce484222325ull;
+    size_t index = 0;
+    for (; index + sizeof(hash) <= context->frameSize; index += sizeof(hash)) {
+        unsigned long long word;
+        memcpy(&word, frame + index, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+
+    context->hashes[frameIndex] = _hashBytes(hash, frame + index, context->frameSize - index);
+}
+
+
+UInt findDuplicateFrames(const UChar* frames, UInt numberOfFrames, size_t frameSize, UInt* sources)
+{
+    FrameHashContext context;
+    context.frames    = frames;
+    context.frameSize = frameSize;
+    context.hashes    = (unsigned long long*) malloc(numberOfFrames * sizeof(unsigned long long));
+
+    for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex)
+        sources[frameIndex] = frameIndex;
+
+    if (!context.hashes)
+        return numberOfFrames; // <-- every frame is its own
+
+    parallelFor(numberOfFrames, _hashFrame, &context);
+
+    UInt numberOfDistinctFrames = 0;
+    for (UInt frameIndex=0; frameIndex<numberOfFrames; ++frameIndex) {
+        // Look back from the previous frame: repeats are most often consecutive
+        for (UInt otherIndex=frameIndex; otherIndex--; ) {
+            if (sources[otherIndex] == otherIndex
+                && context.hashes[otherIndex] == context.hashes[frameIndex]
+                && !memcmp(frames + otherIndex * frameSize, frames + frameIndex * frameSize, frameSize)) {
+                sources[frameIndex] = otherIndex;
+                break;
+            }
+        }
+        numberOfDistinctFrames += sources[frameIndex] == frameIndex;
+    }
+
+    free(context.hashes);
+    return numberOfDistinctFrames;
+}
+
+
+Int _convertImage(UChar** data,
+                  Int size,
+                  const Char* extension,
+                  Int* numberOfFrames,
+                  Int** frameDelaysMS,
+                  Int* width,
+                  Int* height,
+                  Int* numberOfOriginalChannels,
+                  Int* numberOfOutputChannels)
+{
+    // Init
+    *numberOfFrames           = 0;
+    *frameDelaysMS            = NULL;
+    *width                    = 0;
+    *height                   = 0;
+    *numberOfOriginalChannels = 0;
+
+    // Check file extension
+    Bool isGIF = PTERM_FALSE;
+    if (strcmp(extension, ".gif") == 0) {
+        isGIF = PTERM_TRUE;
+    }
+
+    // Set output channels
+    *numberOfOutputChannels = 4; // <-- Convert to RGBA no matter how many channels the input has
+
+    // Decode frames
+    if (isGIF == PTERM_TRUE) {
+        UChar* tmp = _loadGIF(
             *data,
             size,
             frameDelaysMS,
             width,
             height,
-            numberOfFrames,
-            numberOfOriginalChannels,
-            *numberOfOutputChannels
+            numberOfFrames
         );
+        *numberOfOriginalChannels = 4; // <-- like stb_image, GIFs always decode as RGBA
         free(*data);
         *data = tmp;
     } else { // isGIF
@@ -443,15 +4688,18 @@ Int convertImage(UChar** data,
         if (!*frameDelaysMS)
         {
             PTERM_DEBUG_PRINTF("Failed to allocate memory for frame delays (%ib)\n", 1);
-            exit(PTERM_MEMORY_ERROR);
+            free(*data);
+            *data = NULL;
+            return PTERM_MEMORY_ERROR;
         }
 
         (*frameDelaysMS)[0] = 0;
     } // !isGIF
 
     if (!*data) {
-        PTERM_DEBUG_PRINTF("Failed to load image from %s\n", fileName);
+        PTERM_DEBUG_PRINTF("Failed to decode %s image (%s)\n", extension, stbi_failure_reason());
         free(*frameDelaysMS);
+        *frameDelaysMS = NULL;
         return PTERM_INPUT_ERROR;
     }
 
@@ -459,6 +4707,8 @@ Int convertImage(UChar** data,
         PTERM_DEBUG_PRINTF("Empty image %ix%ix%i with %i frames\n", *width, *height, *numberOfOriginalChannels, *numberOfFrames);
         free(*data);
         free(*frameDelaysMS);
+        *data          = NULL;
+        *frameDelaysMS = NULL;
         return PTERM_INPUT_ERROR;
     }
 
@@ -470,6 +4720,103 @@ Int convertImage(UChar** data,
 }
 
 
+Int probeImage(const UChar* data, Int size, Int* width, Int* height, Int* numberOfChannels)
+{
+    *width = *height = *numberOfChannels = 0;
+    if (!stbi_info_from_memory(data, size, width, height, numberOfChannels))
+        return PTERM_FAIL;
+
+    if (*width <= 0 || *height <= 0 || PTERM_MAX_IMAGE_PIXELS / (UInt) *width < (UInt) *height) {
+        PTERM_DEBUG_PRINTF("Rejected a %ix%i image (more than %u pixels)\n", *width, *height, PTERM_MAX_IMAGE_PIXELS);
+        return PTERM_INPUT_ERROR;
+    }
+
+    return PTERM_SUCCESS;
+}
+
+
+Int convertImageScaled(UChar** data,
+                       Int size,
+                       const Char* extension,
+                       Int minimumWidth,
+                       Int minimumHeight,
+                       Int* numberOfFrames,
+                       Int** frameDelaysMS,
+                       Int* width,
+                       Int* height,
+                       Int* numberOfOriginalChannels,
+                       Int* numberOfOutputChannels)
+{
+    const double begin = beginStage();
+    Int result = PTERM_FAIL;
+
+    Int headerWidth = 0, headerHeight = 0, headerChannels = 0;
+    if (probeImage(*data, size, &headerWidth, &headerHeight, &headerChannels) == PTERM_INPUT_ERROR) {
+        free(*data);
+        *data          = NULL;
+        *frameDelaysMS = NULL;
+        endStage(PTERM_STAGE_DECODE, begin);
+        return PTERM_INPUT_ERROR;
+    }
+
+    // The probed dimensions select the scale of a JPEG (only its SOI marker is checked again)
+    stbi__context context;
+    stbi__start_mem(&context, *data, size);
+    const Bool isJPEG = (minimumWidth || minimumHeight) && stbi__jpeg_test(&context);
+    const Int scaleShift = isJPEG ? getJPEGScaleShift(headerWidth, headerHeight, minimumWidth, minimumHeight) : 0;
+    if (scaleShift) {
+        result = _convertJPEGReduced(data,
+                                     size,
+                                     scaleShift,
+                                     numberOfFrames,
+                                     frameDelaysMS,
+                                     width,
+                                     height,
+                                     numberOfOriginalChannels,
+                                     numberOfOutputChannels);
+    }
+
+    if (result != PTERM_SUCCESS && result != PTERM_MEMORY_ERROR) { // <-- full decode (or retry if the reduced one failed)
+        result = _convertImage(data,
+                               size,
+                               extension,
+                               numberOfFrames,
+                               frameDelaysMS,
+                               width,
+                               height,
+                               numberOfOriginalChannels,
+                               numberOfOutputChannels);
+    }
+
+    endStage(PTERM_STAGE_DECODE, begin);
+    return result;
+}
+
+
+Int convertImage(UChar** data,
+                 Int size,
+                 const Char* extension,
+                 Int* numberOfFrames,
+                 Int** frameDelaysMS,
+                 Int* width,
+                 Int* height,
+                 Int* numberOfOriginalChannels,
+                 Int* numberOfOutputChannels)
+{
+    return convertImageScaled(data,
+                              size,
+                              extension,
+                              0,
+                              0,
+                              numberOfFrames,
+                              frameDelaysMS,
+                              width,
+                              height,
+                              numberOfOriginalChannels,
+                              numberOfOutputChannels);
+}
+
+
 UChar* loadImageFile(const Char* fileName,
                      Int* numberOfFrames,
                      Int** frameDelaysMS,
@@ -504,8 +4851,8 @@ UChar* loadImageFile(const Char* fileName,
     );
 
     if (conversionOutput != PTERM_SUCCESS) {
-        puts("Failed to convert image");
-        exit(conversionOutput);
+        PTERM_DEBUG_PRINTF("Failed to convert %s (%i)\n", fileName, conversionOutput);
+        return NULL;
     }
 
     return data;
@@ -641,4 +4988,545 @@ void _textFromImageInMemory(const UChar* image,
     *cursor = '\0';
 }
 
+
+/// --- BLOCK CHARACTERS --- ///
+
+// Payload of a single block cell: foreground, background and a UTF-8 encoded character
+const Int blockCellSize = 2 * ansiColorSize + 4;
+
+// Quadrant characters indexed by their bit pattern (1: top left, 2: top right, 4: bottom left, 8: bottom right)
+const UInt quadrantCodePoints[] = {
+    0x0020, 0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+    0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588
+};
+
+
+void getCellResolution(Int renderMode, Int* columns, Int* rows)
+{
+    *columns = 1;
+    *rows    = 1;
+
+    if (renderMode == PTERM_RENDER_QUADRANT) {
+        *columns = 2;
+        *rows    = 2;
+    } else if (renderMode == PTERM_RENDER_SEXTANT) {
+        *columns = 2;
+        *rows    = 3;
+    } else if (renderMode == PTERM_RENDER_SHAPE) {
+        *columns = 4;
+        *rows    = 8;
+    }
+}
+
+
+/// Sextant bits are numbered row by row, starting at the top left subpixel.
+UInt getSextantCodePoint(UInt pattern)
+{
+    if (pattern == 0)  return 0x0020; // <-- empty
+    if (pattern == 21) return 0x258C; // <-- left half
+    if (pattern == 42) return 0x2590; // <-- right half
+    if (pattern == 63) return 0x2588; // <-- full block
+
+    // U+1FB00..U+1FB3B skip the patterns that already exist as half blocks
+    return 0x1FB00 + pattern - 1 - (21 < pattern) - (42 < pattern);
+}
+
+
+/// @note destination must have at least 4 bytes
+Int encodeUTF8(UInt codePoint, UChar* destination)
+{
+    if (codePoint < 0x80) {
+        destination[0] = (UChar) codePoint;
+        return 1;
+    } else if (codePoint < 0x800) {
+        destination[0] = 0xC0 | (codePoint >> 6);
+        destination[1] = 0x80 | (codePoint & 0x3F);
+        return 2;
+    } else if (codePoint < 0x10000) {
+        destination[0] = 0xE0 | (codePoint >> 12);
+        destination[1] = 0x80 | ((codePoint >> 6) & 0x3F);
+        destination[2] = 0x80 | (codePoint & 0x3F);
+        return 3;
+    }
+
+    destination[0] = 0xF0 | (codePoint >> 18);
+    destination[1] = 0x80 | ((codePoint >> 12) & 0x3F);
+    destination[2] = 0x80 | ((codePoint >> 6) & 0x3F);
+    destination[3] = 0x80 | (codePoint & 0x3F);
+    return 4;
+}
+
+
+void allocateBlockTextImage(UChar** textImage,
+                            UInt* size,
+                            UInt width,
+                            UInt height)
+{
+    *textImage = NULL;
+    *size =
+        width * height * blockCellSize      // <-- payload (two ANSI colors and a character)
+        + height * (ansiColorResetSize + 1) // <-- new line and color reset at line ends
+        + 1;                                // <-- \0
+    *textImage = (UChar*) malloc(*size);
+
+    if (!*textImage)
+    {
+        PTERM_DEBUG_PRINTF("Failed to allocate memory for block text image (%ib)\n", *size);
+        *size = 0;
+    }
+}
+
+
+// Pattern lookup tables for the two-color fit. Only patterns that leave the last
+// subpixel in the background group are evaluated, since swapping the groups of a
+// pattern yields the same error.
+#define PTERM_MAX_CELL_SUBPIXELS 6
+#define PTERM_MAX_CELL_PATTERNS  32
+
+typedef struct
+{
+    Int   numberOfSubpixels;
+    Int   numberOfPatterns;
+    float masks[PTERM_MAX_CELL_SUBPIXELS][PTERM_MAX_CELL_PATTERNS]; // <-- all bits set where the subpixel is in the foreground group
+    float inverseForegroundCount[PTERM_MAX_CELL_PATTERNS];          // <-- 0 for the single-color pattern
+    float inverseBackgroundCount[PTERM_MAX_CELL_PATTERNS];
+} BlockPatternTable;
+
+
+void initializeBlockPatternTable(BlockPatternTable* table, Int numberOfSubpixels)
+{
+    UInt allBits = 0xFFFFFFFF;
+    float allBitsFloat;
+    memcpy(&allBitsFloat, &allBits, sizeof(float));
+
+    table->numberOfSubpixels = numberOfSubpixels;
+    table->numberOfPatterns  = 1 << (numberOfSubpixels - 1);
+
+    for (Int pattern=0; pattern<table->numberOfPatterns; ++pattern) {
+        Int foregroundCount = 0;
+        for (Int subpixel=0; subpixel<numberOfSubpixels; ++subpixel) {
+            Bool isSet = (pattern >> subpixel) & 1;
+            table->masks[subpixel][pattern] = isSet ? allBitsFloat : 0.0f;
+            foregroundCount += isSet;
+        }
+        table->inverseForegroundCount[pattern] = foregroundCount ? 1.0f / foregroundCount : 0.0f;
+        table->inverseBackgroundCount[pattern] = 1.0f / (numberOfSubpixels - foregroundCount);
+    }
+}
+
+
+/** @brief Find the two-color partition of a cell with the least squared error
+ *  @details For a partition into groups A and B, the squared error equals
+ *           sum(|p|^2) - |sum_A(p)|^2/n_A - |sum_B(p)|^2/n_B, so the best pattern
+ *           maximizes the last two terms. All patterns are scored at once.
+ *  @return the best pattern (bits set for subpixels in the foreground group)
+ */
+UInt fitBlockPattern(const BlockPatternTable* table, const float* red, const float* green, const float* blue)
+{
+    float totalRed = 0.0f, totalGreen = 0.0f, totalBlue = 0.0f;
+    for (Int subpixel=0; subpixel<table->numberOfSubpixels; ++subpixel) {
+        totalRed   += red[subpixel];
+        totalGreen += green[subpixel];
+        totalBlue  += blue[subpixel];
+    }
+
+    float scores[PTERM_MAX_CELL_PATTERNS];
+
+    #ifdef PTERM_SSE2
+    const __m128 vTotalRed   = _mm_set1_ps(totalRed);
+    const __m128 vTotalGreen = _mm_set1_ps(totalGreen);
+    const __m128 vTotalBlue  = _mm_set1_ps(totalBlue);
+
+    for (Int pattern=0; pattern<table->numberOfPatterns; pattern+=4) {
+        __m128 sumRed = _mm_setzero_ps(), sumGreen = _mm_setzero_ps(), sumBlue = _mm_setzero_ps();
+        for (Int subpixel=0; subpixel<table->numberOfSubpixels; ++subpixel) {
+            __m128 mask = _mm_loadu_ps(table->masks[subpixel] + pattern);
+            sumRed   = _mm_add_ps(sumRed,   _mm_and_ps(mask, _mm_set1_ps(red[subpixel])));
+            sumGreen = _mm_add_ps(sumGreen, _mm_and_ps(mask, _mm_set1_ps(green[subpixel])));
+            sumBlue  = _mm_add_ps(sumBlue,  _mm_and_ps(mask, _mm_set1_ps(blue[subpixel])));
+        }
+
+        __m128 restRed   = _mm_sub_ps(vTotalRed, sumRed);
+        __m128 restGreen = _mm_sub_ps(vTotalGreen, sumGreen);
+        __m128 restBlue  = _mm_sub_ps(vTotalBlue, sumBlue);
+
+        __m128 foreground = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sumRed, sumRed), _mm_mul_ps(sumGreen, sumGreen)), _mm_mul_ps(sumBlue, sumBlue));
+        __m128 background = _mm_add_ps(_mm_add_ps(_mm_mul_ps(restRed, restRed), _mm_mul_ps(restGreen, restGreen)), _mm_mul_ps(restBlue, restBlue));
+
+        __m128 score = _mm_add_ps(_mm_mul_ps(foreground, _mm_loadu_ps(table->inverseForegroundCount + pattern)),
+                                  _mm_mul_ps(background, _mm_loadu_ps(table->inverseBackgroundCount + pattern)));
+        _mm_storeu_ps(scores + pattern, score);
+    }
+    #else
+    for (Int pattern=0; pattern<table->numberOfPatterns; ++pattern) {
+        float sumRed = 0.0f, sumGreen = 0.0f, sumBlue = 0.0f;
+        for (Int subpixel=0; subpixel<table->numberOfSubpixels; ++subpixel) {
+            if ((pattern >> subpixel) & 1) {
+                sumRed   += red[subpixel];
+                sumGreen += green[subpixel];
+                sumBlue  += blue[subpixel];
+            }
+        }
+
+        float restRed = totalRed - sumRed, restGreen = totalGreen - sumGreen, restBlue = totalBlue - sumBlue;
+        scores[pattern] = (sumRed*sumRed + sumGreen*sumGreen + sumBlue*sumBlue) * table->inverseForegroundCount[pattern]
+                        + (restRed*restRed + restGreen*restGreen + restBlue*restBlue) * table->inverseBackgroundCount[pattern];
+    }
+    #endif
+
+    UInt bestPattern = 0;
+    for (Int pattern=1; pattern<table->numberOfPatterns; ++pattern) {
+        if (scores[bestPattern] < scores[pattern])
+            bestPattern = pattern;
+    }
+
+    return bestPattern;
+}
+
+
+typedef struct
+{
+    const UChar*      image;
+    UChar*            destination;
+    UInt*             rowSizes;
+    UInt              rowCapacity;
+    UInt              width;
+    UInt              numberOfChannels;
+    Int               renderMode;
+    Int               cellColumns;
+    Int               cellRows;
+    BlockPatternTable table;
+} BlockRowContext;
+
+
+void _blockTextRow(void* p_context, UInt rowIndex)
+{
+    const BlockRowContext* context = (const BlockRowContext*) p_context;
+
+    const Int cellColumns   = context->cellColumns;
+    const Int cellRows      = context->cellRows;
+    const UInt imageWidth   = context->width * cellColumns;
+    const UInt channels     = context->numberOfChannels;
+    UChar* cursor           = context->destination + rowIndex * context->rowCapacity;
+    const UChar* rowBegin   = cursor;
+
+    float red[PTERM_MAX_CELL_SUBPIXELS], green[PTERM_MAX_CELL_SUBPIXELS], blue[PTERM_MAX_CELL_SUBPIXELS];
+
+    for (UInt columnIndex=0; columnIndex<context->width; ++columnIndex) {
+        // Gather subpixels
+        Int subpixel = 0;
+        UInt alpha = 0;
+        for (Int subRow=0; subRow<cellRows; ++subRow) {
+            const UChar* pixel = context->image
+                               + ((rowIndex * cellRows + subRow) * imageWidth + columnIndex * cellColumns) * channels;
+            for (Int subColumn=0; subColumn<cellColumns; ++subColumn, ++subpixel, pixel+=channels) {
+                red[subpixel]   = pixel[0];
+                green[subpixel] = pixel[1];
+                blue[subpixel]  = pixel[2];
+                alpha          += pixel[3];
+            }
+        }
+
+        if (!alpha) { // fully transparent cell
+            ansiPadding(cursor);
+            cursor += ansiColorSize;
+            *cursor++ = ' ';
+            continue;
+        }
+
+        // Fit colors
+        UInt pattern = fitBlockPattern(&context->table, red, green, blue);
+
+        float foreground[3] = {0.0f, 0.0f, 0.0f}, background[3] = {0.0f, 0.0f, 0.0f};
+        Int foregroundCount = 0;
+        for (subpixel=0; subpixel<context->table.numberOfSubpixels; ++subpixel) {
+            float* group = ((pattern >> subpixel) & 1) ? foreground : background;
+            group[0] += red[subpixel];
+            group[1] += green[subpixel];
+            group[2] += blue[subpixel];
+            foregroundCount += (pattern >> subpixel) & 1;
+        }
+
+        float backgroundScale = 1.0f / (context->table.numberOfSubpixels - foregroundCount);
+        for (Int component=0; component<3; ++component)
+            background[component] = background[component] * backgroundScale + 0.5f;
+
+        if (foregroundCount) {
+            float foregroundScale = 1.0f / foregroundCount;
+            for (Int component=0; component<3; ++component)
+                foreground[component] = foreground[component] * foregroundScale + 0.5f;
+        } else { // single color
+            memcpy(foreground, background, sizeof(foreground));
+        }
+
+        // Encode
+        ansiColorCode((UChar)foreground[0], (UChar)foreground[1], (UChar)foreground[2], cursor, PTERM_FALSE);
+        cursor += ansiColorSize;
+        ansiColorCode((UChar)background[0], (UChar)background[1], (UChar)background[2], cursor, PTERM_TRUE);
+        cursor += ansiColorSize;
+
+        UInt codePoint = context->renderMode == PTERM_RENDER_QUADRANT ? quadrantCodePoints[pattern] : getSextantCodePoint(pattern);
+        cursor += encodeUTF8(codePoint, cursor);
+    } // for columnIndex
+
+    ansiReset(cursor);
+    cursor += ansiColorResetSize;
+    *cursor++ = '\n';
+
+    context->rowSizes[rowIndex] = (UInt)(cursor - rowBegin);
+}
+
+
+UInt getBlockRowCapacity(UInt width)
+{
+    return width * blockCellSize + ansiColorResetSize + 1;
+}
+
+
+UInt _blockTextRowsFromImageInMemory(const UChar* image,
+                                     UChar* destination,
+                                     UInt* rowSizes,
+                                     UInt width,
+                                     UInt height,
+                                     UInt numberOfChannels,
+                                     Int renderMode)
+{
+    BlockRowContext context;
+    context.image            = image;
+    context.destination      = destination;
+    context.rowSizes         = rowSizes;
+    context.rowCapacity      = getBlockRowCapacity(width);
+    context.width            = width;
+    context.numberOfChannels = numberOfChannels;
+    context.renderMode       = renderMode;
+    getCellResolution(renderMode, &context.cellColumns, &context.cellRows);
+    initializeBlockPatternTable(&context.table, context.cellColumns * context.cellRows);
+
+    // Rows are encoded into fixed-size slots in parallel
+    parallelFor(height, _blockTextRow, &context);
+
+    UInt size = 0;
+    for (UInt rowIndex=0; rowIndex<height; ++rowIndex)
+        size += rowSizes[rowIndex];
+
+    return size;
+}
+
+
+UInt _blockTextFromImageInMemory(const UChar* image,
+                                 UChar* destination,
+                                 UInt width,
+                                 UInt height,
+                                 UInt numberOfChannels,
+                                 Int renderMode)
+{
+    UInt* rowSizes = (UInt*) malloc(height * sizeof(UInt));
+    if (!rowSizes) {
+        PTERM_DEBUG_PRINTF("Failed to allocate memory for row sizes (%lub)\n", height * sizeof(UInt));
+        exit(PTERM_MEMORY_ERROR);
+    }
+
+    _blockTextRowsFromImageInMemory(image, destination, rowSizes, width, height, numberOfChannels, renderMode);
+
+    // Compact the rows into a contiguous string
+    const UInt rowCapacity = getBlockRowCapacity(width);
+    UChar* cursor = destination;
+    for (UInt rowIndex=0; rowIndex<height; ++rowIndex) {
+        memmove(cursor, destination + rowIndex * rowCapacity, rowSizes[rowIndex]);
+        cursor += rowSizes[rowIndex];
+    }
+    *cursor = '\0';
+
+    free(rowSizes);
+    return (UInt)(cursor - destination);
+}
+
+
+/// --- SHAPE MATCHING --- ///
+
+// Coverage masks of the printable ASCII characters (' '..'~') on a 4x8 grid.
+// Bit (4*row + column) is set if the subpixel is covered, rows start at the top.
+// The last entry pads the table to a multiple of 4 and never wins (ties go to ' ').
+#define PTERM_GLYPH_COUNT 95
+
+const UInt glyphMasks[PTERM_GLYPH_COUNT + 1] = {
+    0x00000000, 0x02022222, 0x00000055, 0x00575750, 0x027861E2, 0x09D22459, 0x0A5D5252, 0x00000022,
+    0x04211124, 0x01244421, 0x00527250, 0x00027200, 0x12200000, 0x00007000, 0x02000000, 0x01122488,
+    0x0699BD96, 0x07222232, 0x0F124896, 0x07886887, 0x044F5564, 0x0698871F, 0x06997116, 0x0222448F,
+    0x06996996, 0x0688E996, 0x00200200, 0x12200200, 0x00421240, 0x00070700, 0x00124210, 0x02024896,
+    0x0615DD96, 0x0999F996, 0x07997997, 0x06911196, 0x07999997, 0x0F11711F, 0x0111711F, 0x0E99D196,
+    0x0999F999, 0x07222227, 0x0698888C, 0x09531359, 0x0F111111, 0x09999FF9, 0x099DDBB9, 0x06999996,
+    0x01117997, 0x869D9996, 0x09957997, 0x0788611E, 0x0222222F, 0x06999999, 0x06699999, 0x09FF9999,
+    0x09966699, 0x02222699, 0x0F12248F, 0x07111117, 0x08842211, 0x07444447, 0x00000052, 0xF0000000,
+    0x00000021, 0x0E9E8600, 0x07999711, 0x0E111E00, 0x0E999E88, 0x0E1F9600, 0x022272A4, 0x68E99E00,
+    0x09999711, 0x07222302, 0x34444604, 0x09535911, 0x07222223, 0x099DDB00, 0x09999700, 0x06999600,
+    0x11799700, 0x88E99E00, 0x01113D00, 0x07861E00, 0x0C222722, 0x0E999900, 0x06699900, 0x06FF9900,
+    0x09666900, 0x68E99900, 0x0F124F00, 0x04221224, 0x22222222, 0x01224221, 0x00005A00,
+    0x00000000
+};
+
+// Cells with a smaller luminance range are drawn by intensity only
+const Int shapeContrastThreshold = 48;
+
+
+/// @return index of the glyph with the least differing subpixels
+UInt matchGlyph(UInt mask)
+{
+    #ifdef PTERM_SSE2
+    const __m128i vMask  = _mm_set1_epi32((Int) mask);
+    const __m128i m1     = _mm_set1_epi32(0x55555555);
+    const __m128i m2     = _mm_set1_epi32(0x33333333);
+    const __m128i m4     = _mm_set1_epi32(0x0F0F0F0F);
+    const __m128i m6     = _mm_set1_epi32(0x3F);
+    const __m128i stride = _mm_set1_epi32(4);
+    __m128i indices      = _mm_set_epi32(3, 2, 1, 0);
+    __m128i best         = _mm_set1_epi32(0x7FFFFFFF);
+
+    for (UInt glyphIndex=0; glyphIndex<PTERM_GLYPH_COUNT; glyphIndex+=4, indices=_mm_add_epi32(indices, stride)) {
+        // Population count of the differing bits in each lane
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(glyphMasks + glyphIndex)), vMask);
+        x = _mm_sub_epi32(x, _mm_and_si128(_mm_srli_epi32(x, 1), m1));
+        x = _mm_add_epi32(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi32(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi32(x, _mm_srli_epi32(x, 4)), m4);
+        x = _mm_add_epi32(x, _mm_srli_epi32(x, 8));
+        x = _mm_and_si128(_mm_add_epi32(x, _mm_srli_epi32(x, 16)), m6);
+
+        // Keep the minimum of (distance, index) pairs
+        __m128i key  = _mm_or_si128(_mm_slli_epi32(x, 8), indices);
+        __m128i less = _mm_cmplt_epi32(key, best);
+        best = _mm_or_si128(_mm_and_si128(less, key), _mm_andnot_si128(less, best));
+    }
+
+    UInt keys[4];
+    _mm_storeu_si128((__m128i*) keys, best);
+    UInt bestKey = keys[0];
+    for (Int lane=1; lane<4; ++lane) {
+        if (keys[lane] < bestKey)
+            bestKey = keys[lane];
+    }
+    return bestKey & 0xFF;
+    #else
+    UInt bestIndex = 0, bestDistance = 33;
+    for (UInt glyphIndex=0; glyphIndex<PTERM_GLYPH_COUNT; ++glyphIndex) {
+        UInt x = glyphMasks[glyphIndex] ^ mask;
+        UInt distance = 0;
+        for (; x; x&=x-1) ++distance;
+
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            bestIndex    = glyphIndex;
+        }
+    }
+    return bestIndex;
+    #endif
+}
+
+
+typedef struct
+{
+    const UChar* image;
+    UChar*       destination;
+    UInt         width;
+    UInt         numberOfChannels;
+} ShapeRowContext;
+
+
+void _shapeTextRow(void* p_context, UInt rowIndex)
+{
+    const ShapeRowContext* context = (const ShapeRowContext*) p_context;
+
+    const UInt imageWidth = context->width * 4;
+    const UInt channels   = context->numberOfChannels;
+    UChar* cursor         = context->destination + rowIndex * (context->width * (ansiColorSize + 1) + ansiColorResetSize + 1);
+
+    UChar luminance[32];
+
+    for (UInt columnIndex=0; columnIndex<context->width; ++columnIndex) {
+        // Gather subpixels
+        UInt sum[3] = {0, 0, 0}, alpha = 0;
+        Int minimum = 255, maximum = 0;
+        for (Int subRow=0; subRow<8; ++subRow) {
+            const UChar* pixel = context->image + ((rowIndex * 8 + subRow) * imageWidth + columnIndex * 4) * channels;
+            for (Int subColumn=0; subColumn<4; ++subColumn, pixel+=channels) {
+                Int value = (77*pixel[0] + 150*pixel[1] + 29*pixel[2]) >> 8;
+                luminance[4*subRow + subColumn] = (UChar) value;
+                if (value < minimum) minimum = value;
+                if (maximum < value) maximum = value;
+                sum[0] += pixel[0];
+                sum[1] += pixel[1];
+                sum[2] += pixel[2];
+                alpha  += pixel[3];
+            }
+        }
+
+        if (!alpha) { // fully transparent cell
+            ansiPadding(cursor);
+            cursor += ansiColorSize;
+            *cursor++ = ' ';
+            continue;
+        }
+
+        UChar red = (UChar)(sum[0] / 32), green = (UChar)(sum[1] / 32), blue = (UChar)(sum[2] / 32);
+        UChar character;
+
+        if (maximum - minimum < shapeContrastThreshold) {
+            character = getASCIIFromRGB(red, green, blue);
+        } else {
+            // Bright subpixels are the glyph's 'ink' on a dark terminal
+            const Int threshold = (minimum + maximum) / 2;
+            UInt mask = 0;
+            UInt ink[3] = {0, 0, 0}, inkCount = 0;
+            for (Int subpixel=0; subpixel<32; ++subpixel) {
+                if (threshold < luminance[subpixel]) {
+                    mask |= 1u << subpixel;
+                    ++inkCount;
+                }
+            }
+
+            for (Int subRow=0; subRow<8; ++subRow) {
+                const UChar* pixel = context->image + ((rowIndex * 8 + subRow) * imageWidth + columnIndex * 4) * channels;
+                for (Int subColumn=0; subColumn<4; ++subColumn, pixel+=channels) {
+                    if ((mask >> (4*subRow + subColumn)) & 1) {
+                        ink[0] += pixel[0];
+                        ink[1] += pixel[1];
+                        ink[2] += pixel[2];
+                    }
+                }
+            }
+
+            red       = (UChar)(ink[0] / inkCount);
+            green     = (UChar)(ink[1] / inkCount);
+            blue      = (UChar)(ink[2] / inkCount);
+            character = (UChar)(' ' + matchGlyph(mask));
+        }
+
+        ansiColorCode(red, green, blue, cursor, PTERM_FALSE);
+        cursor += ansiColorSize;
+        *cursor++ = character;
+    } // for columnIndex
+
+    ansiReset(cursor);
+    cursor += ansiColorResetSize;
+    *cursor = '\n';
+}
+
+
+void _shapeTextFromImageInMemory(const UChar* image,
+                                 UChar* destination,
+                                 UInt width,
+                                 UInt height,
+                                 UInt numberOfChannels)
+{
+    ShapeRowContext context;
+    context.image            = image;
+    context.destination      = destination;
+    context.width            = width;
+    context.numberOfChannels = numberOfChannels;
+
+    // Rows have a fixed size, so they can be written in place
+    parallelFor(height, _shapeTextRow, &context);
+
+    destination[height * (width * (ansiColorSize + 1) + ansiColorResetSize + 1)] = '\0';
+}
+
 #endif // PTERM_IMPLEMENTATION
\ No newline at end of file